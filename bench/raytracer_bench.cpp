@@ -0,0 +1,446 @@
+// Benchmarks of the renderer's hot paths and of whole renders.
+//
+//     raytracer_bench [-o results.json] [-b name_filter] [-t seconds_per_benchmark] [-j threads]
+//
+// Every workload is seeded, so the numbers of two builds (or two commits) can be compared directly.
+// The results are written as JSON to standard output or to the -o file; a readable table goes to stderr.
+
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "scenes.h"
+#include "sphere.h"
+#include "sphere_batch.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using bench_clock = std::chrono::steady_clock;
+
+// Keeps the compiler from optimizing away a result that is never used
+template <class T>
+inline void keep(const T& value) {
+#if defined(__GNUC__)
+    asm volatile("" : : "g"(&value) : "memory");
+#else
+    static volatile const void* sink;
+    sink = &value;
+#endif
+}
+
+struct micro_result {
+    std::string name;
+    long long ops;              // Operations timed in the best repetition
+    double ns_per_op;           // Best of the repetitions
+    double median_ns_per_op;
+};
+
+struct render_result {
+    std::string name;
+    std::string integrator;
+    int width, height, samples_per_pixel, threads;
+    double seconds;
+    long long rays;             // Rays traced into the scene: camera rays and every bounce
+    std::string image_hash;     // Changes whenever the rendered image does
+};
+
+struct bench_options {
+    std::string filter;         // Only benchmarks whose name contains this run
+    double seconds = 0.2;       // Time spent on each repetition of a microbenchmark
+    int threads = 0;            // Render threads (0 = every hardware core)
+};
+
+bool selected(const bench_options& options, const std::string& name) {
+    return options.filter.empty() || name.find(options.filter) != std::string::npos;
+}
+
+// Times op(k) for k = 0, 1, 2, ... The batch size is grown until one batch takes options.seconds;
+// then five batches are timed and the best and the median time per operation are reported.
+template <class Op>
+micro_result run_micro(const std::string& name, const bench_options& options, Op&& op) {
+    auto time_batch = [&](long long count) {
+        auto start = bench_clock::now();
+        for (long long k = 0; k < count; k++)
+            op(k);
+        return std::chrono::duration<double>(bench_clock::now() - start).count();
+    };
+
+    long long batch = 1000;
+    while (time_batch(batch) < options.seconds && batch < (1LL << 40))
+        batch *= 2;
+
+    std::vector<double> ns;
+    for (int repetition = 0; repetition < 5; repetition++)
+        ns.push_back(time_batch(batch) * 1e9 / batch);
+    std::sort(ns.begin(), ns.end());
+
+    micro_result result = {name, batch, ns.front(), ns[ns.size() / 2]};
+    clog << "  " << name << ": " << result.ns_per_op << " ns/op\n";
+    return result;
+}
+
+// Rays through a box around the origin, so every scene object has a chance to be hit
+std::vector<ray> random_rays(int count, real extent) {
+    std::vector<ray> rays;
+    for (int k = 0; k < count; k++)
+        rays.emplace_back(point3::random(-extent, extent), random_unit_vector());
+    return rays;
+}
+
+void run_micro_benchmarks(const bench_options& options, std::vector<micro_result>& results) {
+    const int input_count = 4096;           // Inputs are generated up front and cycled, a power of two
+    const int input_mask = input_count - 1;
+    auto add = [&](const std::string& name, auto&& op) {
+        if (selected(options, name))
+            results.push_back(run_micro(name, options, op));
+    };
+
+    clog << "Microbenchmarks\n";
+    thread_rng() = pcg32();
+
+    add("random_double", [](long long) { keep(random_double()); });
+    add("random_unit_vector", [](long long) { keep(random_unit_vector()); });
+    add("random_in_unit_disk", [](long long) { keep(random_in_unit_disk()); });
+
+    // Starting a camera sample and drawing its pixel position, with each sampler
+    for (const char* name : {"independent", "stratified", "sobol", "bluenoise"}) {
+        auto s = make_sampler(name, 64);
+        add(std::string("sampler_") + name, [&](long long k) {
+            s->start_sample(int(k & 255), int((k >> 8) & 255), int((k >> 16) & 63), 0);
+            sample2 u = s->get_2d();
+            keep(u.x + u.y);
+        });
+    }
+
+    // sphere::hit with rays that all hit and rays that all miss the unit sphere
+    sphere ball(point3(0,0,0), 1, 0);
+    std::vector<ray> hitting, missing;
+    for (int k = 0; k < input_count; k++) {
+        point3 origin = 5 * random_unit_vector();
+        point3 target = 0.5 * random_unit_vector();
+        hitting.emplace_back(origin, target - origin);
+        missing.emplace_back(origin, cross(origin, random_unit_vector()));  // Perpendicular to the way to the sphere
+    }
+    add("sphere_hit_hit", [&](long long k) {
+        hit_record rec;
+        keep(ball.hit(hitting[k & input_mask], interval(ray_t_min, infinity), rec));
+        keep(rec);
+    });
+    add("sphere_hit_miss", [&](long long k) {
+        hit_record rec;
+        keep(ball.hit(missing[k & input_mask], interval(ray_t_min, infinity), rec));
+    });
+
+    // Lists of separate sphere objects, the structure of the original renderer, next to the batched
+    // spheres and the BVH that replace it
+    auto rays = random_rays(input_count, 4);
+    for (int size : {1, 16, 256, 4096}) {
+        hittable_list list;
+        sphere_batch batch;
+        for (int k = 0; k < size; k++) {
+            point3 center = vec3::random(-4, 4);
+            real radius = random_double(0.05, 0.3);
+            list.add(make_shared<sphere>(center, radius, 0));
+            batch.add(center, radius, 0);
+        }
+        auto suffix = "_" + std::to_string(size);
+        add("hittable_list_hit" + suffix, [&](long long k) {
+            hit_record rec;
+            keep(list.hit(rays[k & input_mask], interval(ray_t_min, infinity), rec));
+        });
+        add("sphere_batch_hit" + suffix, [&](long long k) {
+            hit_record rec;
+            keep(batch.hit(rays[k & input_mask], interval(ray_t_min, infinity), rec));
+        });
+        if (size >= 256) {
+            bvh_node tree(batch.split(8));
+            add("bvh_hit" + suffix, [&](long long k) {
+                hit_record rec;
+                keep(tree.hit(rays[k & input_mask], interval(ray_t_min, infinity), rec));
+            });
+            // Bringing the tree up to date after objects moved (frame sequences): refit in place or build anew
+            add("bvh_refit" + suffix, [&](long long) { tree.refit(); });
+            add("bvh_rebuild" + suffix, [&](long long) { tree.rebuild(); });
+
+            // The same tree with its leaf batches and their arrays stored together in an arena
+            scene_arena arena;
+            bvh_node arena_tree(batch.split(8, &arena));
+            add("bvh_arena_hit" + suffix, [&](long long k) {
+                hit_record rec;
+                keep(arena_tree.hit(rays[k & input_mask], interval(ray_t_min, infinity), rec));
+            });
+        }
+    }
+
+    // triangle_mesh::hit on sphere meshes, with the best SIMD kernel and with the scalar one
+    for (int rings : {16, 256}) {
+        triangle_mesh mesh(sphere_mesh(rings, 2 * rings), 0);
+        auto suffix = "_" + std::to_string(mesh.triangle_count());
+        add("triangle_mesh_hit" + suffix, [&](long long k) {
+            hit_record rec;
+            keep(mesh.hit(hitting[k & input_mask], interval(ray_t_min, infinity), rec));
+        });
+        mesh.level = simd_level::scalar;
+        add("triangle_mesh_scalar_hit" + suffix, [&](long long k) {
+            hit_record rec;
+            keep(mesh.hit(hitting[k & input_mask], interval(ray_t_min, infinity), rec));
+        });
+    }
+
+    // Each material scattering rays that arrive at a fixed surface point from random directions
+    hit_record rec;
+    rec.p = point3(0,0,0);
+    rec.normal = vec3(0,1,0);
+    rec.front_face = true;
+    rec.t = 1;
+    rec.p_error = hit_point_error(rec.p, 1);
+    std::vector<ray> incoming;
+    for (int k = 0; k < input_count; k++) {
+        vec3 from = random_unit_vector();
+        from = vec3(from.x(), std::fabs(from.y()) + real(0.01), from.z());
+        incoming.emplace_back(from, -from);
+    }
+    std::pair<const char*, material> materials[] = {
+        {"scatter_lambertian", lambertian(color(0.5, 0.5, 0.5))},
+        {"scatter_metal", metal(color(0.8, 0.8, 0.8), 0.3)},
+        {"scatter_dielectric", dielectric(1.5)},
+    };
+    for (const auto& entry : materials) {
+        const material& mat = entry.second;
+        add(entry.first, [&](long long k) {
+            color attenuation;
+            ray scattered;
+            keep(scatter(mat, incoming[k & input_mask], rec, attenuation, scattered));
+            keep(scattered);
+        });
+    }
+}
+
+// Passes every query on to the scene and counts them. Each thread counts into its own slot,
+// so counting adds no contention between the render threads.
+class counting_hittable : public hittable {
+    public:
+        explicit counting_hittable(const hittable& world) : world(world), id(next_id++) {}
+
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            counter()++;
+            return world.hit(r, ray_t, rec);
+        }
+
+        aabb bounding_box() const override { return world.bounding_box(); }
+
+        long long count() const {
+            std::lock_guard<std::mutex> lock(mutex);
+            long long total = 0;
+            for (const auto& c : counters) total += *c;
+            return total;
+        }
+
+    private:
+        const hittable& world;
+        int id;
+        mutable std::mutex mutex;
+        mutable std::vector<std::unique_ptr<long long>> counters;
+        static inline std::atomic<int> next_id{0};
+
+        long long& counter() const {
+            thread_local int owner = -1;                // Which counting_hittable `slot` belongs to
+            thread_local long long* slot = nullptr;
+            if (owner != id) {
+                std::lock_guard<std::mutex> lock(mutex);
+                counters.push_back(std::make_unique<long long>(0));
+                slot = counters.back().get();
+                owner = id;
+            }
+            return *slot;
+        }
+};
+
+// FNV-1a hash of the 8-bit image
+std::string image_hash(const framebuffer& image) {
+    std::ostringstream bytes;
+    image.write(bytes, image_format::p6);
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (unsigned char c : bytes.str()) {
+        hash ^= c;
+        hash *= 0x100000001b3ULL;
+    }
+    std::ostringstream text;
+    text << std::hex << hash;
+    return text.str();
+}
+
+void run_render_benchmarks(const bench_options& options, std::vector<render_result>& results) {
+    struct scene_setup {
+        std::string name;
+        hittable_list world;
+        material_table materials;
+        camera cam;
+    };
+    std::vector<scene_setup> scenes(3);
+
+    // The final scene of the book, seen from the book's camera
+    scenes[0].name = "book_final";
+    thread_rng() = pcg32();
+    random_spheres_scene(scenes[0].world, scenes[0].materials);
+    scenes[0].cam.aspect_ratio = 16.0 / 9.0;
+    scenes[0].cam.image_width = 400;
+    scenes[0].cam.samples_per_pixel = 16;
+    scenes[0].cam.max_depth = 50;
+    scenes[0].cam.vfov = 20;
+    scenes[0].cam.lookfrom = point3(12,2,3);
+    scenes[0].cam.lookat = point3(0,0,0);
+
+    // Ten thousand small spheres behind a BVH
+    scenes[1].name = "sphere_cloud_10k";
+    thread_rng() = pcg32();
+    sphere_cloud_scene(scenes[1].world, scenes[1].materials, 10000);
+    scenes[1].cam.aspect_ratio = 16.0 / 9.0;
+    scenes[1].cam.image_width = 320;
+    scenes[1].cam.samples_per_pixel = 16;
+    scenes[1].cam.max_depth = 16;
+    scenes[1].cam.vfov = 50;
+    scenes[1].cam.lookfrom = point3(0,0,12);
+    scenes[1].cam.lookat = point3(0,0,0);
+
+    // A million spheres as 1024 transformed copies of one 1000-sphere cloud
+    scenes[2].name = "instanced_clouds_1m";
+    thread_rng() = pcg32();
+    instanced_clouds_scene(scenes[2].world, scenes[2].materials, 32, 1000);
+    scenes[2].cam.aspect_ratio = 16.0 / 9.0;
+    scenes[2].cam.image_width = 320;
+    scenes[2].cam.samples_per_pixel = 16;
+    scenes[2].cam.max_depth = 16;
+    scenes[2].cam.vfov = 40;
+    scenes[2].cam.lookfrom = point3(40,14,40);
+    scenes[2].cam.lookat = point3(0,0,0);
+
+    clog << "Renders\n";
+    for (auto& scene : scenes) {
+        // The wavefront integrator runs with and without sorting the rays of every bounce; the images are the same
+        struct { integrator_type integrator; bool sort_rays; const char* name; } integrators[] = {
+            {integrator_type::recursive, false, "recursive"},
+            {integrator_type::wavefront, false, "wavefront"},
+            {integrator_type::wavefront, true, "wavefront_sorted"}};
+        for (const auto& integrator : integrators) {
+            std::string integrator_name = integrator.name;
+            std::string name = "render_" + scene.name + "_" + integrator_name;
+            if (!selected(options, name)) continue;
+
+            camera& cam = scene.cam;
+            cam.integrator = integrator.integrator;
+            cam.sort_rays = integrator.sort_rays;
+            cam.num_threads = options.threads;
+            counting_hittable counted(scene.world);
+            framebuffer image;
+
+            auto* log = clog.rdbuf(nullptr);        // Silences the progress output of the render
+            auto start = bench_clock::now();
+            cam.render(counted, scene.materials, image);
+            double seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+            clog.rdbuf(log);
+
+            render_result result;
+            result.name = name;
+            result.integrator = integrator_name;
+            result.width = image.width();
+            result.height = image.height();
+            result.samples_per_pixel = cam.samples_per_pixel;
+            result.threads = options.threads > 0 ? options.threads : int(std::max(1u, std::thread::hardware_concurrency()));
+            result.seconds = seconds;
+            result.rays = counted.count();
+            result.image_hash = image_hash(image);
+            results.push_back(result);
+
+            clog << "  " << name << ": " << result.rays / seconds * 1e-6 << " Mrays/s, "
+                 << double(result.width) * result.height * result.samples_per_pixel / seconds << " samples/s\n";
+        }
+    }
+}
+
+std::string json_string(const std::string& s) {
+    std::string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') out += '\\';
+        if (c == '\n') { out += "\\n"; continue; }
+        out += c;
+    }
+    return out + "\"";
+}
+
+void write_json(std::ostream& out, const bench_options& options, const std::vector<micro_result>& micro,
+                const std::vector<render_result>& renders) {
+    const char* levels[] = {"scalar", "sse2", "avx2"};
+    out << "{\n";
+    out << "  \"precision\": " << json_string(sizeof(real) == sizeof(float) ? "float" : "double") << ",\n";
+    out << "  \"simd\": " << json_string(levels[int(detect_simd_level())]) << ",\n";
+#if defined(__VERSION__)
+    out << "  \"compiler\": " << json_string(__VERSION__) << ",\n";
+#endif
+    out << "  \"seconds_per_repetition\": " << options.seconds << ",\n";
+
+    out << "  \"micro\": [";
+    for (size_t k = 0; k < micro.size(); k++) {
+        const auto& m = micro[k];
+        out << (k ? ",\n" : "\n") << "    {\"name\": " << json_string(m.name) << ", \"ns_per_op\": " << m.ns_per_op
+            << ", \"median_ns_per_op\": " << m.median_ns_per_op << ", \"ops_per_second\": " << 1e9 / m.ns_per_op
+            << ", \"ops\": " << m.ops << "}";
+    }
+    out << (micro.empty() ? "],\n" : "\n  ],\n");
+
+    out << "  \"render\": [";
+    for (size_t k = 0; k < renders.size(); k++) {
+        const auto& r = renders[k];
+        double samples = double(r.width) * r.height * r.samples_per_pixel;
+        out << (k ? ",\n" : "\n") << "    {\"name\": " << json_string(r.name) << ", \"integrator\": " << json_string(r.integrator)
+            << ", \"width\": " << r.width << ", \"height\": " << r.height << ", \"samples_per_pixel\": " << r.samples_per_pixel
+            << ", \"threads\": " << r.threads << ", \"seconds\": " << r.seconds << ", \"rays\": " << r.rays
+            << ", \"mrays_per_second\": " << r.rays / r.seconds * 1e-6 << ", \"samples_per_second\": " << samples / r.seconds
+            << ", \"image_hash\": " << json_string(r.image_hash) << "}";
+    }
+    out << (renders.empty() ? "]\n" : "\n  ]\n");
+    out << "}\n";
+}
+
+int main(int argc, char* argv[]) {
+    bench_options options;
+    std::string output_path;
+    for (int k = 1; k + 1 < argc; k += 2) {
+        if (strcmp(argv[k], "-o") == 0) output_path = argv[k+1];
+        else if (strcmp(argv[k], "-b") == 0) options.filter = argv[k+1];
+        else if (strcmp(argv[k], "-t") == 0) options.seconds = atof(argv[k+1]);
+        else if (strcmp(argv[k], "-j") == 0) options.threads = atoi(argv[k+1]);
+        else {
+            cerr << "Unknown option " << argv[k]
+                 << "\nUsage: raytracer_bench [-o results.json] [-b name_filter] [-t seconds_per_benchmark] [-j threads]\n";
+            return 1;
+        }
+    }
+
+    std::vector<micro_result> micro;
+    std::vector<render_result> renders;
+    run_micro_benchmarks(options, micro);
+    run_render_benchmarks(options, renders);
+
+    if (output_path.empty()) {
+        write_json(std::cout, options, micro, renders);
+    } else {
+        std::ofstream out(output_path);
+        write_json(out, options, micro, renders);
+        if (!out) {
+            clog << "Could not write " << output_path << '\n';
+            return 1;
+        }
+    }
+    return 0;
+}
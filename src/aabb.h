@@ -0,0 +1,99 @@
+#ifndef AABB_H
+#define AABB_H
+
+#include "rtweekend.h"
+
+// Axis-aligned bounding box: one interval per axis
+class aabb {
+    public:
+        interval x, y, z;
+
+        aabb() {}   // The default box is empty, since intervals are empty by default
+
+        aabb(const interval& x, const interval& y, const interval& z) : x(x), y(y), z(z) {}
+
+        aabb(const point3& a, const point3& b) {
+            // Treats the two points a and b as extrema for the bounding box, so the order does not matter
+            x = (a[0] <= b[0]) ? interval(a[0], b[0]) : interval(b[0], a[0]);
+            y = (a[1] <= b[1]) ? interval(a[1], b[1]) : interval(b[1], a[1]);
+            z = (a[2] <= b[2]) ? interval(a[2], b[2]) : interval(b[2], a[2]);
+        }
+
+        aabb(const aabb& box0, const aabb& box1) {      // Smallest box enclosing both boxes
+            x = interval(box0.x, box1.x);
+            y = interval(box0.y, box1.y);
+            z = interval(box0.z, box1.z);
+        }
+
+        const interval& axis_interval(int n) const {
+            if (n == 1) return y;
+            if (n == 2) return z;
+            return x;
+        }
+
+        bool is_empty() const {
+            return x.min > x.max || y.min > y.max || z.min > z.max;
+        }
+
+        point3 centroid() const {
+            return point3(0.5*(x.min + x.max), 0.5*(y.min + y.max), 0.5*(z.min + z.max));
+        }
+
+        int longest_axis() const {      // Index of the axis with the longest side
+            if (x.size() > y.size())
+                return x.size() > z.size() ? 0 : 2;
+            else
+                return y.size() > z.size() ? 1 : 2;
+        }
+
+        real surface_area() const {     // Used by the surface area heuristic: the chance a random ray hits the box grows with its area
+            if (is_empty()) return 0;
+            auto dx = x.size(), dy = y.size(), dz = z.size();
+            return 2 * (dx*dy + dy*dz + dz*dx);
+        }
+
+        bool hit(const ray& r, interval ray_t) const {      // Slab test: the ray hits the box if its t ranges inside all three slabs overlap
+            const point3& ray_orig = r.origin();
+            const vec3&   ray_dir  = r.direction();
+
+            for (int axis = 0; axis < 3; axis++) {
+                const interval& ax = axis_interval(axis);
+                const real adinv = 1 / ray_dir[axis];
+
+                auto t0 = (ax.min - ray_orig[axis]) * adinv;
+                auto t1 = (ax.max - ray_orig[axis]) * adinv;
+
+                if (t0 > t1) std::swap(t0, t1);
+                if (t0 > ray_t.min) ray_t.min = t0;
+                if (t1 < ray_t.max) ray_t.max = t1;
+
+                if (ray_t.max <= ray_t.min)
+                    return false;
+            }
+            return true;
+        }
+
+        static const aabb empty, universe;
+};
+
+const aabb aabb::empty    = aabb(interval::empty,    interval::empty,    interval::empty);
+const aabb aabb::universe = aabb(interval::universe, interval::universe, interval::universe);
+
+// Position of p along a Morton (Z-order) curve through box, 10 bits per axis: points close to each other in
+// space mostly get codes close to each other. Points outside the box count as on its nearest side.
+inline uint32_t morton_code(const point3& p, const aabb& box) {
+    auto spread = [](uint32_t v) {          // Puts two zero bits between the 10 bits of v
+        v = (v | (v << 16)) & 0x030000FF;
+        v = (v | (v <<  8)) & 0x0300F00F;
+        v = (v | (v <<  4)) & 0x030C30C3;
+        v = (v | (v <<  2)) & 0x09249249;
+        return v;
+    };
+    auto cell = [](double x, const interval& range) {
+        double u = range.size() > 0 ? (x - range.min) / range.size() : 0;
+        return uint32_t(std::fmin(std::fmax(u * 1024, 0.0), 1023.0));
+    };
+    return (spread(cell(p.x(), box.x)) << 2) | (spread(cell(p.y(), box.y)) << 1) | spread(cell(p.z(), box.z));
+}
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef ADAPTIVE_SAMPLING_H
+#define ADAPTIVE_SAMPLING_H
+
+#include "framebuffer.h"
+
+#include <algorithm>
+#include <vector>
+
+// Running statistics of the samples of one pixel, used to decide when the pixel has converged.
+// The mean and variance are tracked on luminance with Welford's online algorithm.
+struct pixel_stats {
+    int n = 0;                  // Samples taken so far (also the index of the next sample)
+    double mean = 0;            // Mean luminance of the samples
+    double m2 = 0;              // Sum of squared differences from the mean
+    color sum = color(0,0,0);   // Sum of the sample colors
+    bool done = false;          // Converged or reached the maximum sample count
+
+    void add(const color& sample) {
+        sum += sample;
+        double lum = 0.2126*sample.x() + 0.7152*sample.y() + 0.0722*sample.z();
+        n++;
+        double delta = lum - mean;
+        mean += delta / n;
+        m2 += delta * (lum - mean);
+    }
+
+    // Half-width of the 95% confidence interval of the mean, relative to the mean.
+    // The small constant keeps almost-black pixels from needing endless samples.
+    double relative_error() const {
+        if (n < 2) return infinity;
+        double variance = m2 / (n - 1);
+        return 1.96 * std::sqrt(variance / n) / (mean + 1e-3);
+    }
+};
+
+// Debug image of how many samples every pixel received: black = none, white = max_spp
+inline framebuffer spp_map(const std::vector<pixel_stats>& stats, int width, int height, int max_spp) {
+    framebuffer map(width, height);
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            double x = double(stats[size_t(j) * width + i].n) / std::max(max_spp, 1);
+            map.add(i, j, color(x, x, x), 1);
+        }
+    }
+    return map;
+}
+
+#endif
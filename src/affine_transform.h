@@ -0,0 +1,124 @@
+#ifndef AFFINE_TRANSFORM_H
+#define AFFINE_TRANSFORM_H
+
+#include "aabb.h"
+
+#include <cmath>
+#include <utility>
+
+// Affine transform p -> m p + t, kept together with its inverse so that both directions cost one
+// matrix-vector product. Transforms are combined with *, which applies the right operand first.
+class affine_transform {
+    public:
+        affine_transform() : m{{1,0,0},{0,1,0},{0,0,1}}, inv{{1,0,0},{0,1,0},{0,0,1}} {}      // Identity
+
+        static affine_transform translate(const vec3& offset) {
+            affine_transform x;
+            x.t = offset;
+            x.inv_t = -offset;
+            return x;
+        }
+
+        static affine_transform scale(real s) { return scale(vec3(s, s, s)); }
+
+        static affine_transform scale(const vec3& s) {        // Factors must not be 0
+            affine_transform x;
+            for (int k = 0; k < 3; k++) {
+                x.m[k][k] = s[k];
+                x.inv[k][k] = 1 / s[k];
+            }
+            return x;
+        }
+
+        static affine_transform rotate(const vec3& axis, double degrees) {     // Counterclockwise, looking down the axis
+            vec3 a = unit_vector(axis);
+            double theta = degrees_to_radians(degrees);
+            real c = real(std::cos(theta)), s = real(std::sin(theta)), d = 1 - c;
+            affine_transform x;
+            real r[3][3] = {                            // Rodrigues' rotation formula
+                {c + a[0]*a[0]*d,        a[0]*a[1]*d - a[2]*s,   a[0]*a[2]*d + a[1]*s},
+                {a[1]*a[0]*d + a[2]*s,   c + a[1]*a[1]*d,        a[1]*a[2]*d - a[0]*s},
+                {a[2]*a[0]*d - a[1]*s,   a[2]*a[1]*d + a[0]*s,   c + a[2]*a[2]*d},
+            };
+            for (int row = 0; row < 3; row++) {
+                for (int col = 0; col < 3; col++) {
+                    x.m[row][col] = r[row][col];
+                    x.inv[col][row] = r[row][col];      // A rotation's inverse is its transpose
+                }
+            }
+            return x;
+        }
+
+        affine_transform operator*(const affine_transform& first) const {    // `first`, then this
+            affine_transform x;
+            x.m_times(m, first.m, x.m);
+            x.m_times(first.inv, inv, x.inv);
+            x.t = apply_point(first.t);
+            x.inv_t = first.apply_inverse_point(inv_t);
+            return x;
+        }
+
+        affine_transform inverse() const {
+            affine_transform x = *this;
+            std::swap(x.m, x.inv);
+            std::swap(x.t, x.inv_t);
+            return x;
+        }
+
+        point3 apply_point(const point3& p) const { return times(m, p) + t; }
+        vec3 apply_vector(const vec3& v) const { return times(m, v); }
+
+        point3 apply_inverse_point(const point3& p) const { return times(inv, p) + inv_t; }
+        vec3 apply_inverse_vector(const vec3& v) const { return times(inv, v); }
+
+        // Normals stay perpendicular to the surface under the inverse transpose (not normalized)
+        vec3 apply_normal(const vec3& n) const {
+            return vec3(inv[0][0]*n[0] + inv[1][0]*n[1] + inv[2][0]*n[2],
+                        inv[0][1]*n[0] + inv[1][1]*n[1] + inv[2][1]*n[2],
+                        inv[0][2]*n[0] + inv[1][2]*n[1] + inv[2][2]*n[2]);
+        }
+
+        // Box around the transformed box (Arvo, "Transforming Axis-Aligned Bounding Boxes", 1990)
+        aabb apply_box(const aabb& box) const {
+            if (box.is_empty()) return box;
+            real lo[3], hi[3];
+            for (int row = 0; row < 3; row++) {
+                lo[row] = hi[row] = t[row];
+                for (int col = 0; col < 3; col++) {
+                    const interval& range = box.axis_interval(col);
+                    real a = m[row][col] * range.min, b = m[row][col] * range.max;
+                    lo[row] += std::fmin(a, b);
+                    hi[row] += std::fmax(a, b);
+                }
+            }
+            return aabb(interval(lo[0], hi[0]), interval(lo[1], hi[1]), interval(lo[2], hi[2]));
+        }
+
+        // How much the transform can stretch a length at most (the largest absolute row sum of m)
+        real max_stretch() const {
+            real result = 0;
+            for (int row = 0; row < 3; row++)
+                result = std::fmax(result, std::fabs(m[row][0]) + std::fabs(m[row][1]) + std::fabs(m[row][2]));
+            return result;
+        }
+
+    private:
+        real m[3][3];
+        vec3 t;
+        real inv[3][3];
+        vec3 inv_t;
+
+        static vec3 times(const real a[3][3], const vec3& v) {
+            return vec3(a[0][0]*v[0] + a[0][1]*v[1] + a[0][2]*v[2],
+                        a[1][0]*v[0] + a[1][1]*v[1] + a[1][2]*v[2],
+                        a[2][0]*v[0] + a[2][1]*v[1] + a[2][2]*v[2]);
+        }
+
+        static void m_times(const real a[3][3], const real b[3][3], real out[3][3]) {
+            for (int row = 0; row < 3; row++)
+                for (int col = 0; col < 3; col++)
+                    out[row][col] = a[row][0]*b[0][col] + a[row][1]*b[1][col] + a[row][2]*b[2][col];
+        }
+};
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include "affine_transform.h"
+#include "camera.h"
+#include "instance.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Frame sequences: camera parameters and instance placements given at some frames (keys) and interpolated
+// linearly in between. Before the first key and after the last one a value stays as it is at that key.
+
+inline double interpolate(double a, double b, double u) { return a + u * (b - a); }
+inline vec3 interpolate(const vec3& a, const vec3& b, double u) { return a + real(u) * (b - a); }
+
+// Where an instance is: turned about the y axis, scaled and moved
+struct placement {
+    vec3 offset;
+    double scale = 1;
+    double yaw = 0;         // Degrees, counterclockwise seen from above
+
+    affine_transform to_transform() const {
+        return affine_transform::translate(offset) * affine_transform::rotate(vec3(0,1,0), yaw)
+             * affine_transform::scale(real(scale));
+    }
+};
+
+inline placement interpolate(const placement& a, const placement& b, double u) {
+    return {interpolate(a.offset, b.offset, u), interpolate(a.scale, b.scale, u), interpolate(a.yaw, b.yaw, u)};
+}
+
+template <class T>
+class keyframe_track {
+    public:
+        void add(double frame, const T& value) {
+            auto next = std::upper_bound(keys.begin(), keys.end(), frame,
+                                         [](double f, const key& k) { return f < k.frame; });
+            keys.insert(next, {frame, value});
+        }
+
+        bool empty() const { return keys.empty(); }
+
+        T at(double frame) const {              // The track must not be empty
+            if (frame <= keys.front().frame) return keys.front().value;
+            if (frame >= keys.back().frame) return keys.back().value;
+            auto next = std::upper_bound(keys.begin(), keys.end(), frame,
+                                         [](double f, const key& k) { return f < k.frame; });
+            auto prev = next - 1;
+            return interpolate(prev->value, next->value, (frame - prev->frame) / (next->frame - prev->frame));
+        }
+
+    private:
+        struct key {
+            double frame;
+            T value;
+        };
+        std::vector<key> keys;      // By frame
+};
+
+class scene_animation {
+    public:
+        keyframe_track<vec3> lookfrom, lookat;
+        keyframe_track<double> vfov, focus_dist;
+        std::vector<keyframe_track<placement>> placements;     // By instance; an empty track leaves its instance alone
+
+        keyframe_track<placement>& placement_track(int instance) {
+            if (int(placements.size()) <= instance) placements.resize(size_t(instance) + 1);
+            return placements[size_t(instance)];
+        }
+
+        // Sets the animated camera parameters to their values at frame
+        void apply_camera(double frame, camera& cam) const {
+            if (!lookfrom.empty())   cam.lookfrom = lookfrom.at(frame);
+            if (!lookat.empty())     cam.lookat = lookat.at(frame);
+            if (!vfov.empty())       cam.vfov = vfov.at(frame);
+            if (!focus_dist.empty()) cam.focus_dist = focus_dist.at(frame);
+        }
+
+        // Moves the animated instances to where they are at frame and brings the top-level BVH up to date.
+        // Returns true if the BVH had to be rebuilt rather than refitted.
+        bool apply_instances(double frame, instance_set& instances) const {
+            bool moved = false;
+            for (size_t k = 0; k < placements.size() && int(k) < instances.size(); k++) {
+                if (placements[k].empty()) continue;
+                instances.set_transform(int(k), placements[k].at(frame).to_transform());
+                moved = true;
+            }
+            return moved && instances.update();
+        }
+};
+
+// Path of one frame of a sequence: the frame number goes before the extension ("out.ppm" -> "out_0007.ppm")
+inline std::string frame_path(const std::string& path, int frame) {
+    char number[16];
+    std::snprintf(number, sizeof number, "_%04d", frame);
+    auto dot = path.find_last_of('.');
+    auto slash = path.find_last_of('/');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return path + number;
+    return path.substr(0, dot) + number + path.substr(dot);
+}
+
+#endif
@@ -0,0 +1,296 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "render_stats.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Bounding volume hierarchy over arbitrary hittables.
+// The tree is built once with the surface area heuristic (SAH) and stored as a flat array of nodes in
+// depth-first order: the left child of a node always sits right after it, so only the right child index is stored.
+// Rays visit the nearer child first and shrink their interval on every hit, so far subtrees are skipped.
+class bvh_node : public hittable {
+    public:
+        bvh_node(const hittable_list& list) : bvh_node(list.objects) {}
+
+        bvh_node(const std::vector<shared_ptr<hittable>>& objects, int max_leaf_size = 4)
+          : max_leaf_size(std::max(max_leaf_size, 1))
+        {
+            std::vector<build_item> items;
+            items.reserve(objects.size());
+            for (const auto& object : objects) {
+                auto box = object->bounding_box();
+                items.push_back({box, box.centroid(), object});
+            }
+
+            nodes.reserve(2 * items.size());
+            primitives.reserve(items.size());
+            if (!items.empty())
+                build(items, 0, int(items.size()), 0);
+            built_cost = sah_cost();
+        }
+
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            if (nodes.empty()) return false;
+
+            const point3& orig = r.origin();
+            const vec3& dir = r.direction();
+            vec3 inv_dir(1.0 / dir.x(), 1.0 / dir.y(), 1.0 / dir.z());
+
+            real t_entry;
+            if (!hit_box(nodes[0].bbox, orig, inv_dir, ray_t, t_entry))
+                return false;
+
+            struct stack_entry { int node; real t_entry; };
+            stack_entry stack[max_depth + 1];       // One entry per level at most, and build caps the depth
+            int stack_size = 0;
+            stack[stack_size++] = {0, t_entry};
+
+            hit_record temp_rec;
+            bool hit_anything = false;
+
+            while (stack_size > 0) {
+                auto entry = stack[--stack_size];
+                if (entry.t_entry >= ray_t.max)     // A closer hit was found after this node was pushed
+                    continue;
+
+                int index = entry.node;
+                while (true) {
+                    const flat_node& node = nodes[index];
+
+                    if (node.count > 0) {           // Leaf: test its primitives
+                        for (int i = node.offset; i < node.offset + node.count; i++) {
+                            if (primitives[i]->hit(r, ray_t, temp_rec)) {
+                                hit_anything = true;
+                                ray_t.max = temp_rec.t;     // Everything behind this hit can be ignored from now on
+                                rec = temp_rec;
+                            }
+                        }
+                        break;
+                    }
+
+                    int left = index + 1;
+                    int right = node.offset;
+                    real t_left = 0, t_right = 0;
+                    bool hit_left = hit_box(nodes[left].bbox, orig, inv_dir, ray_t, t_left);
+                    bool hit_right = hit_box(nodes[right].bbox, orig, inv_dir, ray_t, t_right);
+
+                    if (hit_left && hit_right) {
+                        // Go to the nearer child now and come back to the farther one later
+                        if (t_right < t_left) {
+                            std::swap(left, right);
+                            std::swap(t_left, t_right);
+                        }
+                        stack[stack_size++] = {right, t_right};
+                        index = left;
+                    } else if (hit_left) {
+                        index = left;
+                    } else if (hit_right) {
+                        index = right;
+                    } else {
+                        break;
+                    }
+                }
+            }
+
+            return hit_anything;
+        }
+
+        aabb bounding_box() const override {
+            return nodes.empty() ? aabb::empty : nodes[0].bbox;
+        }
+
+        int node_count() const { return int(nodes.size()); }
+
+        // Bytes of the node array and the primitive pointers (the primitives themselves not included)
+        size_t memory_bytes() const {
+            return nodes.capacity() * sizeof(flat_node) + primitives.capacity() * sizeof(shared_ptr<hittable>);
+        }
+
+        // Recomputes the bounds of every node from the current bounds of the primitives, keeping the tree as it is.
+        // For primitives that moved (animation) this is far cheaper than a rebuild, but the tree gets worse the
+        // further they move from where it was built.
+        void refit() {
+            for (int index = int(nodes.size()) - 1; index >= 0; index--) {     // Children come after their parent
+                flat_node& node = nodes[index];
+                if (node.count > 0) {
+                    aabb bbox;
+                    for (int i = node.offset; i < node.offset + node.count; i++)
+                        bbox = aabb(bbox, primitives[i]->bounding_box());
+                    node.bbox = bbox;
+                } else {
+                    node.bbox = aabb(nodes[index + 1].bbox, nodes[node.offset].bbox);
+                }
+            }
+        }
+
+        // Builds the tree again over the same primitives, at their current bounds
+        void rebuild() {
+            std::vector<build_item> items;
+            items.reserve(primitives.size());
+            for (const auto& object : primitives) {
+                auto box = object->bounding_box();
+                items.push_back({box, box.centroid(), object});
+            }
+            nodes.clear();
+            primitives.clear();
+            if (!items.empty())
+                build(items, 0, int(items.size()), 0);
+            built_cost = sah_cost();
+        }
+
+        // Refits the tree, and rebuilds it instead when the refitted tree would cost more than max_growth times
+        // what it cost when it was built. Returns true if it was rebuilt.
+        bool update(double max_growth = 1.5) {
+            refit();
+            if (sah_cost() <= max_growth * built_cost)
+                return false;
+            rebuild();
+            return true;
+        }
+
+        // Expected cost of tracing a ray through the tree by the surface area heuristic, in primitive tests
+        double sah_cost() const {
+            if (nodes.empty()) return 0;
+            double root_area = nodes[0].bbox.surface_area();
+            if (!(root_area > 0)) return 0;
+            double cost = 0;
+            for (const auto& node : nodes)
+                cost += node.bbox.surface_area() * (node.count > 0 ? node.count : traversal_cost);
+            return cost / root_area;
+        }
+
+    private:
+        struct flat_node {
+            aabb bbox;
+            int32_t offset;     // Leaf: index of its first primitive. Interior node: index of its right child
+            int32_t count;      // Number of primitives in a leaf, 0 for interior nodes
+        };
+
+        struct build_item {
+            aabb bbox;
+            point3 centroid;
+            shared_ptr<hittable> object;
+        };
+
+        static constexpr int bin_count = 12;            // Candidate split planes per axis for the binned SAH
+        static constexpr double traversal_cost = 1.0;   // Cost of visiting a node, relative to one primitive test
+        static constexpr int max_depth = 64;            // Deeper subtrees become leaves, so the traversal stack cannot overflow
+
+        std::vector<flat_node> nodes;
+        std::vector<shared_ptr<hittable>> primitives;   // Primitives reordered so that every leaf is a contiguous range
+        int max_leaf_size;
+        double built_cost = 0;                          // sah_cost right after the last build
+
+        static bool hit_box(const aabb& box, const point3& orig, const vec3& inv_dir, const interval& ray_t, real& t_entry) {
+            real t_min = ray_t.min;
+            real t_max = ray_t.max;
+            RENDER_STAT(thread_render_stats().count_tests(primitive_kind::bvh_box));
+            for (int axis = 0; axis < 3; axis++) {
+                const interval& ax = box.axis_interval(axis);
+                real t0 = (ax.min - orig[axis]) * inv_dir[axis];
+                real t1 = (ax.max - orig[axis]) * inv_dir[axis];
+                if (t0 > t1) std::swap(t0, t1);
+                t_min = t0 > t_min ? t0 : t_min;
+                t_max = t1 < t_max ? t1 : t_max;
+                if (t_max < t_min) return false;
+            }
+            t_entry = t_min;
+            RENDER_STAT(thread_render_stats().count_hit(primitive_kind::bvh_box));
+            return true;
+        }
+
+        int make_leaf(std::vector<build_item>& items, int begin, int end, int node_index) {
+            nodes[node_index].offset = int32_t(primitives.size());
+            nodes[node_index].count = end - begin;
+            for (int i = begin; i < end; i++)
+                primitives.push_back(items[i].object);
+            return node_index;
+        }
+
+        // Builds the subtree over items[begin, end), whose root is at `depth`, and returns the index of its root node
+        int build(std::vector<build_item>& items, int begin, int end, int depth) {
+            int node_index = int(nodes.size());
+            nodes.push_back(flat_node());
+
+            aabb bbox, centroid_bounds;
+            for (int i = begin; i < end; i++) {
+                bbox = aabb(bbox, items[i].bbox);
+                centroid_bounds = aabb(centroid_bounds, aabb(items[i].centroid, items[i].centroid));
+            }
+            nodes[node_index].bbox = bbox;
+
+            int count = end - begin;
+            if (count == 1 || depth >= max_depth - 1)
+                return make_leaf(items, begin, end, node_index);
+
+            // Find the cheapest split plane over all axes
+            double best_cost = infinity;
+            int best_axis = -1, best_split = 0;
+
+            for (int axis = 0; axis < 3; axis++) {
+                const interval& extent = centroid_bounds.axis_interval(axis);
+                if (extent.size() <= 0) continue;   // All centroids are on one plane, nothing to split
+
+                struct bin { aabb bbox; int count = 0; } bins[bin_count];
+                double scale = bin_count / extent.size();
+                for (int i = begin; i < end; i++) {
+                    int b = std::min(bin_count - 1, int((items[i].centroid[axis] - extent.min) * scale));
+                    bins[b].count++;
+                    bins[b].bbox = aabb(bins[b].bbox, items[i].bbox);
+                }
+
+                // Sweep from the right to know the cost of everything right of each plane, then from the left
+                double right_area[bin_count];
+                int right_count[bin_count];
+                aabb accumulated;
+                int accumulated_count = 0;
+                for (int b = bin_count - 1; b > 0; b--) {
+                    accumulated = aabb(accumulated, bins[b].bbox);
+                    accumulated_count += bins[b].count;
+                    right_area[b] = accumulated.surface_area();
+                    right_count[b] = accumulated_count;
+                }
+
+                accumulated = aabb();
+                accumulated_count = 0;
+                for (int b = 0; b < bin_count - 1; b++) {
+                    accumulated = aabb(accumulated, bins[b].bbox);
+                    accumulated_count += bins[b].count;
+                    if (accumulated_count == 0 || right_count[b+1] == 0) continue;
+
+                    double cost = accumulated.surface_area() * accumulated_count + right_area[b+1] * right_count[b+1];
+                    if (cost < best_cost) {
+                        best_cost = cost;
+                        best_axis = axis;
+                        best_split = b;
+                    }
+                }
+            }
+
+            // Compare splitting against testing every primitive right here
+            double parent_area = bbox.surface_area();
+            double split_cost = traversal_cost + (parent_area > 0 ? best_cost / parent_area : infinity);
+            if (best_axis < 0 || (count <= max_leaf_size && split_cost >= count))
+                return make_leaf(items, begin, end, node_index);
+
+            const interval& extent = centroid_bounds.axis_interval(best_axis);
+            double scale = bin_count / extent.size();
+            auto middle = std::partition(items.begin() + begin, items.begin() + end, [&](const build_item& item) {
+                int b = std::min(bin_count - 1, int((item.centroid[best_axis] - extent.min) * scale));
+                return b <= best_split;
+            });
+            int mid = int(middle - items.begin());
+
+            build(items, begin, mid, depth + 1);                           // The left child lands right after this node
+            nodes[node_index].offset = build(items, mid, end, depth + 1);  // No reference to the node is kept: push_back may reallocate
+            nodes[node_index].count = 0;
+            return node_index;
+        }
+};
+
+#endif
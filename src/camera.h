@@ -1,10 +1,35 @@
 #ifndef CAMERA_H
 #define CAMERA_H
 
+#include "adaptive_sampling.h"
+#include "checkpoint.h"
+#include "denoiser.h"
 #include "hittable.h"
 #include "color.h"
+#include "framebuffer.h"
 #include "interval.h"
+#include "lights.h"
 #include "material.h"
+#include "render_stats.h"
+#include "sampler.h"
+#include "thread_pool.h"
+#include "wavefront.h"
+#include "worker_process.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+
+enum class integrator_type {
+    recursive,      // camera::ray_color follows one path at a time, depth first
+    wavefront       // wavefront_integrator advances a batch of paths one bounce at a time
+};
 
 class camera {
     public:
@@ -13,6 +38,7 @@ class camera {
         int image_width = 100;
         int samples_per_pixel = 10;  // Count of random samples for each pixel
         int max_depth = 10;          // Maximum number of ray bounces into the scene
+        int roulette_depth = 3;      // Bounces after which Russian roulette may end a path (max_depth or more = never)
 
         point3 lookfrom = point3(0,0,0); // Point camera is looking from
         point3 lookat = point3(0,0,-1);  // Point camera is looking at
@@ -24,30 +50,169 @@ class camera {
 
         double vfov = 90; // Vertical view angle - field of view
 
-        void render(const hittable& world) {
-            initialize();
+        bool sky = true;                         // Rays that escape see the sky gradient...
+        color background_color = color(0,0,0);  // ...or, without it, this color (black for scenes lit only by lights)
+
+        int num_threads = 0;   // Worker threads used by render (0 = one per hardware core)
+        int tile_size = 32;    // Width and height of the square image tiles handed to the workers
+        int worker_processes = 0;   // If > 0, tiles are rendered by this many forked processes instead of threads
+
+        integrator_type integrator = integrator_type::recursive;  // How the paths of each tile are traced
+        int wavefront_batch = 16384;                               // Paths traced together by the wavefront integrator
+        bool sort_rays = false;                                    // Wavefront: sort each bounce's rays for coherent traversal
+
+        std::string output_path;                        // File the image is written to ("" = standard output)
+        image_format output_format = image_format::p3;  // Encoding of the written image
+
+        // Checkpoints: with checkpoint_path set, render adds the samples in passes of checkpoint_pass_spp and saves the
+        // image (float sums and sample counts) there every checkpoint_passes passes or checkpoint_seconds seconds,
+        // and at the end. Rendering into an image loaded with load_checkpoint continues where it stopped.
+        // The file records checkpoint_key, and load_checkpoint only takes a checkpoint with the same key.
+        std::string checkpoint_path;
+        int checkpoint_pass_spp = 16;        // Samples added to every pixel per pass
+        int checkpoint_passes = 0;           // Passes between checkpoints (0 = by time only)
+        double checkpoint_seconds = 60;      // Seconds between checkpoints (0 = by passes only)
+        uint64_t scene_key = 0;              // Identifies the scene (scene_fingerprint of a loaded one, 0 for the built-in one)
+
+        // Denoising: render also traces feature_spp camera rays per pixel that record the albedo, normal and depth of
+        // the first hit (in `features`), and write_image filters the image with denoise, guided by them.
+        bool denoise = false;
+        int feature_spp = 4;                 // Camera rays per pixel for the feature buffers
+        std::string feature_prefix;          // If set, the feature buffers are written to <prefix>_albedo.pfm, ...
+        denoise_settings denoiser;
+        feature_buffers features;            // Feature buffers of the last render (if denoise or feature_prefix is set)
+
+        // Adaptive sampling: every pixel starts with adaptive_min_spp samples, then only pixels whose noise is still
+        // above adaptive_threshold get more, up to adaptive_max_spp. The total stays within samples_per_pixel on average.
+        bool adaptive = false;
+        int adaptive_min_spp = 16;           // Samples every pixel gets before its noise is judged
+        int adaptive_max_spp = 0;            // Most samples one pixel can get (0 = 4 * samples_per_pixel)
+        int adaptive_pass_spp = 8;           // Samples added to each noisy pixel per pass
+        double adaptive_threshold = 0.02;    // Relative 95% confidence half-width at which a pixel counts as converged
+        double adaptive_time_budget = 0;     // Seconds after which no new pass is started (0 = no limit)
+        std::string spp_map_path;            // If set, a debug image of the samples per pixel is written there
+
+        // Preview: render refines the image in passes and writes it to preview_path after each one, for a viewer to
+        // watch. The first passes give one sample to every preview_scale-th pixel of every preview_scale-th row, then
+        // to the pixels in between, until every pixel has one; after that every pass adds as many samples as fit in
+        // preview_pass_seconds. These are the samples a normal render takes, so the finished image is the same.
+        bool preview = false;
+        int preview_scale = 8;               // Pixel spacing of the first pass (rounded down to a power of two)
+        double preview_pass_seconds = 0.5;   // Time each full-resolution pass aims for
+        std::string preview_path;            // Where the passes go ("-" = standard output, one image after another)
+
+        int frame = 0;                      // Frame number, part of every sample's random seed
+        shared_ptr<const light_list> lights;    // Lights sampled at every non-specular hit (null = none, paths find lights by chance)
+        shared_ptr<sampler> pixel_sampler;  // Source of the per-sample random numbers (null = independent_sampler)
+
+        // Fingerprint of what the image shows and which samples make it up: the scene, the view, the light transport
+        // settings and the sampler. Settings that only change how the samples are computed (threads, integrator)
+        // or what is done with the image (denoising, output) are left out.
+        checkpoint_fingerprint checkpoint_key() const {
+            uint64_t h = scene_key;
+            auto add = [&](double v) {
+                uint64_t bits;
+                std::memcpy(&bits, &v, sizeof bits);
+                h = hash_combine(h, bits);
+            };
+            add(aspect_ratio); add(image_width);
+            add(max_depth); add(roulette_depth);
+            for (const vec3& v : {lookfrom, lookat, vup})
+                for (int axis = 0; axis < 3; axis++) add(v[axis]);
+            add(vfov); add(defocus_angle); add(focus_dist);
+            add(sky);
+            for (int axis = 0; axis < 3; axis++) add(background_color[axis]);
+            add(frame);
+            return {h, pixel_sampler ? pixel_sampler->identity() : independent_sampler().identity()};
+        }
 
-            cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+        // Renders the scene and writes the image to output_path in output_format.
+        // The hit records of `world` refer to entries of `materials`.
+        void render(const hittable& world, const material_table& materials) {
+            framebuffer image;
+            render(world, materials, image);
+            write_image(image);
+        }
 
-            for (int j = 0; j < image_height; j++) {
+        // Brings every pixel of image up to samples_per_pixel samples. Samples already in the image (say, from a
+        // checkpoint) are kept and not traced again. An image of the wrong size is replaced by an empty one.
+        void render(const hittable& world, const material_table& materials, framebuffer& image) {
+            phase_timer timer(render_phase::render);
+            initialize();
 
-                clog << "\rScanlines remaining: " << (image_height - j) << ' ' << flush;
+            if (image.width() != image_width || image.height() != image_height) {
+                if (image.width() > 0)
+                    clog << "The image to continue is " << image.width() << 'x' << image.height() << ", not "
+                         << image_width << 'x' << image_height << "; starting from an empty image\n";
+                image = framebuffer(image_width, image_height);   // Shared image, every tile writes only its own pixels
+            }
+            if (adaptive && image.has_samples()) {
+                clog << "Adaptive sampling cannot continue an image; starting from an empty image\n";
+                image = framebuffer(image_width, image_height);
+            }
 
-                for (int i = 0; i < image_width; i++) {
-                    color pixel_color(0,0,0);
-                    for (int sample = 0; sample < samples_per_pixel; sample++) {
-                        ray r = get_ray(i, j);
-                        pixel_color += ray_color(r, world, max_depth);
-                    }
-                    write_color(std::cout, pixel_samples_scale * pixel_color);
+            if (worker_processes > 0 && !image.has_samples() && checkpoint_path.empty() && !preview) {
+                // Before the thread pool exists: fork() only copies the calling thread
+                if (adaptive)
+                    clog << "Adaptive sampling needs the whole image in one process; worker processes sample uniformly\n";
+                render_distributed(world, materials, image);
+
+                if (wants_features()) {
+                    thread_pool pool(num_threads);
+                    render_features(world, materials, pool);
                 }
+                clog << "\rDone.                 \n";
+                return;
             }
-            clog << "\rDone.                 \n";
+            if (worker_processes > 0)
+                clog << "Worker processes only render whole images without checkpoints or previews; using threads\n";
+
+            thread_pool pool(num_threads);
+            clog << "Rendering on " << pool.size() << " threads\n";
+            render_on(world, materials, image, pool);
+        }
+
+        // Like render, but on the threads of an existing pool, which outlives the image (frame sequences).
+        // Worker processes are not used.
+        void render(const hittable& world, const material_table& materials, framebuffer& image, thread_pool& pool) {
+            phase_timer timer(render_phase::render);
+            initialize();
+            if (image.width() != image_width || image.height() != image_height || (adaptive && image.has_samples()))
+                image = framebuffer(image_width, image_height);
+            render_on(world, materials, image, pool);
+        }
+
+        // Writes the image to output_path, or to standard output when no path is set.
+        // With denoise set, the filtered image is written instead (image itself is left as it is);
+        // the filter runs on pool, or on a pool of its own if none is given.
+        void write_image(const framebuffer& image, thread_pool* pool = nullptr) const {
+            if (can_denoise(image)) {
+                write_output(denoised(image, pool));
+            } else {
+                if (denoise)
+                    clog << "No feature buffers for this image; writing it without denoising\n";
+                write_output(image);
+            }
+
+            if (!feature_prefix.empty() && !features.save(feature_prefix))
+                clog << "Could not write the feature buffers to " << feature_prefix << "_*.pfm\n";
+        }
+
+        // True if denoise is set and the last render recorded features for an image of this size
+        bool can_denoise(const framebuffer& image) const {
+            return denoise && features.width() == image.width() && features.height() == image.height();
+        }
+
+        framebuffer denoised(const framebuffer& image, thread_pool* pool = nullptr) const {
+            phase_timer timer(render_phase::denoise);
+            if (pool)
+                return ::denoise(image, features, *pool, denoiser);
+            thread_pool own_pool(num_threads);
+            return ::denoise(image, features, own_pool, denoiser);
         }
 
     private:
         int image_height;            // Rendered image height
-        double pixel_samples_scale;  // Color scale factor for a sum of pixel samples
         point3 center;               // Camera center
         point3 pixel00_loc;          // Location of pixel 0, 0
         vec3 pixel_delta_u;          // Offset to pixel to the right
@@ -61,7 +226,8 @@ class camera {
             image_height = int(image_width / aspect_ratio);
             image_height = (image_height < 1) ? 1 : image_height;
 
-            pixel_samples_scale = 1.0 / samples_per_pixel;
+            if (!pixel_sampler)
+                pixel_sampler = make_shared<independent_sampler>();
 
             center = lookfrom;
             
@@ -97,46 +263,526 @@ class camera {
             defocus_disk_v = v * defocus_radius;                                                 // Scales the camera’s up vector by that radius
         }
 
-        ray get_ray(int i, int j) {
+        void render_on(const hittable& world, const material_table& materials, framebuffer& image, thread_pool& pool) {
+            if (preview)
+                render_preview(world, materials, image, pool);
+            else if (adaptive)
+                render_adaptive(world, materials, image, pool);
+            else
+                render_progressive(world, materials, image, pool);
+
+            if (wants_features())
+                render_features(world, materials, pool);
+
+            clog << "\rDone.                 \n";
+        }
+
+        // Runs task(x0, y0, x1, y1) for every tile of the image on the pool and reports progress
+        template <class Task>
+        void for_each_tile(thread_pool& pool, Task&& task) const {
+            int tiles_x = (image_width + tile_size - 1) / tile_size;
+            int tiles_y = (image_height + tile_size - 1) / tile_size;
+            int tile_count = tiles_x * tiles_y;
+
+            std::atomic<int> tiles_remaining(tile_count);
+            std::mutex log_mutex;
+
+            pool.parallel_for(tile_count, [&](int tile, int) {
+                int x0 = (tile % tiles_x) * tile_size;
+                int y0 = (tile / tiles_x) * tile_size;
+                task(x0, y0, std::min(x0 + tile_size, image_width), std::min(y0 + tile_size, image_height));
+
+                int left = --tiles_remaining;
+                std::lock_guard<std::mutex> lock(log_mutex);
+                clog << "\rTiles remaining: " << left << ' ' << flush;
+            });
+        }
+
+        void render_adaptive(const hittable& world, const material_table& materials, framebuffer& image, thread_pool& pool) const {
+            using clock = std::chrono::steady_clock;
+            auto start = clock::now();
+
+            int min_spp = std::max(adaptive_min_spp, 2);
+            int max_spp = std::max(adaptive_max_spp > 0 ? adaptive_max_spp : 4 * samples_per_pixel, min_spp);
+            long long pixels = (long long)image_width * image_height;
+            long long budget = std::max((long long)samples_per_pixel, (long long)min_spp) * pixels;   // Same cost as a uniform render
+
+            std::vector<pixel_stats> stats(image.width() * size_t(image.height()));
+            long long spent = 0;
+
+            // Pass 0 gives every pixel min_spp samples, later passes only touch the pixels that are still noisy
+            for (int pass = 0; ; pass++) {
+                long long active = 0;
+                for (const auto& st : stats)
+                    if (!st.done) active++;
+                if (active == 0) break;
+
+                int pass_spp = pass == 0 ? min_spp : adaptive_pass_spp;
+                if (pass > 0) {
+                    pass_spp = int(std::min<long long>(pass_spp, (budget - spent) / active));
+                    if (pass_spp <= 0) break;      // Sample budget used up
+                    if (adaptive_time_budget > 0 &&
+                        std::chrono::duration<double>(clock::now() - start).count() > adaptive_time_budget)
+                        break;
+                }
+
+                clog << "\rPass " << pass << ": " << active << " pixels active          \n";
+
+                for_each_tile(pool, [&](int x0, int y0, int x1, int y1) {
+                    auto tile_sampler = pixel_sampler->clone();
+                    for (int j = y0; j < y1; j++) {
+                        for (int i = x0; i < x1; i++) {
+                            auto& st = stats[size_t(j) * image_width + i];
+                            if (st.done) continue;
+
+                            int end = std::min(st.n + pass_spp, max_spp);
+                            while (st.n < end)     // The sample index continues where the last pass stopped
+                                st.add(sample_pixel(world, materials, i, j, st.n, *tile_sampler));
+
+                            st.done = st.n >= max_spp || st.relative_error() < adaptive_threshold;
+                        }
+                    }
+                });
+
+                spent = 0;
+                for (const auto& st : stats)
+                    spent += st.n;
+            }
+
+            for (int j = 0; j < image_height; j++)
+                for (int i = 0; i < image_width; i++) {
+                    const auto& st = stats[size_t(j) * image_width + i];
+                    image.add(i, j, st.sum, st.n);
+                }
+
+            clog << "\rAdaptive sampling: " << double(spent) / pixels << " samples per pixel on average\n";
+
+            if (!spp_map_path.empty()) {
+                auto map = spp_map(stats, image_width, image_height, max_spp);
+                if (!map.save(spp_map_path, format_from_path(spp_map_path)))
+                    clog << "Could not write " << spp_map_path << '\n';
+            }
+        }
+
+        void write_output(const framebuffer& image) const {
+            phase_timer timer(render_phase::output);
+            if (output_path.empty()) {
+                image.write(std::cout, output_format);
+                std::cout.flush();
+            } else if (!image.save(output_path, output_format)) {
+                clog << "Could not write " << output_path << '\n';
+            }
+        }
+
+        bool wants_features() const { return denoise || !feature_prefix.empty(); }
+
+        // Fills `features` with the average first-hit albedo, normal and depth of feature_spp camera rays per pixel.
+        // The rays are those of the pixel's first samples, so the features line up with the image edges.
+        void render_features(const hittable& world, const material_table& materials, thread_pool& pool) {
+            features = feature_buffers(image_width, image_height);
+            int spp = std::max(feature_spp, 1);
+
+            pool.parallel_for(image_height, [&](int j, int) {
+                auto row_sampler = pixel_sampler->clone();
+                for (int i = 0; i < image_width; i++) {
+                    color albedo(0,0,0);
+                    vec3 normal(0,0,0);
+                    real depth = 0;
+                    for (int sample = 0; sample < spp; sample++) {
+                        row_sampler->start_sample(i, j, sample, frame);
+                        ray r = get_ray(i, j, *row_sampler);
+                        hit_record rec;
+                        if (world.hit(r, interval(ray_t_min, infinity), rec)) {
+                            albedo += base_color(materials[rec.mat]);
+                            normal += rec.normal;
+                            depth += rec.t * r.direction().length();
+                        } else {
+                            albedo += background(r);
+                        }
+                    }
+                    features.set(i, j, albedo / spp, normal / spp, depth / spp);
+                }
+            });
+        }
+
+        // Adds samples in passes until every pixel has samples_per_pixel. Without a checkpoint file that is a single
+        // pass; with one, every pass adds checkpoint_pass_spp samples and the image is saved when a checkpoint is due.
+        void render_progressive(const hittable& world, const material_table& materials, framebuffer& image,
+                                thread_pool& pool) const {
+            using clock = std::chrono::steady_clock;
+            bool checkpointing = !checkpoint_path.empty();
+            int pass_spp = checkpointing ? std::max(checkpoint_pass_spp, 1) : samples_per_pixel;
+            auto last_save = clock::now();
+
+            for (int pass = 0; image.min_sample_count() < samples_per_pixel; pass++) {
+                if (checkpointing)
+                    clog << "\rPass " << pass << ": from " << image.min_sample_count() << " samples per pixel          \n";
+
+                for_each_tile(pool, [&](int x0, int y0, int x1, int y1) {
+                    trace_tile(world, materials, image, x0, y0, x1, y1, pass_spp);
+                });
+
+                if (!checkpointing) continue;
+                bool due = image.min_sample_count() >= samples_per_pixel
+                        || (checkpoint_passes > 0 && (pass + 1) % checkpoint_passes == 0)
+                        || (checkpoint_seconds > 0 &&
+                            std::chrono::duration<double>(clock::now() - last_save).count() >= checkpoint_seconds);
+                if (due) {
+                    if (!save_checkpoint(checkpoint_path, image, checkpoint_key()))
+                        clog << "\rCould not write " << checkpoint_path << '\n';
+                    last_save = clock::now();
+                }
+            }
+        }
+
+        // Preview passes (see `preview`). Each pass is timed, and the next one is sized from the time per sample.
+        void render_preview(const hittable& world, const material_table& materials, framebuffer& image,
+                            thread_pool& pool) const {
+            using clock = std::chrono::steady_clock;
+            auto start = clock::now();
+            auto elapsed = [&] { return std::chrono::duration<double>(clock::now() - start).count(); };
+            double seconds_per_spp = 0;          // Time to add one sample to every pixel, as last measured
+
+            // Coarse passes: the pixels on a grid of spacing `step` that have no sample yet get their first one
+            int step = 1;
+            while (step * 2 <= preview_scale) step *= 2;
+            for (; step >= 1 && samples_per_pixel > 0 && image.min_sample_count() == 0; step /= 2) {
+                auto pass_start = clock::now();
+                std::atomic<long long> added(0);
+                for_each_tile(pool, [&](int x0, int y0, int x1, int y1) {
+                    auto tile_sampler = pixel_sampler->clone();
+                    long long count = 0;
+                    for (int j = (y0 + step - 1) / step * step; j < y1; j += step)
+                        for (int i = (x0 + step - 1) / step * step; i < x1; i += step)
+                            if (image.sample_count(i, j) == 0) {
+                                image.add(i, j, sample_pixel(world, materials, i, j, 0, *tile_sampler), 1);
+                                count++;
+                            }
+                    added += count;
+                });
+                if (added > 0)
+                    seconds_per_spp = std::chrono::duration<double>(clock::now() - pass_start).count()
+                                    * image_width * image_height / double(added);
+                write_preview(image, step);
+                clog << "\rPreview 1/" << step << " resolution after " << elapsed() << " s          \n";
+            }
+
+            while (image.min_sample_count() < samples_per_pixel) {
+                int from = image.min_sample_count();
+                int pass_spp = seconds_per_spp > 0 ? int(preview_pass_seconds / seconds_per_spp) : 1;
+                pass_spp = std::max(pass_spp, 1);
+
+                auto pass_start = clock::now();
+                for_each_tile(pool, [&](int x0, int y0, int x1, int y1) {
+                    trace_tile(world, materials, image, x0, y0, x1, y1, pass_spp);
+                });
+                seconds_per_spp = std::chrono::duration<double>(clock::now() - pass_start).count()
+                                / std::max(image.min_sample_count() - from, 1);
+                write_preview(image, 1);
+                clog << "\rPreview " << image.min_sample_count() << " samples per pixel after " << elapsed() << " s          \n";
+            }
+        }
+
+        // Writes the image as it is to preview_path. Pixels without samples show the pixel at the corner of
+        // their step x step block. The file is replaced in one step (written next to it, then renamed), so a
+        // viewer never reads half an image; "-" streams one image after another to standard output.
+        void write_preview(const framebuffer& image, int step) const {
+            if (preview_path.empty()) return;
+
+            framebuffer shown = image;
+            if (step > 1) {
+                for (int j = 0; j < image_height; j++)
+                    for (int i = 0; i < image_width; i++)
+                        if (image.sample_count(i, j) == 0)
+                            shown.add(i, j, image.pixel(i - i % step, j - j % step), 1);
+            }
+
+            if (preview_path == "-") {
+                shown.write(std::cout, image_format::p6);
+                std::cout.flush();
+                return;
+            }
+            std::string temporary = preview_path + ".part";
+            if (!shown.save(temporary, format_from_path(preview_path)) ||
+                std::rename(temporary.c_str(), preview_path.c_str()) != 0)
+                clog << "\rCould not write " << preview_path << '\n';
+        }
+
+        // Coordinator side of a multi-process render. Every worker gets one tile at a time; a worker that dies
+        // (broken socket) is reaped and its tile goes back to the queue. If no worker is left, the remaining tiles
+        // are rendered here. Samples are seeded by pixel and sample index, so the merged image is bit for bit
+        // the image a single process renders.
+        void render_distributed(const hittable& world, const material_table& materials, framebuffer& image) const {
+            std::vector<tile_rect> tiles;
+            for (int y0 = 0; y0 < image_height; y0 += tile_size)
+                for (int x0 = 0; x0 < image_width; x0 += tile_size)
+                    tiles.push_back({x0, y0, std::min(x0 + tile_size, image_width), std::min(y0 + tile_size, image_height)});
+
+            std::deque<int> pending;
+            for (int t = 0; t < int(tiles.size()); t++)
+                pending.push_back(t);
+
+            struct worker {
+                worker_process process;
+                int tile = -1;          // Tile it is working on
+            };
+            std::vector<worker> workers(worker_processes);
+
+            signal(SIGPIPE, SIG_IGN);   // A dead worker shows up as a failed write instead of killing the coordinator
+            std::cout.flush();
+            clog.flush();
+
+            int started = 0;
+            for (auto& w : workers) {
+                bool ok = w.process.start([&](int socket) {
+                    for (auto& sibling : workers)
+                        if (&sibling != &w) sibling.process.forget();
+                    serve_tiles(world, materials, socket);
+                });
+                started += ok;
+            }
+            clog << "Rendering on " << started << " worker processes\n";
+
+            auto fail = [&](worker& w) {
+                clog << "\rWorker " << w.process.id() << " failed, its tile goes back to the queue\n";
+                w.process.stop(true);
+                if (w.tile >= 0) pending.push_front(w.tile);
+                w.tile = -1;
+            };
+
+            int tiles_remaining = int(tiles.size());
+            std::vector<pollfd> polled;
+            std::vector<worker*> busy;
+            while (tiles_remaining > 0) {
+                for (auto& w : workers) {
+                    if (!w.process.running() || w.tile >= 0 || pending.empty()) continue;
+                    w.tile = pending.front();
+                    pending.pop_front();
+                    if (!write_all(w.process.socket(), &tiles[w.tile], sizeof(tile_rect)))
+                        fail(w);
+                }
+
+                polled.clear();
+                busy.clear();
+                for (auto& w : workers) {
+                    if (w.tile < 0) continue;
+                    polled.push_back({w.process.socket(), POLLIN, 0});
+                    busy.push_back(&w);
+                }
+                if (busy.empty()) break;    // Every worker is gone
+
+                if (poll(polled.data(), nfds_t(polled.size()), -1) < 0) {
+                    if (errno == EINTR) continue;
+                    break;
+                }
+
+                for (size_t k = 0; k < busy.size(); k++) {
+                    if (polled[k].revents == 0) continue;
+                    worker& w = *busy[k];
+                    render_stats tile_stats;        // Counted by the worker; kept only if the whole tile arrives
+                    if ((RAYTRACER_STATS && !read_all(w.process.socket(), &tile_stats, sizeof tile_stats)) ||
+                        !receive_tile_result(w.process.socket(), tiles[w.tile], image)) {
+                        fail(w);
+                        continue;
+                    }
+                    RENDER_STAT(thread_render_stats().add(tile_stats));
+                    w.tile = -1;
+                    clog << "\rTiles remaining: " << --tiles_remaining << ' ' << flush;
+                }
+            }
+
+            for (auto& w : workers)
+                w.process.stop();       // Closing the socket ends the worker's loop
+
+            if (!pending.empty())
+                clog << "\rNo worker processes left, rendering " << pending.size() << " tiles here\n";
+            for (int t : pending) {
+                trace_tile(world, materials, image, tiles[t].x0, tiles[t].y0, tiles[t].x1, tiles[t].y1, samples_per_pixel);
+                clog << "\rTiles remaining: " << --tiles_remaining << ' ' << flush;
+            }
+        }
+
+        // Worker side: renders the tiles the coordinator sends until it closes the socket.
+        // In stats builds, each tile's counts go ahead of its result, for the coordinator to add to its own.
+        void serve_tiles(const hittable& world, const material_table& materials, int socket) const {
+            framebuffer local(image_width, image_height);   // A tile reaches a given worker at most once, so its pixels start at zero
+            reset_render_stats();                           // The counts copied from the parent are not this worker's
+            tile_rect tile;
+            while (read_all(socket, &tile, sizeof tile)) {
+                trace_tile(world, materials, local, tile.x0, tile.y0, tile.x1, tile.y1, samples_per_pixel);
+                if (RAYTRACER_STATS) {
+                    render_stats tile_stats = collect_render_stats();
+                    reset_render_stats();
+                    if (!write_all(socket, &tile_stats, sizeof tile_stats)) break;
+                }
+                if (!send_tile_result(socket, tile, local)) break;
+            }
+        }
 
-            auto offset = sample_square();   // This is needed to remove the edginess of the picture by aiming in different parts of the pixel
+        // Renders one tile with the chosen integrator
+        void trace_tile(const hittable& world, const material_table& materials, framebuffer& image,
+                        int x0, int y0, int x1, int y1, int pass_spp) const {
+            if (integrator == integrator_type::wavefront)
+                render_tile_wavefront(world, materials, image, x0, y0, x1, y1, pass_spp);
+            else
+                render_tile(world, materials, image, x0, y0, x1, y1, pass_spp);
+        }
+
+        // Color of one camera sample of pixel (i, j)
+        color sample_pixel(const hittable& world, const material_table& materials, int i, int j, int sample_index, sampler& s) const {
+            s.start_sample(i, j, sample_index, frame);
+            ray r = get_ray(i, j, s);
+            return ray_color(r, world, materials);
+        }
+
+        // Adds up to pass_spp samples to every pixel of the tile, without going over samples_per_pixel.
+        // Each pixel continues with the sample index after the samples it already has.
+        void render_tile(const hittable& world, const material_table& materials, framebuffer& image,
+                         int x0, int y0, int x1, int y1, int pass_spp) const {
+            auto tile_sampler = pixel_sampler->clone();  // Samplers may keep state, so every tile works on its own copy
+
+            for (int j = y0; j < y1; j++) {
+                for (int i = x0; i < x1; i++) {
+                    int first = image.sample_count(i, j);
+                    int last = std::min(samples_per_pixel, first + pass_spp);
+                    if (last <= first) continue;
+
+                    color pixel_color(0,0,0);
+                    for (int sample = first; sample < last; sample++)
+                        pixel_color += sample_pixel(world, materials, i, j, sample, *tile_sampler);  // The sample, not the thread that renders it, decides the random sequence
+                    image.add(i, j, pixel_color, last - first);
+                }
+            }
+        }
+
+        void render_tile_wavefront(const hittable& world, const material_table& materials, framebuffer& image,
+                                   int x0, int y0, int x1, int y1, int pass_spp) const {
+            auto tile_sampler = pixel_sampler->clone();
+            wavefront_integrator tracer(world, materials, lights.get(), max_depth, roulette_depth);
+            tracer.sort_rays = sort_rays;
+            path_buffer paths;
+
+            int tile_width = x1 - x0;
+            int pixels = tile_width * (y1 - y0);
+            std::vector<int> first(pixels), last(pixels), wave_start(pixels);
+            int longest = 0;
+            for (int p = 0; p < pixels; p++) {
+                first[p] = image.sample_count(x0 + p % tile_width, y0 + p / tile_width);
+                last[p] = std::max(first[p], std::min(samples_per_pixel, first[p] + pass_spp));
+                longest = std::max(longest, last[p] - first[p]);
+            }
+            int samples_per_wave = std::max(1, std::min(longest, wavefront_batch / pixels));
+            std::vector<color> sums(pixels, color(0,0,0));
+
+            // Every wave traces samples [first + o0, first + o1) of all pixels in the tile
+            for (int o0 = 0; o0 < longest; o0 += samples_per_wave) {
+                int o1 = std::min(o0 + samples_per_wave, longest);
+
+                paths.clear();
+                for (int p = 0; p < pixels; p++) {
+                    int i = x0 + p % tile_width;
+                    int j = y0 + p / tile_width;
+                    wave_start[p] = paths.size();
+                    for (int sample = first[p] + o0; sample < std::min(first[p] + o1, last[p]); sample++) {
+                        tile_sampler->start_sample(i, j, sample, frame);
+                        ray r = get_ray(i, j, *tile_sampler);
+                        paths.push(r, thread_rng(), tile_sampler->state());
+                    }
+                }
+                int wave_end = paths.size();
+
+                tracer.trace(paths, [this](const ray& r) { return background(r); });
+
+                // Add up the samples in sample order, like render_tile does
+                for (int p = 0; p < pixels; p++) {
+                    int end = p + 1 < pixels ? wave_start[p + 1] : wave_end;
+                    for (int k = wave_start[p]; k < end; k++)
+                        sums[p] += paths.radiance[k];
+                }
+            }
+
+            for (int p = 0; p < pixels; p++)
+                if (last[p] > first[p])
+                    image.add(x0 + p % tile_width, y0 + p / tile_width, sums[p], last[p] - first[p]);
+        }
+
+        ray get_ray(int i, int j, sampler& s) const {
+
+            auto offset = sample_square(s);   // This is needed to remove the edginess of the picture by aiming in different parts of the pixel
                                              // not just in the middle of it
             auto pixel_sample = pixel00_loc + ((i + offset.x()) * pixel_delta_u) + ((j + offset.y()) * pixel_delta_v);
             // This way the pixel is not just background color but with the equal probability either object or background color
             // so on the edge of the object colors mixe
             
-            auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample();
+            auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample(s);
             auto ray_direction = pixel_sample - ray_origin;
 
             return ray(ray_origin, ray_direction);
         }
 
-        vec3 sample_square() const {
-            return vec3(random_double() - 0.5, random_double() - 0.5, 0);  // Returns the vector to a random point in the [-0.5,-0.5]-[0.5,0.5] unit square
+        vec3 sample_square(sampler& s) const {
+            auto u = s.get_2d();
+            return vec3(u.x - 0.5, u.y - 0.5, 0);  // Returns the vector to a random point in the [-0.5,-0.5]-[0.5,0.5] unit square
         }
 
-        point3 defocus_disk_sample() const {
+        point3 defocus_disk_sample(sampler& s) const {
             // Returns a random point in the camera defocus disk.
-            auto p = random_in_unit_disk();
+            auto u = s.get_2d();
+            auto p = disk_from_square(u.x, u.y);
             return center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);   // Returns a random point inside the circular aperture centered at the camera
         }
 
-        color ray_color(const ray& r, const hittable& world, int depth) const {
-            if (depth <= 0) return color(0,0,0);
+        // Follows one path from the camera until it escapes, is absorbed, loses the Russian roulette or reaches max_depth
+        color ray_color(const ray& camera_ray, const hittable& world, const material_table& materials) const {
+            ray r = camera_ray;
+            color throughput(1,1,1);                                        // Product of the attenuations so far
+            color radiance(0,0,0);                                          // Light gathered along the path so far
+            real prev_scatter_pdf = 0;                                      // Density of r's direction, for the MIS weight of lights it hits
+            bool light_sampling = lights && !lights->empty();
+
+            for (int depth = 0; depth < max_depth; depth++) {
+                RENDER_STAT(thread_render_stats().count_rays(depth == 0));
+
+                hit_record rec;                                             // A structure to store intersection info
+                if (!world.hit(r, interval(ray_t_min, infinity), rec)) {   // Search from (almost) t = 0 to infinity if the ray hits anything
+                    RENDER_STAT(thread_render_stats().count_path_end(depth, path_end::escaped));
+                    return radiance + throughput * background(r);
+                }
+
+                const material& mat = materials[rec.mat];
+                color emission = emitted(mat, rec);
+                if (emission.length_squared() > 0)
+                    radiance += throughput * emission * (light_sampling ? emission_weight(*lights, r, rec, prev_scatter_pdf) : 1);
+                if (light_sampling && !is_specular(mat))
+                    radiance += throughput * sample_direct_light(world, materials, *lights, mat, r, rec);
 
-            hit_record rec;                                                 // A structure to store intersection info
-            
-            if (world.hit(r, interval(0.001, infinity), rec)) {                 // Search from t = 0 to infinity if the ray hits anything
                 ray scattered;
                 color attenuation;
-                if (rec.mat->scatter(r, rec, attenuation, scattered))
-                    return attenuation * ray_color(scattered, world, depth-1);
-                return color(0,0,0);
-            /*    vec3 direction = rec.normal + random_unit_vector();         // Randomly sends the ray from the object, get the color of the surrondings,
-                                                                            // recursively traces back to the object and gives its the mixed color
-                return 0.5 * ray_color(ray(rec.p, direction), world, depth-1);       // Sends the ray back to the sphere. 0.5 is the fraction of the incoming light refelected*/
+                bool scattering = scatter(mat, r, rec, attenuation, scattered);
+                RENDER_STAT(thread_render_stats().count_scatter(mat, scattering));
+                if (!scattering) {
+                    RENDER_STAT(thread_render_stats().count_path_end(depth, path_end::absorbed));
+                    return radiance;
+                }
+                if (light_sampling)
+                    prev_scatter_pdf = scatter_pdf(mat, r, rec, scattered.direction());
+
+                // Roulette only decides about paths that have a bounce left
+                throughput = throughput * attenuation;
+                int bounces = depth + 1;
+                if (bounces < max_depth && bounces >= roulette_depth && !survives_roulette(throughput)) {
+                    RENDER_STAT(thread_render_stats().count_path_end(bounces, path_end::roulette));
+                    return radiance;
+                }
+                r = scattered;
             }
 
+            RENDER_STAT(thread_render_stats().count_path_end(max_depth, path_end::max_depth));
+            return radiance;
+        }
+
+        color background(const ray& r) const {
+            if (!sky) return background_color;
             vec3 unit_direction = unit_vector(r.direction());               // Normalize ray direction to compute the gradient for the background
             auto a = 0.5*(unit_direction.y() + 1.0);                        // Component to add to the blend factor
             return (1.0-a)*color(0.2, 0.5, 0.7) + a*color(0.2, 0.8, 0.6);  // Returns the background color
@@ -0,0 +1,123 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+// Checkpoint files: the raw accumulation state of a framebuffer (float sums and sample counts of every pixel),
+// so an interrupted render can be resumed and a finished one refined to more samples per pixel.
+//
+//   checkpoint_header, then 3 float sums per pixel, then 1 uint32 count per pixel, row by row from the top
+//
+// The data is stored in the byte order of the machine, like the binary scene cache. The header carries a
+// fingerprint of the scene, camera and sampler that rendered the image (camera::checkpoint_key); a checkpoint
+// is only continued by a render with the same fingerprint, since mixing in samples of anything else would
+// quietly blend two different images.
+
+#include "framebuffer.h"
+#include "mapped_file.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+struct checkpoint_header {
+    char magic[8];          // "RTCKPT\0\0"
+    uint32_t version;
+    uint32_t unused;
+    int32_t width, height;
+    uint64_t render_key;    // Scene and camera of the render
+    uint64_t sampler_key;   // Its sampler (sampler::identity)
+};
+
+// What a checkpoint must match to be continued. The two parts are kept apart to tell the user which differs.
+struct checkpoint_fingerprint {
+    uint64_t render;        // Scene and camera
+    uint64_t sampler;       // sampler::identity, which for stratified samples includes the sample count
+};
+
+constexpr char checkpoint_magic[8] = {'R', 'T', 'C', 'K', 'P', 'T', 0, 0};
+constexpr uint32_t checkpoint_version = 3;
+
+// Writes the image to path + ".tmp" and renames it over path once it is complete and on disk,
+// so an interruption at any moment leaves either the old or the new checkpoint, never a partial one.
+inline bool save_checkpoint(const std::string& path, const framebuffer& image, const checkpoint_fingerprint& fingerprint) {
+    int w = image.width(), h = image.height();
+    size_t pixels = size_t(w) * h;
+
+    checkpoint_header header;
+    std::memcpy(header.magic, checkpoint_magic, sizeof header.magic);
+    header.version = checkpoint_version;
+    header.unused = 0;
+    header.width = w;
+    header.height = h;
+    header.render_key = fingerprint.render;
+    header.sampler_key = fingerprint.sampler;
+
+    std::vector<char> bytes(sizeof header + pixels * (3 * sizeof(float) + sizeof(uint32_t)));
+    std::memcpy(bytes.data(), &header, sizeof header);
+    auto* sums = reinterpret_cast<float*>(bytes.data() + sizeof header);
+    auto* counts = reinterpret_cast<uint32_t*>(sums + 3 * pixels);
+    image.read_tile(0, 0, w, h, sums, counts);
+
+    std::string temp_path = path + ".tmp";
+    int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+
+    bool ok = true;
+    for (size_t done = 0; ok && done < bytes.size(); ) {
+        ssize_t n = ::write(fd, bytes.data() + done, bytes.size() - done);
+        if (n < 0 && errno == EINTR) continue;
+        ok = n > 0;
+        if (ok) done += size_t(n);
+    }
+    ok = ok && fsync(fd) == 0;
+    ok = (::close(fd) == 0) && ok;
+
+    if (!ok || std::rename(temp_path.c_str(), path.c_str()) != 0) {
+        std::remove(temp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Replaces image with the checkpoint at path. Returns false (and leaves image alone) if there is no
+// readable checkpoint there, or if it was rendered with another fingerprint.
+inline bool load_checkpoint(const std::string& path, framebuffer& image, const checkpoint_fingerprint& fingerprint) {
+    mapped_file file(path);
+    if (!file.is_open() || file.size() < sizeof(checkpoint_header))
+        return false;
+
+    checkpoint_header header;
+    std::memcpy(&header, file.data(), sizeof header);
+    if (std::memcmp(header.magic, checkpoint_magic, sizeof header.magic) != 0 ||
+        header.version != checkpoint_version || header.width <= 0 || header.height <= 0)
+        return false;
+    if (header.render_key != fingerprint.render) {
+        clog << path << " was rendered from a different scene or camera\n";
+        return false;
+    }
+    if (header.sampler_key != fingerprint.sampler) {
+        clog << path << " was rendered with a different sampler (-p), or with stratified samples laid out for a"
+                " different -n: the strata of a stratified render depend on its total sample count, so it can only"
+                " be continued with the -n it was started with\n";
+        return false;
+    }
+
+    size_t pixels = size_t(header.width) * size_t(header.height);
+    if (file.size() != sizeof header + pixels * (3 * sizeof(float) + sizeof(uint32_t)))
+        return false;
+
+    // The mapping is page aligned and the header is a multiple of 8 bytes, so the arrays can be read in place
+    auto* sums = reinterpret_cast<const float*>(file.data() + sizeof header);
+    auto* counts = reinterpret_cast<const uint32_t*>(sums + 3 * pixels);
+
+    image = framebuffer(header.width, header.height);
+    image.add_tile(0, 0, header.width, header.height, sums, counts);
+    return true;
+}
+
+#endif
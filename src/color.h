@@ -14,9 +14,9 @@ void write_color(ostream& out, const color& pixel_color) {
     auto b = pixel_color.z();
 
     static const interval intensity(0.000, 0.999);
-    int rbyte = int(255.999 * r);   // From [0,1] format to [0,256] format
-    int gbyte = int(255.999 * g);
-    int bbyte = int(255.999 * b);
+    int rbyte = int(256 * intensity.clamp(r));   // From [0,1] format to [0,255] format, out-of-range values are clamped
+    int gbyte = int(256 * intensity.clamp(g));
+    int bbyte = int(256 * intensity.clamp(b));
 
     out << rbyte << ' ' << gbyte << ' ' << bbyte << '\n';   // Output the pixels as required for PPM file
 }
@@ -0,0 +1,226 @@
+#ifndef DENOISER_H
+#define DENOISER_H
+
+// Feature buffers (AOVs) and an edge-avoiding à-trous wavelet filter guided by them
+// (Dammertz et al., "Edge-Avoiding À-Trous Wavelet Transform for fast Global Illumination Filtering", 2010).
+//
+// The filter works on illumination: the image divided by the albedo of the first hit. That removes the surface
+// colors, which the filter would otherwise blur, and they are multiplied back in at the end.
+
+#include "framebuffer.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// The filter loops read about twenty arrays and write four. Proving that they do not overlap takes more runtime
+// checks than the compiler is willing to emit, so without this it leaves the loops scalar.
+#if defined(__clang__)
+#define DENOISER_NO_ALIAS _Pragma("clang loop vectorize(assume_safety)")
+#elif defined(__GNUC__)
+#define DENOISER_NO_ALIAS _Pragma("GCC ivdep")
+#else
+#define DENOISER_NO_ALIAS
+#endif
+
+// Per-pixel first-hit features, one float plane per channel
+class feature_buffers {
+    public:
+        feature_buffers() {}
+
+        feature_buffers(int width, int height) : w(width), h(height) {
+            size_t n = size_t(width) * height;
+            for (auto* plane : planes())
+                plane->assign(n, 0.0f);
+        }
+
+        int width() const  { return w; }
+        int height() const { return h; }
+
+        std::vector<float> albedo[3];   // Surface color of the first hit (the background color for misses)
+        std::vector<float> normal[3];   // Normal at the first hit, facing the camera (0 for misses)
+        std::vector<float> depth;       // Distance from the camera to the first hit (0 for misses)
+
+        void set(int i, int j, const color& a, const vec3& n, real d) {
+            size_t p = size_t(j) * w + i;
+            for (int c = 0; c < 3; c++) {
+                albedo[c][p] = float(a[c]);
+                normal[c][p] = float(n[c]);
+            }
+            depth[p] = float(d);
+        }
+
+        // Writes <prefix>_albedo.pfm, <prefix>_normal.pfm and <prefix>_depth.pfm; false if one cannot be written
+        bool save(const std::string& prefix) const {
+            framebuffer a(w, h), n(w, h), d(w, h);
+            for (int j = 0; j < h; j++) {
+                for (int i = 0; i < w; i++) {
+                    size_t p = size_t(j) * w + i;
+                    a.add(i, j, color(albedo[0][p], albedo[1][p], albedo[2][p]), 1);
+                    n.add(i, j, color(normal[0][p], normal[1][p], normal[2][p]), 1);
+                    d.add(i, j, color(depth[p], depth[p], depth[p]), 1);
+                }
+            }
+            return a.save(prefix + "_albedo.pfm", image_format::pfm)
+                && n.save(prefix + "_normal.pfm", image_format::pfm)
+                && d.save(prefix + "_depth.pfm", image_format::pfm);
+        }
+
+    private:
+        int w = 0, h = 0;
+
+        std::vector<std::vector<float>*> planes() {
+            return {&albedo[0], &albedo[1], &albedo[2], &normal[0], &normal[1], &normal[2], &depth};
+        }
+};
+
+struct denoise_settings {
+    int iterations = 5;             // Filter passes; pass k samples pixels 2^k apart, so 5 passes reach 62 pixels
+    float sigma_color = 0.25f;      // Illumination difference that still mixes (halved every pass)
+    float sigma_normal = 0.3f;      // Normal difference that still mixes
+    float sigma_albedo = 0.1f;      // Albedo difference that still mixes
+    float sigma_depth = 0.02f;      // Depth difference, relative to the depth, that still mixes
+};
+
+// exp(-x) for x >= 0, to about 2e-4 relative. No branches and no library call, so the filter loops vectorize.
+inline float exp_neg(float x) {
+    // Clamps x to 80 on its bit pattern (the same order for non-negative floats): a float comparison
+    // could trap on NaN, and that alone stops the compiler from vectorizing the caller's loop
+    int32_t x_bits;
+    std::memcpy(&x_bits, &x, sizeof x);
+    x_bits = x_bits < 0x42a00000 ? x_bits : 0x42a00000;     // 80.0f
+    std::memcpy(&x, &x_bits, sizeof x);
+
+    float t = -1.44269504f * x;                             // exp(-x) = 2^t, t in [-115.4, 0]
+    int32_t whole = int32_t(t);                             // Rounds toward zero, so the fraction is in (-1, 0]
+    float f = t - float(whole);
+    float p = 1.0f + f * (0.69314718f + f * (0.24022651f + f * (0.05550411f + f * (0.00961813f + f * 0.00133336f))));
+    int32_t bits = (whole + 127) << 23;                     // 2^whole as a float
+    float scale;
+    std::memcpy(&scale, &bits, sizeof scale);
+    return p * scale;
+}
+
+// Returns the filtered image (one sample per pixel). features must have the size of image.
+inline framebuffer denoise(const framebuffer& image, const feature_buffers& features, thread_pool& pool,
+                           const denoise_settings& settings = denoise_settings()) {
+    const int w = image.width(), h = image.height();
+    const size_t n = size_t(w) * h;
+    const float albedo_floor = 1e-3f;      // Keeps the division by a black albedo finite; the multiplication undoes it
+
+    // Illumination planes, and the reciprocal depths the depth weights are relative to
+    std::vector<float> in[3], out[3], inv_depth(n);
+    for (int c = 0; c < 3; c++) {
+        in[c].resize(n);
+        out[c].resize(n);
+    }
+    for (int j = 0; j < h; j++) {
+        for (int i = 0; i < w; i++) {
+            size_t p = size_t(j) * w + i;
+            color c = image.pixel(i, j);
+            for (int k = 0; k < 3; k++)
+                in[k][p] = float(c[k]) / (features.albedo[k][p] + albedo_floor);
+            inv_depth[p] = 1.0f / (features.depth[p] + 1e-3f);
+        }
+    }
+
+    const float kernel[5] = {1.0f/16, 1.0f/4, 3.0f/8, 1.0f/4, 1.0f/16};    // B3 spline
+    const float* an[3] = {features.albedo[0].data(), features.albedo[1].data(), features.albedo[2].data()};
+    const float* nn[3] = {features.normal[0].data(), features.normal[1].data(), features.normal[2].data()};
+    const float* dd = features.depth.data();
+    const float* id = inv_depth.data();
+
+    // Per-thread row accumulators
+    std::vector<std::vector<float>> scratch(size_t(pool.size()), std::vector<float>(4 * size_t(w)));
+
+    for (int pass = 0; pass < settings.iterations; pass++) {
+        int step = 1 << pass;
+        float sigma_color = settings.sigma_color / float(1 << pass);
+        float wc = 1.0f / (sigma_color * sigma_color);
+        float wn = 1.0f / (settings.sigma_normal * settings.sigma_normal);
+        float wa = 1.0f / (settings.sigma_albedo * settings.sigma_albedo);
+        float wd = 1.0f / settings.sigma_depth;
+
+        pool.parallel_for(h, [&](int y, int worker) {
+            float* sum_r = scratch[worker].data();
+            float* sum_g = sum_r + w;
+            float* sum_b = sum_g + w;
+            float* sum_w = sum_b + w;
+            std::fill(sum_r, sum_r + 4 * size_t(w), 0.0f);
+
+            const size_t row = size_t(y) * w;
+
+            for (int ty = -2; ty <= 2; ty++) {
+                int qy = y + ty * step;
+                if (qy < 0 || qy >= h) continue;
+                const size_t qrow = size_t(qy) * w;
+
+                for (int tx = -2; tx <= 2; tx++) {
+                    const int dx = tx * step;
+                    const float k = kernel[ty + 2] * kernel[tx + 2];
+                    const int x_begin = std::max(0, -dx), x_end = std::min(w, w - dx);   // Taps outside the image are skipped
+                    if (x_begin >= x_end) continue;
+
+                    // The run of pixels x_begin .. x_end-1 of this row (p0) and the pixels at offset (dx, qy - y) from
+                    // them (p1). Both start inside the image, so no pointer is formed outside the arrays.
+                    const size_t p0 = row + size_t(x_begin), p1 = qrow + size_t(x_begin + dx);
+                    const int count = x_end - x_begin;
+                    const float *r0 = in[0].data() + p0, *g0 = in[1].data() + p0, *b0 = in[2].data() + p0;
+                    const float *r1 = in[0].data() + p1, *g1 = in[1].data() + p1, *b1 = in[2].data() + p1;
+                    const float *a0x = an[0] + p0, *a0y = an[1] + p0, *a0z = an[2] + p0;
+                    const float *a1x = an[0] + p1, *a1y = an[1] + p1, *a1z = an[2] + p1;
+                    const float *n0x = nn[0] + p0, *n0y = nn[1] + p0, *n0z = nn[2] + p0;
+                    const float *n1x = nn[0] + p1, *n1y = nn[1] + p1, *n1z = nn[2] + p1;
+                    const float *d0 = dd + p0, *d1 = dd + p1, *id0 = id + p0;
+                    float *out_r = sum_r + x_begin, *out_g = sum_g + x_begin, *out_b = sum_b + x_begin, *out_w = sum_w + x_begin;
+
+                    DENOISER_NO_ALIAS
+                    for (int x = 0; x < count; x++) {
+                        float dr = r1[x] - r0[x], dg = g1[x] - g0[x], db = b1[x] - b0[x];
+                        float dax = a1x[x] - a0x[x], day = a1y[x] - a0y[x], daz = a1z[x] - a0z[x];
+                        float dnx = n1x[x] - n0x[x], dny = n1y[x] - n0y[x], dnz = n1z[x] - n0z[x];
+                        float dz = std::abs(d1[x] - d0[x]) * id0[x];
+
+                        float distance = wc * (dr*dr + dg*dg + db*db)
+                                       + wa * (dax*dax + day*day + daz*daz)
+                                       + wn * (dnx*dnx + dny*dny + dnz*dnz)
+                                       + wd * dz;
+                        float weight = k * exp_neg(distance);
+
+                        out_r[x] += weight * r1[x];
+                        out_g[x] += weight * g1[x];
+                        out_b[x] += weight * b1[x];
+                        out_w[x] += weight;
+                    }
+                }
+            }
+
+            DENOISER_NO_ALIAS
+            for (int x = 0; x < w; x++) {       // The center tap has weight > 0, so sum_w never is 0
+                float inv = 1.0f / sum_w[x];
+                out[0][row + x] = sum_r[x] * inv;
+                out[1][row + x] = sum_g[x] * inv;
+                out[2][row + x] = sum_b[x] * inv;
+            }
+        });
+
+        for (int c = 0; c < 3; c++)
+            std::swap(in[c], out[c]);
+    }
+
+    framebuffer result(w, h);
+    for (int j = 0; j < h; j++) {
+        for (int i = 0; i < w; i++) {
+            size_t p = size_t(j) * w + i;
+            result.add(i, j, color(in[0][p] * (features.albedo[0][p] + albedo_floor),
+                                   in[1][p] * (features.albedo[1][p] + albedo_floor),
+                                   in[2][p] * (features.albedo[2][p] + albedo_floor)), 1);
+        }
+    }
+    return result;
+}
+
+#endif
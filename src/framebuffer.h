@@ -0,0 +1,181 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include "color.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+enum class image_format {
+    p3,     // Text PPM, the original output
+    p6,     // Binary PPM, same 8-bit image in a third of the size
+    pfm     // Portable float map, keeps the full float values for later compositing
+};
+
+// Picks the format from a file name: .pfm gives PFM, anything else binary PPM
+inline image_format format_from_path(const std::string& path) {
+    auto dot = path.rfind('.');
+    if (dot != std::string::npos && path.substr(dot) == ".pfm")
+        return image_format::pfm;
+    return image_format::p6;
+}
+
+// In-memory image that renders accumulate into.
+// Every pixel keeps the float sum of its samples and how many samples were added,
+// so more samples can be added later and the average is taken only when the image is written.
+class framebuffer {
+    public:
+        framebuffer() {}
+
+        framebuffer(int width, int height) : w(width), h(height),
+                                             sums(size_t(width) * height * 3, 0.0f),
+                                             counts(size_t(width) * height, 0) {}
+
+        int width() const  { return w; }
+        int height() const { return h; }
+
+        void add(int i, int j, const color& sample_sum, int sample_count) {
+            size_t p = pixel_index(i, j);
+            sums[3*p + 0] += float(sample_sum.x());
+            sums[3*p + 1] += float(sample_sum.y());
+            sums[3*p + 2] += float(sample_sum.z());
+            counts[p] += uint32_t(sample_count);
+        }
+
+        int sample_count(int i, int j) const { return int(counts[pixel_index(i, j)]); }
+
+        int min_sample_count() const {
+            return counts.empty() ? 0 : int(*std::min_element(counts.begin(), counts.end()));
+        }
+
+        bool has_samples() const {
+            return std::any_of(counts.begin(), counts.end(), [](uint32_t c) { return c > 0; });
+        }
+
+        // Copies the raw sums (3 per pixel) and sample counts of the pixels in [x0, x1) x [y0, y1), row by row.
+        // Together with add_tile this moves partial images between processes without any rounding.
+        void read_tile(int x0, int y0, int x1, int y1, float* tile_sums, uint32_t* tile_counts) const {
+            for (int j = y0; j < y1; j++) {
+                size_t p = pixel_index(x0, j);
+                size_t n = size_t(x1 - x0);
+                std::memcpy(tile_sums, &sums[3*p], 3 * n * sizeof(float));
+                std::memcpy(tile_counts, &counts[p], n * sizeof(uint32_t));
+                tile_sums += 3 * n;
+                tile_counts += n;
+            }
+        }
+
+        void add_tile(int x0, int y0, int x1, int y1, const float* tile_sums, const uint32_t* tile_counts) {
+            for (int j = y0; j < y1; j++) {
+                for (int i = x0; i < x1; i++) {
+                    size_t p = pixel_index(i, j);
+                    sums[3*p + 0] += *tile_sums++;
+                    sums[3*p + 1] += *tile_sums++;
+                    sums[3*p + 2] += *tile_sums++;
+                    counts[p] += *tile_counts++;
+                }
+            }
+        }
+
+        color pixel(int i, int j) const {           // Average of the samples of pixel (i, j)
+            size_t p = pixel_index(i, j);
+            if (counts[p] == 0) return color(0,0,0);
+            float scale = 1.0f / float(counts[p]);
+            return color(sums[3*p + 0] * scale, sums[3*p + 1] * scale, sums[3*p + 2] * scale);
+        }
+
+        void write(std::ostream& out, image_format format) const {
+            switch (format) {
+                case image_format::p3:  write_p3(out);  break;
+                case image_format::p6:  write_p6(out);  break;
+                case image_format::pfm: write_pfm(out); break;
+            }
+        }
+
+        // Writes the image to a file; returns false if the file cannot be written
+        bool save(const std::string& path, image_format format) const {
+            std::ofstream out(path, std::ios::binary);
+            if (!out) return false;
+            write(out, format);
+            return bool(out);
+        }
+
+    private:
+        int w = 0, h = 0;
+        std::vector<float> sums;        // r, g, b sums of every pixel, row by row from the top
+        std::vector<uint32_t> counts;   // Samples added to every pixel
+
+        size_t pixel_index(int i, int j) const { return size_t(j) * w + i; }
+
+        static int to_byte(double x) {
+            static const interval intensity(0.000, 0.999);
+            return int(256 * intensity.clamp(x));   // From [0,1] to [0,255], out-of-range values are clamped
+        }
+
+        void write_p3(std::ostream& out) const {
+            out << "P3\n" << w << ' ' << h << "\n255\n";
+
+            // Formats the whole image into one buffer instead of three stream insertions per pixel
+            std::string text;
+            text.reserve(size_t(w) * h * 12);
+            char line[16];
+            for (int j = 0; j < h; j++) {
+                for (int i = 0; i < w; i++) {
+                    color c = pixel(i, j);
+                    int n = std::snprintf(line, sizeof line, "%d %d %d\n", to_byte(c.x()), to_byte(c.y()), to_byte(c.z()));
+                    text.append(line, size_t(n));
+                }
+            }
+            out.write(text.data(), std::streamsize(text.size()));
+        }
+
+        void write_p6(std::ostream& out) const {
+            out << "P6\n" << w << ' ' << h << "\n255\n";
+
+            std::vector<unsigned char> bytes(size_t(w) * h * 3);
+            size_t k = 0;
+            for (int j = 0; j < h; j++) {
+                for (int i = 0; i < w; i++) {
+                    color c = pixel(i, j);
+                    bytes[k++] = (unsigned char)to_byte(c.x());
+                    bytes[k++] = (unsigned char)to_byte(c.y());
+                    bytes[k++] = (unsigned char)to_byte(c.z());
+                }
+            }
+            out.write(reinterpret_cast<const char*>(bytes.data()), std::streamsize(bytes.size()));
+        }
+
+        void write_pfm(std::ostream& out) const {
+            // A negative scale marks little-endian data; PFM rows go from the bottom of the image to the top
+            out << "PF\n" << w << ' ' << h << "\n-1.0\n";
+
+            std::vector<float> values(size_t(w) * h * 3);
+            size_t k = 0;
+            for (int j = h - 1; j >= 0; j--) {
+                for (int i = 0; i < w; i++) {
+                    color c = pixel(i, j);
+                    values[k++] = float(c.x());
+                    values[k++] = float(c.y());
+                    values[k++] = float(c.z());
+                }
+            }
+
+            std::vector<unsigned char> bytes(values.size() * 4);
+            for (size_t v = 0; v < values.size(); v++) {
+                uint32_t bits;
+                std::memcpy(&bits, &values[v], 4);
+                bytes[4*v + 0] = (unsigned char)(bits);
+                bytes[4*v + 1] = (unsigned char)(bits >> 8);
+                bytes[4*v + 2] = (unsigned char)(bits >> 16);
+                bytes[4*v + 3] = (unsigned char)(bits >> 24);
+            }
+            out.write(reinterpret_cast<const char*>(bytes.data()), std::streamsize(bytes.size()));
+        }
+};
+
+#endif
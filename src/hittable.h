@@ -1,17 +1,25 @@
 #ifndef HITTABLE_H
 #define HITTABLE_H
 
+#include "aabb.h"
 #include "ray.h"
 
-class material; 
+#include <cstdint>
 
 class hit_record {
     public:
         point3 p;
         vec3 normal;
-        double t;
+        real t;
+        real p_error = 0;     // Bound on the rounding error of p (see hit_point_error)
         bool front_face;
-        shared_ptr<material> mat;
+        uint32_t mat = 0;     // Index of the surface material in the scene's material_table
+        int32_t sphere = -1;  // Index of the sphere in the scene's sphere arrays (see sphere_batch::first_index), else -1
+
+        // Ray leaving the hit point in `direction`, such as a scattered ray
+        ray spawn_ray(const vec3& direction) const {
+            return ray(offset_ray_origin(p, normal, p_error, direction), direction);
+        }
 
         void set_face_normal(const ray& r, const vec3& outward_normal) {
             
@@ -31,7 +39,9 @@ class hittable {
 
 
     virtual bool hit(const ray& r, interval ray_t, hit_record& rec) const = 0;
-    
+
+    virtual aabb bounding_box() const = 0;      // Box enclosing the whole object, used by acceleration structures
+
 };
 
 
@@ -14,10 +14,14 @@ class hittable_list : public hittable {
         hittable_list() {}                                              // Default constructor
         hittable_list(shared_ptr<hittable> object) { add(object); }     // Parametrised constructor
 
-        void clear() { objects.clear(); }
+        void clear() {
+            objects.clear();
+            bbox = aabb();
+        }
 
         void add(shared_ptr<hittable> object) {
             objects.push_back(object);
+            bbox = aabb(bbox, object->bounding_box());  // Grows the box of the list to cover the new object
         }
 
         bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
@@ -35,6 +39,11 @@ class hittable_list : public hittable {
             return hit_anything;
         }
 
+        aabb bounding_box() const override { return bbox; }
+
+    private:
+        aabb bbox;
+
 
 };
 
@@ -0,0 +1,85 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "affine_transform.h"
+#include "bvh.h"
+#include "hittable.h"
+
+#include <vector>
+
+// A placement of shared geometry: any hittable, a whole BVH included, seen through an affine transform.
+// The geometry is stored once however many instances use it; an instance only adds its transform.
+// Rays are moved into object space instead of the object into world space. The direction is not normalized
+// there, so the hit distance t means the same in both spaces.
+class instance : public hittable {
+    public:
+        instance(shared_ptr<hittable> object, const affine_transform& object_to_world)
+          : object(std::move(object)), object_to_world(object_to_world) {
+            bbox = object_to_world.apply_box(this->object->bounding_box());
+        }
+
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            ray local(object_to_world.apply_inverse_point(r.origin()), object_to_world.apply_inverse_vector(r.direction()));
+            if (!object->hit(local, ray_t, rec))
+                return false;
+
+            // The object already made the normal face the ray; the inverse transpose keeps that side
+            rec.p = object_to_world.apply_point(rec.p);
+            rec.normal = unit_vector(object_to_world.apply_normal(rec.normal));
+            rec.p_error = object_to_world.max_stretch() * rec.p_error + hit_point_error(rec.p, 0);
+            rec.sphere = -1;        // A sphere index inside the object is not one of the scene's (lights are found by it)
+            return true;
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        void set_transform(const affine_transform& new_object_to_world) {      // Moves the instance (animation)
+            object_to_world = new_object_to_world;
+            bbox = object_to_world.apply_box(object->bounding_box());
+        }
+
+    private:
+        shared_ptr<hittable> object;
+        affine_transform object_to_world;
+        aabb bbox;
+};
+
+// Top-level acceleration structure: a BVH over instances. The instances sit in one array (no allocation
+// per instance), and every leaf of the top-level BVH leads into the BVH of the instanced object.
+class instance_set : public hittable {
+    public:
+        explicit instance_set(std::vector<instance> instances)
+          : instances(make_shared<std::vector<instance>>(std::move(instances))) {
+            std::vector<shared_ptr<hittable>> pointers;
+            pointers.reserve(this->instances->size());
+            for (auto& item : *this->instances)
+                pointers.emplace_back(this->instances, &item);     // Shares ownership of the array; no allocation
+            top_level = make_shared<bvh_node>(pointers, 1);         // One instance per leaf: instances are expensive to test
+        }
+
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            return top_level->hit(r, ray_t, rec);
+        }
+
+        aabb bounding_box() const override { return top_level->bounding_box(); }
+
+        int size() const { return int(instances->size()); }
+
+        // Bytes of the instances and the top-level BVH (the instanced objects not included)
+        size_t memory_bytes() const { return instances->capacity() * sizeof(instance) + top_level->memory_bytes(); }
+
+        // Moves an instance. The top-level BVH is out of date until update is called.
+        void set_transform(int index, const affine_transform& object_to_world) {
+            (*instances)[size_t(index)].set_transform(object_to_world);
+        }
+
+        // Brings the top-level BVH up to date after instances moved: refits it, or rebuilds it when refitting
+        // made it much worse (see bvh_node::update). Returns true if it was rebuilt.
+        bool update(double max_growth = 1.5) { return top_level->update(max_growth); }
+
+    private:
+        shared_ptr<std::vector<instance>> instances;
+        shared_ptr<bvh_node> top_level;
+};
+
+#endif
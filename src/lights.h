@@ -0,0 +1,137 @@
+#ifndef LIGHTS_H
+#define LIGHTS_H
+
+#include "hittable.h"
+#include "material.h"
+#include "render_stats.h"
+#include "sampler.h"
+
+#include <cmath>
+#include <unordered_map>
+#include <vector>
+
+// Next event estimation: at every diffuse or glossy hit, the path tracer also aims one shadow ray at a light
+// picked from a light_list, instead of waiting for a bounce to find the light by chance. Small lights that
+// scattered rays almost never hit then light the scene after a few samples.
+//
+// A light can now be reached two ways, by the shadow ray and by a scattered ray that happens to hit it. The two
+// estimates are combined with multiple importance sampling (power heuristic): each is weighted by how likely
+// its own strategy was to pick that direction, so neither counts the light twice and the noise of the worse
+// strategy (light sampling on glossy metal, scattering towards a small light) is kept down.
+
+// Spherical area lights. Each one is sampled over the cone of directions in which it is seen from the shaded
+// point, so every shadow ray is aimed at its visible side. A light is one sphere of the scene's sphere arrays, and
+// hits find their light by the index of the sphere they hit (hit_record::sphere).
+class light_list {
+    public:
+        struct sphere_light {
+            point3 center;
+            real radius;
+        };
+
+        // Adds sphere number `sphere` of the scene's sphere arrays, which has a light material
+        void add(const point3& center, real radius, int32_t sphere) {
+            by_sphere[sphere] = int(lights.size());
+            lights.push_back({center, radius});
+        }
+        bool empty() const { return lights.empty(); }
+        int size() const { return int(lights.size()); }
+
+        // Picks a light with `choice` (uniform in [0,1)) and a direction from p towards it with u. Returns false
+        // if p is inside the light. pdf is the density of direction over solid angle, the light choice included.
+        bool sample(const point3& p, double choice, const sample2& u, vec3& direction, real& pdf, int& light) const {
+            light = std::min(int(choice * lights.size()), int(lights.size()) - 1);
+            const sphere_light& s = lights[light];
+
+            vec3 to_center = s.center - p;
+            real distance_squared = to_center.length_squared();
+            real one_minus_cos_max = cone_size(s.radius, distance_squared);
+            if (one_minus_cos_max <= 0) return false;
+
+            // Uniform over the cone: 1 - cos theta is uniform in [0, 1 - cos theta_max]
+            real one_minus_cos = real(u.x) * one_minus_cos_max;
+            real cos_theta = 1 - one_minus_cos;
+            real sin_theta = std::sqrt(std::fmax(real(0), one_minus_cos * (2 - one_minus_cos)));
+            real phi = 2 * real(pi) * real(u.y);
+
+            vec3 w = to_center / std::sqrt(distance_squared);
+            vec3 a = std::fabs(w.x()) > real(0.9) ? vec3(0,1,0) : vec3(1,0,0);
+            vec3 v = unit_vector(cross(w, a));
+            vec3 t = cross(w, v);
+            direction = sin_theta * std::cos(phi) * t + sin_theta * std::sin(phi) * v + cos_theta * w;
+            pdf = 1 / (lights.size() * 2 * real(pi) * one_minus_cos_max);
+            return true;
+        }
+
+        // Density with which sample would pick `direction` from p towards light number `light`
+        real pdf(const point3& p, const vec3& direction, int light) const {
+            const sphere_light& s = lights[light];
+            vec3 to_center = s.center - p;
+            real distance_squared = to_center.length_squared();
+            real one_minus_cos_max = cone_size(s.radius, distance_squared);
+            if (one_minus_cos_max <= 0) return 0;
+
+            real cos_theta = dot(unit_vector(direction), to_center) / std::sqrt(distance_squared);
+            if (cos_theta < 1 - one_minus_cos_max) return 0;
+            return 1 / (lights.size() * 2 * real(pi) * one_minus_cos_max);
+        }
+
+        // The light that rec hit, or -1 if it is not one of the sampled lights
+        int find(const hit_record& rec) const {
+            if (rec.sphere < 0) return -1;
+            auto it = by_sphere.find(rec.sphere);
+            return it == by_sphere.end() ? -1 : it->second;
+        }
+
+    private:
+        std::vector<sphere_light> lights;
+        std::unordered_map<int32_t, int> by_sphere;     // Index of each light's sphere -> its index in lights
+
+        // 1 - cos of the half-angle under which a sphere is seen, written so it stays exact for distant lights
+        static real cone_size(real radius, real distance_squared) {
+            real sin2 = radius * radius / distance_squared;
+            if (sin2 >= 1) return 0;                                    // Inside the sphere
+            return sin2 / (1 + std::sqrt(1 - sin2));
+        }
+};
+
+inline real power_heuristic(real pdf, real other_pdf) {
+    return pdf * pdf / (pdf * pdf + other_pdf * other_pdf);
+}
+
+// Light that reaches rec.p (hit by r_in, made of mat) straight from a light, through a shadow ray, weighted
+// against the chance that scattering would have found the same direction. The caller multiplies it by the
+// path throughput. Draws the same random numbers whether the shadow ray is blocked or not.
+inline color sample_direct_light(const hittable& world, const material_table& materials, const light_list& lights,
+                                 const material& mat, const ray& r_in, const hit_record& rec) {
+    double choice = sample_1d();
+    sample2 u = sample_2d();
+    vec3 direction;
+    real light_pdf;
+    int light;
+    if (!lights.sample(rec.p, choice, u, direction, light_pdf, light) || dot(direction, rec.normal) <= 0)
+        return color(0,0,0);
+
+    // The material's color times its scatter density is its reflectance (BRDF times cosine) for this direction
+    real bsdf_pdf = scatter_pdf(mat, r_in, rec, direction);
+    if (bsdf_pdf <= 0) return color(0,0,0);
+
+    RENDER_STAT(thread_render_stats().count_shadow_ray());
+    hit_record shadow;
+    if (!world.hit(rec.spawn_ray(direction), interval(ray_t_min, infinity), shadow) || lights.find(shadow) != light)
+        return color(0,0,0);
+
+    real weight = power_heuristic(light_pdf, bsdf_pdf);
+    return base_color(mat) * emitted(materials[shadow.mat], shadow) * (bsdf_pdf * weight / light_pdf);
+}
+
+// MIS weight of the light a scattered ray r picks up at rec. prev_scatter_pdf is the density with which the
+// previous bounce picked r's direction, 0 for camera rays and specular bounces, which light sampling cannot match.
+inline real emission_weight(const light_list& lights, const ray& r, const hit_record& rec, real prev_scatter_pdf) {
+    if (prev_scatter_pdf <= 0 || lights.empty()) return 1;
+    int light = lights.find(rec);
+    if (light < 0) return 1;
+    return power_heuristic(prev_scatter_pdf, lights.pdf(r.origin(), r.direction(), light));
+}
+
+#endif
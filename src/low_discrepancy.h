@@ -0,0 +1,175 @@
+#ifndef LOW_DISCREPANCY_H
+#define LOW_DISCREPANCY_H
+
+// Building blocks of the stratified, Sobol and blue-noise samplers: the first two Sobol dimensions,
+// hash-based Owen scrambling (Burley, "Practical Hash-based Owen Scrambling", JCGT 2020), Kensler's
+// hashed permutation ("Correlated Multi-Jittered Sampling", 2013) and a void-and-cluster blue-noise mask.
+// Everything here is a pure function of its arguments, so any sample can be computed on its own.
+
+#include "random.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+inline uint32_t reverse_bits(uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+// Sobol dimension 0 (van der Corput) and 1 as 32-bit fractions. Together they are a (0,2)-sequence:
+// every power-of-two prefix puts exactly one point in each of the equal-area boxes of that many points.
+inline uint32_t sobol_0(uint32_t index) { return reverse_bits(index); }
+
+inline uint32_t sobol_1(uint32_t index) {
+    // Its direction numbers are the rows of Pascal's triangle mod 2, each one the last XOR itself shifted by one.
+    // The result is linear in the bits of index, so it is looked up a byte at a time.
+    static const std::array<uint32_t, 4 * 256> table = [] {
+        std::array<uint32_t, 4 * 256> t{};
+        uint32_t direction = 1u << 31;
+        for (int bit = 0; bit < 32; bit++, direction ^= direction >> 1) {
+            int byte = bit / 8, mask = 1 << (bit % 8);
+            for (int value = 0; value < 256; value++)
+                if (value & mask) t[byte * 256 + value] ^= direction;
+        }
+        return t;
+    }();
+    return table[index & 255] ^ table[256 + ((index >> 8) & 255)] ^ table[512 + ((index >> 16) & 255)] ^ table[768 + (index >> 24)];
+}
+
+// Owen scrambling of a 32-bit fraction: a random permutation of every level of the binary subdivision,
+// decided by seed. It keeps the stratification of the sequence and randomizes everything else.
+inline uint32_t owen_scramble(uint32_t x, uint32_t seed) {
+    x = reverse_bits(x);
+    x += seed;                      // Laine-Karras style hash: each bit only depends on the bits below it
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits(x);
+}
+
+inline double to_unit(uint32_t x) { return x * (1.0 / 4294967296.0); }             // 32-bit fraction to [0,1)
+
+inline double hash_to_unit(uint64_t key) { return double(mix_bits(key) >> 11) * (1.0 / 9007199254740992.0); }
+
+inline uint64_t hash_combine(uint64_t a, uint64_t b) { return mix_bits(a ^ (b + 0x9e3779b97f4a7c15ULL + (a << 6) + (a >> 2))); }
+
+// Element `index` of a random permutation of [0, n), decided by seed (Kensler's permute)
+inline uint32_t permute(uint32_t index, uint32_t n, uint32_t seed) {
+    uint32_t w = n - 1;
+    w |= w >> 1;  w |= w >> 2;  w |= w >> 4;  w |= w >> 8;  w |= w >> 16;
+    do {        // Permutes within the next power of two and walks out of the range again (cycle walking)
+        index ^= seed;              index *= 0xe170893du;
+        index ^= seed >> 16;        index ^= (index & w) >> 4;
+        index ^= seed >> 8;         index *= 0x0929eb3fu;
+        index ^= seed >> 23;        index ^= (index & w) >> 1;
+        index *= 1 | seed >> 27;    index *= 0x6935fa69u;
+        index ^= (index & w) >> 11; index *= 0x74dcb303u;
+        index ^= (index & w) >> 2;  index *= 0x9e501cc3u;
+        index ^= (index & w) >> 2;  index *= 0xc860a3dfu;
+        index &= w;                 index ^= index >> 5;
+    } while (index >= n);
+    return (index + seed) % n;
+}
+
+// Tileable blue-noise dither mask: every value 0..size²-1 once, arranged so that pixels with nearby values are
+// far apart (Ulichney's void-and-cluster method). Built once, on first use, in a few tens of milliseconds.
+class blue_noise_mask {
+    public:
+        static constexpr int size = 64;
+
+        static const blue_noise_mask& get() {
+            static const blue_noise_mask mask;
+            return mask;
+        }
+
+        // Rank of pixel (x, y) (wrapped around) divided by the pixel count, in [0,1)
+        double value(int x, int y) const {
+            return (rank[size_t(y & (size - 1)) * size + (x & (size - 1))] + 0.5) / double(size * size);
+        }
+
+    private:
+        std::vector<uint32_t> rank;
+
+        blue_noise_mask() {
+            const int n = size * size;
+            const double sigma = 1.9;
+
+            // Gaussian energy every set pixel adds to the pixels around it, on the torus
+            std::vector<double> kernel(n);
+            for (int y = 0; y < size; y++) {
+                for (int x = 0; x < size; x++) {
+                    int dx = std::min(x, size - x), dy = std::min(y, size - y);
+                    kernel[size_t(y) * size + x] = std::exp(-(dx*dx + dy*dy) / (2 * sigma * sigma));
+                }
+            }
+
+            std::vector<uint8_t> on(n, 0);
+            std::vector<double> energy(n, 0.0);
+            auto toggle = [&](int p, bool set) {
+                on[p] = set;
+                double sign = set ? 1 : -1;
+                int px = p % size, py = p / size;
+                for (int y = 0; y < size; y++) {
+                    const double* k = &kernel[size_t((y - py + size) & (size - 1)) * size];
+                    double* e = &energy[size_t(y) * size];
+                    for (int x = 0; x < size; x++)
+                        e[x] += sign * k[(x - px + size) & (size - 1)];
+                }
+            };
+            auto tightest_cluster = [&]() {     // The set pixel with the most energy
+                int best = -1;
+                for (int p = 0; p < n; p++)
+                    if (on[p] && (best < 0 || energy[p] > energy[best])) best = p;
+                return best;
+            };
+            auto largest_void = [&]() {         // The empty pixel with the least energy
+                int best = -1;
+                for (int p = 0; p < n; p++)
+                    if (!on[p] && (best < 0 || energy[p] < energy[best])) best = p;
+                return best;
+            };
+
+            // Initial pattern: a tenth of the pixels at random, then moved from clusters to voids until it settles
+            int initial = n / 10;
+            pcg32 rng(0x5eed, 0xb1);
+            for (int placed = 0; placed < initial; ) {
+                int p = int(rng.next_uint() % uint32_t(n));
+                if (!on[p]) { toggle(p, true); placed++; }
+            }
+            while (true) {
+                int cluster = tightest_cluster();
+                toggle(cluster, false);
+                int gap = largest_void();
+                toggle(gap, true);
+                if (gap == cluster) break;
+            }
+            std::vector<uint8_t> start = on;
+            std::vector<double> start_energy = energy;
+
+            rank.assign(n, 0);
+            // Ranks below the initial count: take the pattern apart, tightest cluster first
+            for (int r = initial - 1; r >= 0; r--) {
+                int cluster = tightest_cluster();
+                toggle(cluster, false);
+                rank[cluster] = uint32_t(r);
+            }
+            // Ranks from there on: fill the largest void, one pixel at a time
+            on = start;
+            energy = start_energy;
+            for (int r = initial; r < n; r++) {
+                int gap = largest_void();
+                toggle(gap, true);
+                rank[gap] = uint32_t(r);
+            }
+        }
+};
+
+#endif
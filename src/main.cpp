@@ -2,85 +2,109 @@
 
 #include "hittable.h"
 #include "hittable_list.h"
+#include "bvh.h"
 #include "sphere.h" 
+#include "sphere_batch.h"
 #include "camera.h"
 #include "material.h"
+#include "scene_file.h"
+#include "scenes.h"
+#include "render_stats.h"
+#include "animation.h"
+#include "render_service.h"
+
+#include <cstring>
+#include <fstream>
 
 using namespace std;
 
 
-int main() {
-
-    hittable_list world;  // Creates the container that holds the collection of all objects that rays can hit
-
-    auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
-    world.add(make_shared<sphere>(point3(0,-1000,0), 1000, ground_material));
-
-    for (int a = -1; a < 1; a++) {
-        for (int b = -11; b < 11; b++) {
-            auto choose_mat = random_double();
-            point3 center(a + 0.9*random_double(), 0.2, b + 0.9*random_double());
-
-            if ((center - point3(4, 0.2, 0)).length() > 0.9) {
-                shared_ptr<material> sphere_material;
-
-                if (choose_mat < 0.8) {
-                    // diffuse
-                    auto albedo = color::random() * color::random();
-                    sphere_material = make_shared<lambertian>(albedo);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                } else if (choose_mat < 0.95) {
-                    // metal
-                    auto albedo = color::random(0.5, 1);
-                    auto fuzz = random_double(0, 0.5);
-                    sphere_material = make_shared<metal>(albedo, fuzz);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                } else {
-                    // glass
-                    sphere_material = make_shared<dielectric>(1.5);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                }
-            }
+int main(int argc, char* argv[]) {
+
+    const char* usage = "Usage: raytracer [-s scene_file] [-o output_file] [-f p3|p6|pfm] [-S stats.json]\n"
+                        "                 [-w worker_processes] [-c checkpoint_file] [-n samples_per_pixel]\n"
+                        "                 [-d] [-a feature_prefix] [-p independent|stratified|sobol|bluenoise] [-F frames]\n"
+                        "                 [-P preview_file] [-L socket_path] [-I recursive|wavefront] [-r]\n"
+                        "                 [-A noise_threshold] [-m spp_map_file]\n";
+    string scene_path;
+    string output_path;
+    string output_format;
+    string stats_path;
+    int worker_processes = 0;
+    string checkpoint_path;
+    int samples_per_pixel = 0;
+    bool denoise = false;
+    bool sort_rays = false;
+    string feature_prefix;
+    string sampler_name = "sobol";
+    int frames = 0;
+    string preview_path;
+    string listen_path;
+    string integrator_name = "recursive";
+    double adaptive_threshold = 0;
+    string spp_map_path;
+    for (int k = 1; k < argc; k += 2) {
+        if (strcmp(argv[k], "-d") == 0 || strcmp(argv[k], "-r") == 0) {   // The options without a value
+            if (argv[k][1] == 'd') denoise = true;
+            else sort_rays = true;
+            k--;
+            continue;
+        }
+        if (k + 1 == argc) {
+            cerr << "Option " << argv[k] << " needs a value\n" << usage;
+            return 1;
+        }
+        if (strcmp(argv[k], "-s") == 0) scene_path = argv[k+1];
+        else if (strcmp(argv[k], "-o") == 0) output_path = argv[k+1];
+        else if (strcmp(argv[k], "-f") == 0) output_format = argv[k+1];
+        else if (strcmp(argv[k], "-S") == 0) stats_path = argv[k+1];
+        else if (strcmp(argv[k], "-w") == 0) worker_processes = atoi(argv[k+1]);
+        else if (strcmp(argv[k], "-c") == 0) checkpoint_path = argv[k+1];
+        else if (strcmp(argv[k], "-n") == 0) samples_per_pixel = atoi(argv[k+1]);
+        else if (strcmp(argv[k], "-a") == 0) feature_prefix = argv[k+1];
+        else if (strcmp(argv[k], "-p") == 0) sampler_name = argv[k+1];
+        else if (strcmp(argv[k], "-F") == 0) frames = atoi(argv[k+1]);
+        else if (strcmp(argv[k], "-P") == 0) preview_path = argv[k+1];
+        else if (strcmp(argv[k], "-L") == 0) listen_path = argv[k+1];
+        else if (strcmp(argv[k], "-I") == 0) integrator_name = argv[k+1];
+        else if (strcmp(argv[k], "-A") == 0) adaptive_threshold = atof(argv[k+1]);
+        else if (strcmp(argv[k], "-m") == 0) spp_map_path = argv[k+1];
+        else {
+            cerr << "Unknown option " << argv[k] << '\n' << usage;
+            return 1;
         }
     }
 
-    auto material1 = make_shared<dielectric>(1.5);
-    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
-
-    auto material2 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
-    world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
-
-    auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-    world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
-    
-    
-    /*auto R = std::cos(pi/4);
-
-    auto material_left  = make_shared<lambertian>(color(0.9,0,0.5));
-    auto material_right = make_shared<lambertian>(color(0,1,0));
-
-    world.add(make_shared<sphere>(point3(-R, 0, -1), R, material_left));
-    world.add(make_shared<sphere>(point3( R, 0, -1), R, material_right));*/
-    
-    /*auto material_ground = make_shared<lambertian>(color(0.4, 0.9, 0.1));
-    auto material_center = make_shared<lambertian>(color(0.2, 0.3, 1.0));
-    // Hollow glass sphere is modeled just as a bubble of air inside the glass environment
-    auto material_left   = make_shared<dielectric>(1.50);        
-    auto material_bubble = make_shared<dielectric>(1.00 / 1.50);
-    auto material_right = make_shared<metal>(color(0.8, 0.1, 0.2), 1.0);
-
-    world.add(make_shared<sphere>(point3( 0.0, -100.5, -1.0), 100.0, material_ground));
-    world.add(make_shared<sphere>(point3( 0.0, 0.0, -1.2), 0.5, material_center));
-    world.add(make_shared<sphere>(point3(-1.0, 0.0, -1.0), 0.5, material_left));
-    world.add(make_shared<sphere>(point3(-1.0, 0.0, -1.0), 0.4, material_bubble));
-    world.add(make_shared<sphere>(point3( 1.0, 0.0, -1.0), 0.5, material_right));*/
-
     camera cam; // Sets up the camera
 
     cam.aspect_ratio = 16.0/9.0;
     cam.image_width = 1200;
     cam.samples_per_pixel = 500;
     cam.max_depth = 50;
+    cam.roulette_depth = 3;         // After 3 bounces, dim paths are ended at random (and the survivors brightened) instead of traced to max_depth
+    cam.num_threads = 0;            // Render threads (0 = use every hardware core)
+    cam.worker_processes = worker_processes;   // -w: render the tiles in this many processes instead of threads
+    cam.denoise = denoise;          // -d: filter the image guided by first-hit albedo, normals and depth (then ~32 spp are enough)
+    cam.feature_prefix = feature_prefix;       // -a: also write those feature buffers as <prefix>_albedo.pfm, ...
+    if (integrator_name == "wavefront")      cam.integrator = integrator_type::wavefront;  // -I: trace paths in batches, a bounce at a time
+    else if (integrator_name == "recursive") cam.integrator = integrator_type::recursive;  // One path at a time (same image)
+    else {
+        cerr << "Unknown integrator " << integrator_name << '\n' << usage;
+        return 1;
+    }
+    cam.sort_rays = sort_rays;      // -r, with -I wavefront: trace each bounce's rays sorted by origin and direction
+    if (sort_rays && cam.integrator != integrator_type::wavefront) {
+        cerr << "Ray sorting (-r) needs the wavefront integrator (-I wavefront)\n" << usage;
+        return 1;
+    }
+    cam.adaptive = adaptive_threshold > 0;     // -A: move samples from flat regions (sky) to noisy ones (glass, fuzzy metal)
+    if (cam.adaptive)
+        cam.adaptive_threshold = adaptive_threshold;   // ...until their relative noise is below this (0.02 = 2%)
+    cam.spp_map_path = spp_map_path;           // -m: write the samples each pixel got there (adaptive only)
+    if (!spp_map_path.empty() && !cam.adaptive)
+        clog << "A samples-per-pixel map (-m) is only written with adaptive sampling (-A); -m is ignored\n";
+    cam.preview = !preview_path.empty();       // -P: refine the image in passes and write each one there ("-" = stdout)
+    cam.preview_path = preview_path;
 
     cam.vfov = 20;                  // Closiness 
     cam.lookfrom = point3(12,2,3);  // Point of view
@@ -90,7 +114,105 @@ int main() {
     cam.defocus_angle = 0.0;       // Controls the aperture size (how wide the lens opening is)
     cam.focus_dist    = 10.0;        // Sets the distance from the camera to the sharp focus plane
 
-    cam.render(world); // Loops over every pixel in the "world" and writes its color output
+    hittable_list world;      // Creates the container that holds the collection of all objects that rays can hit
+    material_table materials; // The materials of the objects, which refer to them by index
+    scene_data scene;         // A scene loaded from a file; its camera statements override the settings above
+
+    {
+        phase_timer timer(render_phase::scene_build);
+        if (scene_path.empty()) {
+            random_spheres_scene(world, materials);
+        } else {
+            if (!load_scene(scene_path, cam, scene))
+                return 1;
+            add_scene_objects(scene, world);  // Big scenes: a BVH over slices of the sphere arrays, in the scene's arena
+            materials = scene.materials;
+            cam.lights = scene_lights(scene);   // Spheres of a light material get shadow rays aimed at them
+            cam.scene_key = scene_fingerprint(scene);
+            if (!cam.lights->empty())
+                clog << "Sampling " << cam.lights->size() << " lights\n";
+            clog << "Scene memory: " << scene_footprint(scene) << '\n';
+        }
+    }
+
+    cam.output_path = output_path;                               // Empty path: the image goes to standard output
+    if (output_format == "p6")       cam.output_format = image_format::p6;
+    else if (output_format == "pfm") cam.output_format = image_format::pfm;
+    else if (output_format == "p3")  cam.output_format = image_format::p3;
+    else if (!output_path.empty())   cam.output_format = format_from_path(output_path);
+
+    if (samples_per_pixel > 0)
+        cam.samples_per_pixel = samples_per_pixel;                // -n: e.g. more samples for an image continued from a checkpoint
+
+    cam.pixel_sampler = make_sampler(sampler_name, cam.samples_per_pixel);     // -p: Owen-scrambled Sobol points unless told otherwise
+    if (!cam.pixel_sampler) {
+        cerr << "Unknown sampler " << sampler_name << '\n' << usage;
+        return 1;
+    }
+
+    // With -L, the scene stays loaded and the renderer serves jobs (camera settings) sent to a Unix socket.
+    // With -F, frames 0 .. frames-1 of the scene's animation are rendered to numbered files. The scene, the
+    // materials and the render threads stay alive between frames; moved meshes only refit the top-level BVH.
+    if (!listen_path.empty()) {
+        cam.preview = false;
+        render_service service(world, materials, scene, cam, sampler_name);
+        if (!service.listen(listen_path))
+            return 1;
+        service.run();
+    } else if (frames > 0) {
+        if (output_path.empty()) {
+            cerr << "A frame sequence (-F) needs an output file (-o)\n" << usage;
+            return 1;
+        }
+        if (worker_processes > 0 || !checkpoint_path.empty())
+            clog << "Frame sequences render in threads without checkpoints; -w and -c are ignored\n";
+        cam.worker_processes = 0;
+
+        thread_pool pool(cam.num_threads);
+        for (int frame = 0; frame < frames; frame++) {
+            auto start = std::chrono::steady_clock::now();
+            scene.animation.apply_camera(frame, cam);
+            bool rebuilt = false;
+            if (scene.meshes) {
+                phase_timer timer(render_phase::scene_build);
+                rebuilt = scene.animation.apply_instances(frame, *scene.meshes);
+            }
+            cam.frame = frame;
+            cam.output_path = frame_path(output_path, frame);
+
+            framebuffer image;
+            cam.render(world, materials, image, pool);
+            cam.write_image(image, &pool);
+
+            std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+            clog << "Frame " << frame << " -> " << cam.output_path << " in " << seconds.count() << " s"
+                 << (rebuilt ? " (BVH rebuilt)" : "") << '\n';
+        }
+    } else {
+        // With -c, an existing checkpoint is continued and the image is saved there as it renders. A file there
+        // that is not a checkpoint of this render is left alone rather than overwritten.
+        framebuffer image;
+        cam.checkpoint_path = checkpoint_path;
+        if (!checkpoint_path.empty()) {
+            if (load_checkpoint(checkpoint_path, image, cam.checkpoint_key())) {
+                clog << "Continuing " << checkpoint_path << " from " << image.min_sample_count() << " samples per pixel\n";
+            } else if (ifstream(checkpoint_path)) {
+                cerr << "Cannot continue " << checkpoint_path << "; remove it or choose another checkpoint file\n";
+                return 1;
+            }
+        }
 
+        cam.render(world, materials, image); // Loops over every pixel in the "world" and adds its color to the image
+        cam.write_image(image);
+    }
+
+    if (!stats_path.empty()) {
+        if (!RAYTRACER_STATS)
+            clog << "Statistics are compiled out; configure with -DRAYTRACER_STATS=ON to count them\n";
+        ofstream stats_file(stats_path);
+        write_render_stats_json(stats_file, collect_render_stats());
+        if (!stats_file)
+            clog << "Could not write " << stats_path << '\n';
+    }
 
 }
\ No newline at end of file
@@ -0,0 +1,58 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only memory mapping of a whole file (POSIX mmap).
+// The pages are loaded by the OS on first touch, so "opening" even a huge file is almost free
+// and the data can be used in place without copying it to the heap.
+class mapped_file {
+    public:
+        mapped_file() {}
+
+        explicit mapped_file(const std::string& path) { open(path); }
+
+        ~mapped_file() { close(); }
+
+        mapped_file(const mapped_file&) = delete;
+        mapped_file& operator=(const mapped_file&) = delete;
+
+        bool open(const std::string& path) {
+            close();
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) return false;
+
+            struct stat info;
+            if (fstat(fd, &info) == 0 && info.st_size > 0) {
+                void* p = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p != MAP_FAILED) {
+                    bytes = static_cast<const char*>(p);
+                    length = size_t(info.st_size);
+                }
+            }
+            ::close(fd);    // The mapping stays valid after the descriptor is closed
+            return bytes != nullptr;
+        }
+
+        void close() {
+            if (bytes) munmap(const_cast<char*>(bytes), length);
+            bytes = nullptr;
+            length = 0;
+        }
+
+        bool is_open() const { return bytes != nullptr; }
+        const char* data() const { return bytes; }
+        size_t size() const { return length; }
+
+    private:
+        const char* bytes = nullptr;
+        size_t length = 0;
+};
+
+#endif
@@ -3,93 +3,181 @@
 
 #include "hittable.h"
 #include "color.h"
+#include "sampler.h"
 
-class material {
-    public:
-    virtual ~material() = default;
+#include <variant>
+#include <vector>
 
-    virtual bool scatter(
-        const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const {
-        return false;
-    }
-};
-
-class lambertian : public material {                                         // Matte material
+class lambertian {                                                           // Matte material
     public:
         lambertian(const color& albedo) : albedo(albedo) {}
 
-        bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override {
-            auto scatter_direction = rec.normal + random_unit_vector();     // Generates a random direction biased toward the normal
+        bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const {
+            auto scatter_direction = rec.normal + sample_unit_vector();     // Generates a random direction biased toward the normal
 
             if (scatter_direction.near_zero()) scatter_direction = rec.normal; // Prevents the vectors from summing up to zero with the normal
             
-            scattered = ray(rec.p, scatter_direction);                      // Creates a new ray starting at the hit point and going in that direction
+            scattered = rec.spawn_ray(scatter_direction);                   // Creates a new ray starting at the hit point and going in that direction
             attenuation = albedo;                                           // Shows that color of the surface affects the bounced light
             return true;                                                    // Always scatters the light
         }
+
+        // Density of the directions scatter picks (cosine-weighted about the normal)
+        real scatter_pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const {
+            return std::fmax(dot(unit_vector(direction), rec.normal), real(0)) / real(pi);
+        }
+
+        bool is_specular() const { return false; }
+        color emitted(const hit_record& rec) const { return color(0,0,0); }
+        color base_color() const { return albedo; }
     private:
         color albedo;
 };
 
-class metal : public material {                                               // Metallic material
+class metal {                                                                 // Metallic material
   public:
-    metal(const color& albedo, double fuzz) : albedo(albedo), 
+    metal(const color& albedo, real fuzz) : albedo(albedo), 
                                               fuzz(fuzz < 1 ? fuzz : 1) {}    // Color and fuzziness
 
-    bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override {
+    bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const {
         vec3 reflected = reflect(r_in.direction(), rec.normal);              // Computes the mirror reflection direction
-        reflected = unit_vector(reflected) + (fuzz * random_unit_vector());
+        reflected = unit_vector(reflected) + (fuzz * sample_unit_vector());
         
-        scattered = ray(rec.p, reflected);                                   // Creates the outgoing ray
+        scattered = rec.spawn_ray(reflected);                                // Creates the outgoing ray
         attenuation = albedo;                                                // Makes reflected light tinted by the metal’s color (will be multiplied by this color)
         return (dot(scattered.direction(), rec.normal) > 0);                 // Returns true if the ray is reflected to the outside surface
     }
 
+    // Density of the directions scatter picks, below the surface included. scatter aims at a uniform point of the
+    // sphere of radius fuzz around the mirror direction, so a direction is picked through the (up to) two points
+    // where it crosses that sphere, at distances t1 and t2. 0 for a perfect mirror, whose density is a spike.
+    real scatter_pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const {
+        if (fuzz <= 0) return 0;
+        vec3 mirror = unit_vector(reflect(unit_vector(r_in.direction()), rec.normal));
+        real b = dot(unit_vector(direction), mirror);
+        real discriminant = b*b - (1 - fuzz*fuzz);
+        if (b <= 0 || discriminant <= 0) return 0;
+        real root = std::sqrt(discriminant);
+        real t1 = b - root, t2 = b + root;
+        return (t1*t1 + t2*t2) / (4 * real(pi) * fuzz * root);
+    }
+
+    bool is_specular() const { return fuzz <= 0; }
+    color emitted(const hit_record& rec) const { return color(0,0,0); }
+    color base_color() const { return albedo; }
+
   private:
     color albedo;
-    double fuzz;
+    real fuzz;
 };
 
-class dielectric : public material {                                           // Glass-like material
+class dielectric {                                                             // Glass-like material
     public:
-        dielectric(double refraction_index) : 
+        dielectric(real refraction_index) : 
                                         refraction_index(refraction_index) {}  // Refraction index of the certain material
 
-        bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override {
+        bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const {
             attenuation = color(1.0, 1.0, 1.0);                                // No color absorbption for glass - white color
-            double ri = rec.front_face ? (1.0/refraction_index) : 
+            real ri = rec.front_face ? (1/refraction_index) : 
                                                     refraction_index;          // Chooses either outside or inside absorption index
 
             vec3 unit_direction = unit_vector(r_in.direction());               // Normalizes incoming rays
 
-            double cos_theta = 
+            real cos_theta = 
                            std::fmin(dot(-unit_direction, rec.normal), 1.0);   // Computes the angle between the incoming ray and the normal
-            double sin_theta = std::sqrt(1.0 - cos_theta*cos_theta);           // Computes sin using trig identity
+            real sin_theta = std::sqrt(1 - cos_theta*cos_theta);               // Computes sin using trig identity
 
             bool cannot_refract = ri * sin_theta > 1.0;                        // Checks for total internal reflection
             vec3 direction;
 
-            if (cannot_refract || reflectance(cos_theta, ri) > random_double())
+            if (cannot_refract || reflectance(cos_theta, ri) > sample_1d())
                 direction = reflect(unit_direction, rec.normal);               // If refraction is impossible - choose reflection
             else
                 direction = refract(unit_direction, rec.normal, ri);           // Otherwise - refract by bending through the surface
 
-            scattered = ray(rec.p, direction);
+            scattered = rec.spawn_ray(direction);
             vec3 refracted = refract(unit_direction, rec.normal, ri);          // Computes the "bent" ray using Snell's Law
 
-            scattered = ray(rec.p, refracted);                                 // Creates a new ray from hit point to the refracted direction
+            scattered = rec.spawn_ray(refracted);                              // Creates a new ray from hit point to the refracted direction
             return true;                                                       // Returns true because glass always either refracts or reflects
         }
 
+        real scatter_pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const { return 0; }
+        bool is_specular() const { return true; }
+        color emitted(const hit_record& rec) const { return color(0,0,0); }
+        color base_color() const { return color(1.0, 1.0, 1.0); }
+
             private:
-                double refraction_index;
+                real refraction_index;
 
-            static double reflectance(double cosine, double refraction_index) { // Returns how much light reflects
+            static real reflectance(real cosine, real refraction_index) {       // Returns how much light reflects
                 auto r0 = (1 - refraction_index) / (1 + refraction_index);      // Computes how much light reflects when hitting straight on (θ = 0°)
                 r0 = r0*r0;
                 return r0 + (1-r0)*std::pow((1 - cosine),5);                    // Calculates how much light reflects vs refracts based on viewing angle (Schlick Approximation)
     }
 };
 
+class diffuse_light {                                                          // Light source: glows, reflects nothing
+    public:
+        diffuse_light(const color& emit) : emit(emit) {}
+
+        bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const { return false; }
+        real scatter_pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const { return 0; }
+        bool is_specular() const { return true; }
+        color emitted(const hit_record& rec) const { return rec.front_face ? emit : color(0,0,0); }  // From the front side only
+        color base_color() const { return emit; }
+
+    private:
+        color emit;
+};
+
+// A material is one of a closed set of types. Calls through it are a switch on the type that the
+// compiler can inline, instead of a virtual call per bounce.
+using material = std::variant<lambertian, metal, dielectric, diffuse_light>;
+
+enum class material_kind { lambertian, metal, dielectric, diffuse_light };  // Same order as the types in `material`
+constexpr int material_kinds = int(material_kind::diffuse_light) + 1;
+
+inline material_kind kind(const material& mat) { return material_kind(mat.index()); }
+
+inline bool scatter(const material& mat, const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) {
+    return std::visit([&](const auto& m) { return m.scatter(r_in, rec, attenuation, scattered); }, mat);
+}
+
+// Density (per solid angle) with which scatter picks `direction`; 0 for specular materials
+inline real scatter_pdf(const material& mat, const ray& r_in, const hit_record& rec, const vec3& direction) {
+    return std::visit([&](const auto& m) { return m.scatter_pdf(r_in, rec, direction); }, mat);
+}
+
+// Specular materials scatter into single directions, which light sampling cannot find
+inline bool is_specular(const material& mat) {
+    return std::visit([](const auto& m) { return m.is_specular(); }, mat);
+}
+
+inline color emitted(const material& mat, const hit_record& rec) {
+    return std::visit([&](const auto& m) { return m.emitted(rec); }, mat);
+}
+
+// Color of the surface itself, independent of lighting (the albedo feature buffer of the denoiser)
+inline color base_color(const material& mat) {
+    return std::visit([](const auto& m) { return m.base_color(); }, mat);
+}
+
+// All materials of a scene in one contiguous array. Objects and hit records refer to them by index.
+class material_table {
+    public:
+        uint32_t add(const material& mat) {
+            materials.push_back(mat);
+            return uint32_t(materials.size() - 1);
+        }
+
+        const material& operator[](uint32_t id) const { return materials[id]; }
+
+        size_t size() const { return materials.size(); }
+
+    private:
+        std::vector<material> materials;
+};
+
 
 #endif
\ No newline at end of file
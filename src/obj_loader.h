@@ -0,0 +1,90 @@
+#ifndef OBJ_LOADER_H
+#define OBJ_LOADER_H
+
+// Wavefront OBJ meshes. Only the geometry is read: vertex positions ("v x y z") and faces ("f a b c ...",
+// with corners written as v, v/vt, v/vt/vn or v//vn, and negative indices counting back from the last vertex).
+// Polygons are split into triangle fans. Texture coordinates, normals, groups and materials are skipped.
+//
+// The file is memory-mapped and parsed in one pass without copying lines, so a mesh with millions of
+// triangles loads in about the time it takes to read the file.
+
+#include "mapped_file.h"
+#include "triangle_mesh.h"
+
+#include <charconv>
+#include <cstring>
+#include <string>
+#include <vector>
+
+inline bool load_obj(const std::string& path, mesh_buffers& mesh) {
+    mapped_file file(path);
+    if (!file.is_open()) {
+        clog << "Could not open mesh " << path << '\n';
+        return false;
+    }
+
+    mesh = mesh_buffers();
+    mesh.vertices.reserve(file.size() / 40);        // Rough guesses; a vertex line is 30-40 bytes
+    mesh.indices.reserve(file.size() / 10);
+
+    const char* p = file.data();
+    const char* file_end = p + file.size();
+    std::vector<uint32_t> polygon;
+
+    auto skip_blanks = [](const char*& q, const char* end) {
+        while (q < end && (*q == ' ' || *q == '\t' || *q == '\r')) q++;
+    };
+
+    for (int line = 1; p < file_end; line++) {
+        const char* end = static_cast<const char*>(std::memchr(p, '\n', size_t(file_end - p)));
+        if (!end) end = file_end;
+
+        auto fail = [&](const char* what) {
+            clog << path << ':' << line << ": " << what << '\n';
+            return false;
+        };
+
+        skip_blanks(p, end);
+        if (end - p > 1 && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+            p++;
+            double xyz[3];
+            for (double& value : xyz) {
+                skip_blanks(p, end);
+                auto result = std::from_chars(p, end, value);
+                if (result.ec != std::errc()) return fail("expected: v x y z");
+                p = result.ptr;
+            }
+            mesh.vertices.emplace_back(xyz[0], xyz[1], xyz[2]);
+        } else if (end - p > 1 && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+            p++;
+            polygon.clear();
+            while (true) {
+                skip_blanks(p, end);
+                if (p == end) break;
+                long long index;
+                auto result = std::from_chars(p, end, index);
+                if (result.ec != std::errc() || index == 0) return fail("bad face index");
+                if (index < 0) index += (long long)mesh.vertices.size() + 1;     // -1 is the last vertex so far
+                if (index < 1 || index > (long long)mesh.vertices.size()) return fail("face index out of range");
+                polygon.push_back(uint32_t(index - 1));
+
+                p = result.ptr;
+                while (p < end && *p != ' ' && *p != '\t' && *p != '\r') p++;   // Skips "/vt/vn"
+            }
+            if (polygon.size() < 3) return fail("face with fewer than three corners");
+            for (size_t k = 1; k + 1 < polygon.size(); k++) {
+                mesh.indices.push_back(polygon[0]);
+                mesh.indices.push_back(polygon[k]);
+                mesh.indices.push_back(polygon[k + 1]);
+            }
+        }
+
+        p = end + 1;
+    }
+
+    mesh.vertices.shrink_to_fit();
+    mesh.indices.shrink_to_fit();
+    return true;
+}
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef PRECISION_H
+#define PRECISION_H
+
+#include <limits>
+#include <type_traits>
+
+// Scalar type of the geometry (vectors, rays, intervals, primitives): double by default, float when the
+// renderer is built with RAYTRACER_FLOAT defined. float halves the size of every ray, hit and scene array
+// and doubles the number of SIMD lanes.
+#ifdef RAYTRACER_FLOAT
+using real = float;
+#else
+using real = double;
+#endif
+
+// Rounding error of a computed hit point, relative to the magnitude of the numbers it was computed from
+// (a few ulps, with margin). See hit_point_error and offset_ray_origin.
+constexpr real hit_epsilon = std::numeric_limits<real>::epsilon() * 16;
+
+// Closest distance at which a ray can hit something. The origin offset already keeps rays off the surface
+// they start on, so this only has to reject hits at the origin itself.
+constexpr real ray_t_min = std::numeric_limits<real>::epsilon() * 4;
+
+// Vectors shorter than this in every coordinate count as zero (vec3::near_zero). A float sum like
+// normal + random_unit_vector() loses its direction to rounding long before it gets to 1e-8.
+constexpr real near_zero_epsilon = std::is_same<real, float>::value ? real(1e-3) : real(1e-8);
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <cstdint>
+
+// PCG32 random number generator (O'Neill, pcg-random.org).
+// 16 bytes of state, a few instructions per number and a choice of 2^63 independent streams,
+// so every pixel can get its own sequence without any shared global state.
+class pcg32 {
+    public:
+        pcg32() : state(0x853c49e6748fea9bULL), inc(0xda3e39cb94b95bdbULL) {}     // Default state from the reference implementation
+
+        pcg32(uint64_t seed_value, uint64_t stream) { seed(seed_value, stream); }
+
+        void seed(uint64_t seed_value, uint64_t stream) {
+            state = 0;
+            inc = (stream << 1u) | 1u;      // The increment must be odd
+            next_uint();
+            state += seed_value;
+            next_uint();
+        }
+
+        uint32_t next_uint() {
+            uint64_t old_state = state;
+            state = old_state * 6364136223846793005ULL + inc;
+            uint32_t xorshifted = uint32_t(((old_state >> 18u) ^ old_state) >> 27u);
+            uint32_t rot = uint32_t(old_state >> 59u);
+            return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+        }
+
+        double next_double() {
+            // 53 random bits, the full resolution of a double, in [0,1)
+            uint64_t a = next_uint() >> 5;
+            uint64_t b = next_uint() >> 6;
+            return double(a * 67108864 + b) * (1.0 / 9007199254740992.0);
+        }
+
+    private:
+        uint64_t state;
+        uint64_t inc;
+};
+
+// SplitMix64 finalizer: scrambles an integer so that nearby inputs give unrelated outputs
+inline uint64_t mix_bits(uint64_t v) {
+    v ^= v >> 30;
+    v *= 0xbf58476d1ce4e5b9ULL;
+    v ^= v >> 27;
+    v *= 0x94d049bb133111ebULL;
+    v ^= v >> 31;
+    return v;
+}
+
+inline pcg32& thread_rng() {
+    thread_local pcg32 rng;      // Every thread owns its generator, so threads never contend on it
+    return rng;
+}
+
+#endif
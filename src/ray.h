@@ -16,7 +16,7 @@ class ray {
         const vec3& direction() const { return dir; }
 
 
-        point3 at(double t) const {                                                        // Finds where the vector points
+        point3 at(real t) const {                                                          // Finds where the vector points
             return orig + t*dir;} 
 
     private:
@@ -25,6 +25,20 @@ class ray {
 
 };
 
+// Bound on the rounding error of a hit point on an object at `position` with the given size. The error grows
+// with the magnitude of the numbers in the intersection test, so a huge sphere has a large one everywhere.
+inline real hit_point_error(const point3& position, real size) {
+    real magnitude = std::fmax(std::fabs(position.x()), std::fmax(std::fabs(position.y()), std::fabs(position.z())));
+    return hit_epsilon * (1 + magnitude + size);
+}
+
+// Where a ray leaving the surface point p (normal n) in direction dir should start: p pushed off the surface,
+// to the side the ray goes, by its rounding error. Otherwise the ray could hit its own surface again, which
+// shows as dark speckles ("acne") and needlessly long paths, especially in the float build.
+inline point3 offset_ray_origin(const point3& p, const vec3& n, real p_error, const vec3& dir) {
+    return dot(dir, n) < 0 ? p - p_error*n : p + p_error*n;
+}
+
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,324 @@
+#ifndef RENDER_SERVICE_H
+#define RENDER_SERVICE_H
+
+// Render service: keeps one scene loaded and renders the jobs that clients send over a Unix socket, so a
+// batch of views of the same scene pays for loading it and building its BVHs once. Jobs wait in a queue,
+// highest priority first and otherwise in the order they came, and run one at a time on a thread pool that
+// lives as long as the service.
+//
+// A job is a few lines of text ending with "render". Every job starts from the camera of the scene:
+//
+//     camera lookfrom 13 2 3          (any camera statement of the scene file format)
+//     camera samples_per_pixel 64
+//     frame 12                        (the scene's animation at frame 12, applied before the camera statements)
+//     priority 5                      (default 0; higher runs first)
+//     format pfm                      (p6, the default, p3 or pfm)
+//     render
+//
+// The reply is "image <bytes>\n" followed by the image file, or "error <message>\n". A connection may send
+// any number of jobs, one after another. "shutdown" lets the queued jobs finish and then stops the service.
+
+#include "camera.h"
+#include "scene_file.h"
+#include "worker_process.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <list>
+#include <mutex>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+class render_service {
+    public:
+        // The service renders `world` as the scene was built; `scene` provides the animation for frame jobs
+        render_service(const hittable& world, const material_table& materials, scene_data& scene,
+                       const camera& scene_camera, const std::string& sampler_name)
+          : world(world), materials(materials), scene(scene), base(scene_camera), sampler_name(sampler_name),
+            pool(scene_camera.num_threads) {}
+
+        ~render_service() {
+            if (listen_fd >= 0) {
+                ::close(listen_fd);
+                ::unlink(socket_path.c_str());
+            }
+        }
+
+        render_service(const render_service&) = delete;
+        render_service& operator=(const render_service&) = delete;
+
+        // Creates the socket at path, replacing a socket left behind by an earlier service. False if it cannot.
+        bool listen(const std::string& path) {
+            sockaddr_un address = {};
+            address.sun_family = AF_UNIX;
+            if (path.size() >= sizeof address.sun_path) {
+                clog << "Socket path too long: " << path << '\n';
+                return false;
+            }
+            std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+            listen_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            ::unlink(path.c_str());
+            if (listen_fd < 0 || ::bind(listen_fd, reinterpret_cast<sockaddr*>(&address), sizeof address) != 0 ||
+                ::listen(listen_fd, 16) != 0) {
+                clog << "Could not listen on " << path << ": " << std::strerror(errno) << '\n';
+                return false;
+            }
+            socket_path = path;
+            clog << "Render service listening on " << path << " with " << pool.size() << " threads\n";
+            return true;
+        }
+
+        // Accepts clients and renders their jobs until one of them sends shutdown
+        void run() {
+            signal(SIGPIPE, SIG_IGN);       // A client that hangs up shows up as a failed write
+            std::thread acceptor([this] { accept_clients(); });
+
+            while (true) {
+                shared_ptr<job> next;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    changed.wait(lock, [&] { return !queue.empty() || stopping; });
+                    if (queue.empty()) break;           // Stopping, and every queued job is done
+                    next = queue.top();
+                    queue.pop();
+                }
+                render(*next);
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    next->done = true;
+                }
+                changed.notify_all();
+            }
+
+            // Unblocks accept() and the client threads waiting for a next request
+            ::shutdown(listen_fd, SHUT_RDWR);
+            acceptor.join();
+            std::list<client> finished;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                for (auto& c : clients)
+                    if (!c.done) ::shutdown(c.fd, SHUT_RDWR);
+                finished.swap(clients);
+            }
+            for (auto& c : finished) c.thread.join();
+            clog << "Render service stopped after " << jobs_done << " jobs\n";
+        }
+
+    private:
+        struct job {
+            uint64_t id = 0;
+            int priority = 0;
+            camera cam;
+            std::vector<std::string> camera_statements;     // Applied after the frame's animated camera
+            bool has_frame = false;
+            double frame = 0;
+            image_format format = image_format::p6;
+            std::string reply;
+            bool done = false;
+        };
+
+        struct runs_later {             // Order of the priority queue: the top is the job to run next
+            bool operator()(const shared_ptr<job>& a, const shared_ptr<job>& b) const {
+                return a->priority != b->priority ? a->priority < b->priority : a->id > b->id;
+            }
+        };
+
+        const hittable& world;
+        const material_table& materials;
+        scene_data& scene;
+        camera base;
+        std::string sampler_name;
+        thread_pool pool;
+
+        int listen_fd = -1;
+        std::string socket_path;
+
+        std::mutex mutex;                               // Guards everything below
+        std::condition_variable changed;                // A job was queued or finished, or the service is stopping
+        std::priority_queue<shared_ptr<job>, std::vector<shared_ptr<job>>, runs_later> queue;
+        uint64_t next_id = 1;
+        bool stopping = false;
+        struct client {
+            std::thread thread;
+            int fd;
+            bool done = false;                          // Its connection is closed; the thread only has to be joined
+        };
+        std::list<client> clients;
+        std::atomic<long long> jobs_done{0};
+
+        void accept_clients() {
+            while (true) {
+                int fd = ::accept(listen_fd, nullptr, nullptr);
+                if (fd < 0) {
+                    if (errno == EINTR || errno == ECONNABORTED) continue;
+                    return;                             // The socket was shut down
+                }
+                std::list<client> finished;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    // Reaps the threads of clients that have hung up, so a long-running service does not keep them
+                    for (auto c = clients.begin(); c != clients.end(); ) {
+                        auto next = std::next(c);
+                        if (c->done) finished.splice(finished.end(), clients, c);
+                        c = next;
+                    }
+                    if (stopping) {
+                        ::close(fd);
+                    } else {
+                        clients.push_back({std::thread(), fd});
+                        client& c = clients.back();
+                        c.thread = std::thread([this, &c] { serve_client(c); });
+                    }
+                }
+                for (auto& c : finished) c.thread.join();
+            }
+        }
+
+        void serve_client(client& self) {
+            int fd = self.fd;
+            std::string buffer, line;
+            auto read_line = [&] {
+                size_t newline;
+                while ((newline = buffer.find('\n')) == std::string::npos) {
+                    char chunk[4096];
+                    ssize_t n = ::read(fd, chunk, sizeof chunk);
+                    if (n < 0 && errno == EINTR) continue;
+                    if (n <= 0) return false;
+                    buffer.append(chunk, size_t(n));
+                }
+                line.assign(buffer, 0, newline);
+                buffer.erase(0, newline + 1);
+                return true;
+            };
+
+            auto request = make_shared<job>();
+            std::string error;
+            while (read_line()) {
+                const char* p = line.data();
+                const char* end = p + line.size();
+                std::string word;
+                if (!next_word(p, end, word) || word[0] == '#') continue;
+
+                if (word == "render") {
+                    std::string reply = error.empty() ? submit(request) : "error " + error + "\n";
+                    if (!write_all(fd, reply.data(), reply.size())) break;
+                    request = make_shared<job>();
+                    error.clear();
+                    continue;
+                }
+                if (word == "shutdown") {
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        stopping = true;
+                    }
+                    changed.notify_all();
+                    continue;
+                }
+                if (!error.empty()) continue;           // Only the first error of a job is reported
+
+                double value;
+                auto fits_int = [&] {                   // Finite and within int, so int(value) is defined
+                    return value >= std::numeric_limits<int>::min() && value <= std::numeric_limits<int>::max();
+                };
+                if (word == "camera") {
+                    // Checked now, applied by submit once the frame is known
+                    camera scratch = base;
+                    std::string statement(p, end);
+                    if (const char* what = parse_camera_statement(p, end, scratch)) error = what;
+                    else request->camera_statements.push_back(statement);
+                } else if (word == "frame") {
+                    if (!next_number(p, end, value) || !fits_int()) {
+                        error = "expected: frame number";
+                    } else {
+                        request->frame = value;
+                        request->has_frame = true;
+                    }
+                } else if (word == "priority") {
+                    if (!next_number(p, end, value) || !fits_int()) error = "expected: priority number";
+                    else request->priority = int(value);
+                } else if (word == "format") {
+                    std::string name;
+                    next_word(p, end, name);
+                    if (name == "p6")       request->format = image_format::p6;
+                    else if (name == "p3")  request->format = image_format::p3;
+                    else if (name == "pfm") request->format = image_format::pfm;
+                    else error = "expected: format p3|p6|pfm";
+                } else {
+                    error = "unknown statement " + word;
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            ::close(fd);
+            self.done = true;
+        }
+
+        // Queues a job and waits until it has been rendered; returns the reply
+        std::string submit(const shared_ptr<job>& request) {
+            camera& cam = request->cam;
+            cam = base;
+            if (request->has_frame)
+                scene.animation.apply_camera(request->frame, cam);
+            for (const auto& statement : request->camera_statements) {
+                const char* p = statement.data();
+                parse_camera_statement(p, p + statement.size(), cam);
+            }
+
+            if (cam.image_width < 1 || cam.samples_per_pixel < 1 || !(cam.aspect_ratio > 0))
+                return "error image_width, samples_per_pixel and aspect_ratio must be positive\n";
+
+            std::unique_lock<std::mutex> lock(mutex);
+            if (stopping) return "error the service is shutting down\n";
+            request->id = next_id++;
+            queue.push(request);
+            clog << "\rJob " << request->id << " queued (priority " << request->priority << ", "
+                 << queue.size() << " waiting)\n";
+            changed.notify_all();
+            changed.wait(lock, [&] { return request->done; });
+            return std::move(request->reply);
+        }
+
+        void render(job& request) {
+            auto start = std::chrono::steady_clock::now();
+            camera& cam = request.cam;
+            cam.frame = int(request.frame);
+            cam.preview = false;
+            cam.checkpoint_path.clear();
+            cam.pixel_sampler = make_sampler(sampler_name, cam.samples_per_pixel);
+            if (scene.meshes) {
+                phase_timer timer(render_phase::scene_build);
+                scene.animation.apply_instances(request.frame, *scene.meshes);
+            }
+
+            framebuffer image;
+            cam.render(world, materials, image, pool);
+            if (cam.can_denoise(image))
+                image = cam.denoised(image, &pool);
+
+            std::ostringstream file;
+            image.write(file, request.format);
+            std::string bytes = file.str();
+            request.reply = "image " + std::to_string(bytes.size()) + "\n" + bytes;
+            jobs_done++;
+
+            std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+            clog << "\rJob " << request.id << ": " << image.width() << 'x' << image.height() << ", "
+                 << cam.samples_per_pixel << " samples per pixel in " << seconds.count() << " s\n";
+        }
+};
+
+#endif
@@ -0,0 +1,197 @@
+#ifndef RENDER_STATS_H
+#define RENDER_STATS_H
+
+// Render statistics: what the renderer did (rays, intersection tests, path lengths, scatter events) and
+// where the time went. Counting is switched on by building with RAYTRACER_STATS=1 (CMake option of the
+// same name). Without it, every RENDER_STAT(...) in the hot paths expands to nothing.
+
+#include "material.h"
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <type_traits>
+#include <vector>
+
+#ifndef RAYTRACER_STATS
+#define RAYTRACER_STATS 0
+#endif
+
+#if RAYTRACER_STATS
+#define RENDER_STAT(statement) do { statement; } while (0)
+#else
+#define RENDER_STAT(statement) do {} while (0)
+#endif
+
+enum class primitive_kind { sphere, sphere_batch, triangle, bvh_box };    // What an intersection test was against
+enum class path_end { escaped, absorbed, roulette, max_depth };   // Why a path stopped
+enum class render_phase { scene_build, render, denoise, output };
+
+struct render_stats {
+    static constexpr int primitive_kinds = int(primitive_kind::bvh_box) + 1;
+    static constexpr int material_kinds = ::material_kinds;
+    static constexpr int phases = int(render_phase::output) + 1;
+    static constexpr int depth_bins = 64;       // Paths with more bounces are counted in the last bin
+
+    uint64_t primary_rays = 0;                  // Rays from the camera
+    uint64_t secondary_rays = 0;                // Rays scattered off surfaces
+    uint64_t shadow_rays = 0;                   // Rays from surfaces toward sampled lights
+    uint64_t tests[primitive_kinds] = {};       // Intersection tests (batch tests count every sphere or triangle lane)
+    uint64_t hits[primitive_kinds] = {};        // Tests that reported a hit (once per batch test)
+
+    uint64_t path_depths[depth_bins] = {};      // Finished paths by their number of bounces
+    uint64_t paths_escaped = 0;                 // Paths that ended in the background
+    uint64_t paths_absorbed = 0;                // Paths whose last hit did not scatter
+    uint64_t paths_roulette = 0;                // Paths ended by Russian roulette
+    uint64_t paths_max_depth = 0;               // Paths cut off at max_depth
+
+    uint64_t scatters[material_kinds] = {};     // Scatter events per material type
+    uint64_t absorptions = 0;                   // Hits that did not scatter
+
+    double phase_seconds[phases] = {};          // Wall time per phase
+
+    void add(const render_stats& other) {
+        primary_rays += other.primary_rays;
+        secondary_rays += other.secondary_rays;
+        shadow_rays += other.shadow_rays;
+        for (int k = 0; k < primitive_kinds; k++) {
+            tests[k] += other.tests[k];
+            hits[k] += other.hits[k];
+        }
+        for (int k = 0; k < depth_bins; k++)
+            path_depths[k] += other.path_depths[k];
+        paths_escaped += other.paths_escaped;
+        paths_absorbed += other.paths_absorbed;
+        paths_roulette += other.paths_roulette;
+        paths_max_depth += other.paths_max_depth;
+        for (int k = 0; k < material_kinds; k++)
+            scatters[k] += other.scatters[k];
+        absorptions += other.absorptions;
+        for (int k = 0; k < phases; k++)
+            phase_seconds[k] += other.phase_seconds[k];
+    }
+
+    // Hot-path helpers, each meant to be wrapped in RENDER_STAT
+    void count_rays(bool primary, uint64_t count = 1) { (primary ? primary_rays : secondary_rays) += count; }
+    void count_shadow_ray() { shadow_rays++; }
+
+    void count_tests(primitive_kind kind, uint64_t count = 1) { tests[int(kind)] += count; }
+    void count_hit(primitive_kind kind) { hits[int(kind)]++; }
+
+    void count_scatter(const material& mat, bool scattered) {
+        if (scattered) scatters[mat.index()]++;
+        else absorptions++;
+    }
+
+    void count_path_end(int bounces, path_end end, uint64_t count = 1) {
+        path_depths[bounces < depth_bins ? bounces : depth_bins - 1] += count;
+        if (end == path_end::escaped) paths_escaped += count;
+        else if (end == path_end::absorbed) paths_absorbed += count;
+        else if (end == path_end::roulette) paths_roulette += count;
+        else paths_max_depth += count;
+    }
+};
+
+static_assert(std::is_trivially_copyable<render_stats>::value, "worker processes send render_stats as bytes");
+
+// Every thread counts into its own render_stats, so counting needs no synchronization.
+// The registry owns them, so the counts outlive the threads of a finished render.
+class render_stats_registry {
+    public:
+        static render_stats_registry& instance() {
+            static render_stats_registry registry;
+            return registry;
+        }
+
+        render_stats& local() {
+            thread_local render_stats* stats = nullptr;
+            if (!stats) {
+                std::lock_guard<std::mutex> lock(mutex);
+                all.push_back(std::make_unique<render_stats>());
+                stats = all.back().get();
+            }
+            return *stats;
+        }
+
+        // Sum over every thread. Only exact while no render is running.
+        render_stats total() {
+            std::lock_guard<std::mutex> lock(mutex);
+            render_stats sum;
+            for (const auto& stats : all) sum.add(*stats);
+            return sum;
+        }
+
+        void reset() {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto& stats : all) *stats = render_stats();
+        }
+
+    private:
+        std::mutex mutex;
+        std::vector<std::unique_ptr<render_stats>> all;
+};
+
+inline render_stats& thread_render_stats() { return render_stats_registry::instance().local(); }
+inline render_stats collect_render_stats() { return render_stats_registry::instance().total(); }
+inline void reset_render_stats() { render_stats_registry::instance().reset(); }
+
+// Adds the wall time of its scope to one phase of the calling thread's statistics
+// (an empty object without RAYTRACER_STATS: not even the clock is read)
+class phase_timer {
+    public:
+#if RAYTRACER_STATS
+        explicit phase_timer(render_phase phase) : phase(phase), start(std::chrono::steady_clock::now()) {}
+
+        ~phase_timer() {
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            thread_render_stats().phase_seconds[int(phase)] += elapsed.count();
+        }
+
+    private:
+        render_phase phase;
+        std::chrono::steady_clock::time_point start;
+#else
+        explicit phase_timer(render_phase) {}
+#endif
+};
+
+inline void write_render_stats_json(std::ostream& out, const render_stats& stats) {
+    const char* primitive_names[] = {"sphere", "sphere_batch", "triangle", "bvh_box"};
+    const char* material_names[] = {"lambertian", "metal", "dielectric", "diffuse_light"};
+    const char* phase_names[] = {"scene_build", "render", "denoise", "output"};
+
+    int last_depth = render_stats::depth_bins - 1;      // Trailing empty bins are left out
+    while (last_depth > 0 && stats.path_depths[last_depth] == 0) last_depth--;
+
+    out << "{\n";
+    out << "  \"rays\": {\"primary\": " << stats.primary_rays << ", \"secondary\": " << stats.secondary_rays
+        << ", \"shadow\": " << stats.shadow_rays << "},\n";
+
+    out << "  \"intersections\": {";
+    for (int k = 0; k < render_stats::primitive_kinds; k++)
+        out << (k ? ", " : "") << '"' << primitive_names[k] << "\": {\"tests\": " << stats.tests[k]
+            << ", \"hits\": " << stats.hits[k] << '}';
+    out << "},\n";
+
+    out << "  \"paths\": {\"escaped\": " << stats.paths_escaped << ", \"absorbed\": " << stats.paths_absorbed
+        << ", \"roulette\": " << stats.paths_roulette << ", \"max_depth\": " << stats.paths_max_depth << ", \"depth_histogram\": [";
+    for (int k = 0; k <= last_depth; k++)
+        out << (k ? ", " : "") << stats.path_depths[k];
+    out << "]},\n";
+
+    out << "  \"scatters\": {";
+    for (int k = 0; k < render_stats::material_kinds; k++)
+        out << (k ? ", " : "") << '"' << material_names[k] << "\": " << stats.scatters[k];
+    out << "},\n";
+    out << "  \"absorptions\": " << stats.absorptions << ",\n";
+
+    out << "  \"seconds\": {";
+    for (int k = 0; k < render_stats::phases; k++)
+        out << (k ? ", " : "") << '"' << phase_names[k] << "\": " << stats.phase_seconds[k];
+    out << "}\n";
+    out << "}\n";
+}
+
+#endif
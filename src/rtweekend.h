@@ -7,6 +7,8 @@
 #include <limits>
 #include <memory> // For shared pointers
 
+#include "random.h"
+
 // C++ Std Usings
 using std::make_shared;
 using std::shared_ptr;
@@ -21,7 +23,7 @@ inline double degrees_to_radians(double degrees) {
 }
 
 inline double random_double() {
-    return std::rand() / (RAND_MAX + 1.0);     // Returns a random real number in [0,1)
+    return thread_rng().next_double();         // Returns a random real number in [0,1) from this thread's generator
 }
 
 inline double random_double(double min, double max) {
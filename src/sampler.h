@@ -0,0 +1,273 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "rtweekend.h"
+#include "low_discrepancy.h"
+
+#include <cmath>
+#include <string>
+
+struct sample2 {
+    double x, y;
+};
+
+// Which sample is being traced and how many of its numbers were drawn so far
+struct sample_state {
+    int i = 0, j = 0;               // Pixel
+    int sample_index = 0;
+    int frame = 0;
+    uint32_t dimension = 0;         // Index of the next number of the sample
+    uint64_t pixel_key = 0;         // Hash of the sampler's seed, the pixel and the frame
+};
+
+// Decides where the random numbers of one camera sample come from.
+// The camera calls start_sample before tracing each sample, which seeds the calling thread's generator
+// from (pixel, sample index, frame). Every sample is therefore reproducible bit for bit, no matter which
+// thread renders it or in which order, and threads never share generator state.
+//
+// Numbers are drawn in a fixed order (pixel position, lens position, then a few per bounce), so number k of
+// a sample is its dimension k. Samplers other than the independent one compute each number directly from
+// (pixel, sample index, dimension), which lets them spread the samples of a pixel evenly in every dimension.
+// start_sample also makes the sampler this thread's active one: materials draw their numbers through
+// sample_1d / sample_2d, so they get the same well-spread numbers as the camera.
+class sampler {
+    public:
+        explicit sampler(uint64_t seed = 0) : seed(seed) {}
+
+        sampler(const sampler& other) : seed(other.seed), current(other.current) {}     // A copy is not active anywhere
+        sampler& operator=(const sampler&) = delete;
+
+        virtual ~sampler() {
+            if (active() == this) active() = nullptr;
+        }
+
+        void start_sample(int i, int j, int sample_index, int frame) {
+            uint64_t pixel = (uint64_t(uint32_t(j)) << 32) | uint32_t(i);                   // Each pixel gets its own PCG stream
+            uint64_t sample_key = mix_bits(seed ^ mix_bits((uint64_t(uint32_t(frame)) << 32) | uint32_t(sample_index)));
+            thread_rng().seed(sample_key, pixel);
+            uint64_t key = hash_combine(hash_combine(seed, pixel), uint32_t(frame));
+            current = sample_state{i, j, sample_index, frame, 0, key};
+            active() = this;
+        }
+
+        double get_1d() {                                   // Next number in [0,1) of the current sample
+            return value_1d(current.dimension++);
+        }
+
+        sample2 get_2d() {                                  // Next two numbers, spread well as a pair
+            sample2 u = value_2d(current.dimension);
+            current.dimension += 2;
+            return u;
+        }
+
+        // The wavefront integrator traces many samples side by side; it saves each one's state after a
+        // bounce and resumes it before the next, together with the path's generator
+        const sample_state& state() const { return current; }
+
+        void resume(const sample_state& state) {
+            current = state;
+            active() = this;
+        }
+
+        virtual std::unique_ptr<sampler> clone() const = 0; // Fresh copy for another worker thread
+
+        // Identifies the numbers the sampler hands out: its kind, its seed and whatever its pattern depends on.
+        // Checkpoints record it, so an image is only continued with the samples that started it.
+        virtual uint64_t identity() const = 0;
+
+        // The sampler that most recently started or resumed a sample on this thread (null if none)
+        static sampler*& active() {
+            thread_local sampler* current_sampler = nullptr;
+            return current_sampler;
+        }
+
+    protected:
+        uint64_t seed;
+        sample_state current;
+
+        virtual double value_1d(uint32_t dimension) = 0;
+        virtual sample2 value_2d(uint32_t dimension) = 0;
+
+        // Hash of the current pixel and frame with a dimension, for per-pixel scrambles and permutations
+        uint32_t pixel_hash(uint32_t dimension) const {
+            return uint32_t(hash_combine(current.pixel_key, dimension));
+        }
+
+        // Independent number of the current sample for dimension, for samples past the end of a pattern
+        double hashed_random(uint32_t dimension) const {
+            return hash_to_unit(hash_combine(pixel_hash(dimension), uint32_t(current.sample_index)));
+        }
+};
+
+// Plain independent uniform random numbers.
+class independent_sampler : public sampler {
+    public:
+        explicit independent_sampler(uint64_t seed = 0) : sampler(seed) {}
+
+        std::unique_ptr<sampler> clone() const override {
+            return std::make_unique<independent_sampler>(*this);
+        }
+
+        uint64_t identity() const override { return hash_combine(seed, 1); }
+
+    protected:
+        double value_1d(uint32_t) override {
+            return random_double();
+        }
+
+        sample2 value_2d(uint32_t) override {
+            double x = random_double();
+            return {x, random_double()};
+        }
+};
+
+// Jittered stratification: the samples of a pixel fall one into each cell of an n x m grid (n*m strata in 1D),
+// a random point per cell. The cells are visited in a random order that differs per pixel and dimension,
+// so the dimensions are not correlated with each other. Sample indices past samples_per_pixel (adaptive
+// sampling) get independent numbers.
+class stratified_sampler : public sampler {
+    public:
+        explicit stratified_sampler(int samples_per_pixel, uint64_t seed = 0)
+          : sampler(seed), count(std::max(1, samples_per_pixel)) {
+            nx = std::max(1, int(std::sqrt(double(count))));
+            ny = count / nx;                                // nx * ny <= count; the rest of the samples is not stratified
+        }
+
+        std::unique_ptr<sampler> clone() const override {
+            return std::make_unique<stratified_sampler>(*this);
+        }
+
+        uint64_t identity() const override {                // The strata depend on the sample count
+            return hash_combine(hash_combine(seed, 2), uint32_t(count));
+        }
+
+    protected:
+        double value_1d(uint32_t dimension) override {
+            uint32_t index = uint32_t(current.sample_index);
+            if (index >= uint32_t(count)) return hashed_random(dimension);
+            uint32_t stratum = permute(index, uint32_t(count), pixel_hash(dimension));
+            return (stratum + jitter(dimension, 0)) / count;
+        }
+
+        sample2 value_2d(uint32_t dimension) override {
+            uint32_t index = uint32_t(current.sample_index);
+            uint32_t cells = uint32_t(nx * ny);
+            if (index >= cells) return {hashed_random(dimension), hashed_random(dimension + 1)};
+            uint32_t cell = permute(index, cells, pixel_hash(dimension));
+            return {((cell % nx) + jitter(dimension, 0)) / nx,
+                    ((cell / nx) + jitter(dimension, 1)) / ny};
+        }
+
+    private:
+        int count;
+        int nx, ny;
+
+        double jitter(uint32_t dimension, uint32_t axis) const {
+            return hash_to_unit(hash_combine(pixel_hash(dimension), (uint64_t(axis) << 32) | uint32_t(current.sample_index)));
+        }
+};
+
+// Owen-scrambled Sobol points (Burley 2020): every pair of dimensions is the 2D Sobol sequence, scrambled and
+// shuffled with seeds that differ per pixel and dimension. Any power-of-two prefix of the samples of a pixel
+// is stratified in every 1D and 2D projection, and error falls off faster than with independent numbers.
+class sobol_sampler : public sampler {
+    public:
+        explicit sobol_sampler(uint64_t seed = 0) : sampler(seed) {}
+
+        std::unique_ptr<sampler> clone() const override {
+            return std::make_unique<sobol_sampler>(*this);
+        }
+
+        uint64_t identity() const override { return hash_combine(seed, 3); }
+
+    protected:
+        double value_1d(uint32_t dimension) override {
+            uint32_t hash = pixel_hash(dimension);
+            uint32_t index = owen_scramble(uint32_t(current.sample_index), hash);
+            return to_unit(owen_scramble(sobol_0(index), uint32_t(mix_bits(hash))));
+        }
+
+        sample2 value_2d(uint32_t dimension) override {
+            uint32_t hash = pixel_hash(dimension);
+            uint32_t index = owen_scramble(uint32_t(current.sample_index), hash);   // Shuffling keeps the prefixes stratified
+            uint64_t seeds = mix_bits(hash);
+            return {to_unit(owen_scramble(sobol_0(index), uint32_t(seeds))),
+                    to_unit(owen_scramble(sobol_1(index), uint32_t(seeds >> 32)))};
+        }
+};
+
+// Sobol points shared by all pixels, each pixel shifted (toroidally) by a blue-noise mask value. Neighbouring
+// pixels get very different shifts, so at low sample counts the error looks like fine high-frequency grain
+// instead of blotches, which the eye (and the denoiser) averages away more easily.
+// (Georgiev and Fajardo, "Blue-noise Dithered Sampling", 2016)
+class blue_noise_sampler : public sampler {
+    public:
+        explicit blue_noise_sampler(uint64_t seed = 0) : sampler(seed), mask(&blue_noise_mask::get()) {}
+
+        std::unique_ptr<sampler> clone() const override {
+            return std::make_unique<blue_noise_sampler>(*this);
+        }
+
+        uint64_t identity() const override { return hash_combine(seed, 4); }
+
+    protected:
+        double value_1d(uint32_t dimension) override {
+            uint32_t hash = dimension_hash(dimension);
+            double u = to_unit(owen_scramble(sobol_0(uint32_t(current.sample_index)), hash));
+            return wrap(u + shift(dimension, 0));
+        }
+
+        sample2 value_2d(uint32_t dimension) override {
+            uint64_t seeds = mix_bits(dimension_hash(dimension));
+            uint32_t index = uint32_t(current.sample_index);
+            double x = to_unit(owen_scramble(sobol_0(index), uint32_t(seeds)));
+            double y = to_unit(owen_scramble(sobol_1(index), uint32_t(seeds >> 32)));
+            return {wrap(x + shift(dimension, 0)), wrap(y + shift(dimension, 1))};
+        }
+
+    private:
+        const blue_noise_mask* mask;
+
+        uint32_t dimension_hash(uint32_t dimension) const {     // The same scramble for every pixel
+            return uint32_t(hash_combine(seed, (uint64_t(uint32_t(current.frame)) << 32) | dimension));
+        }
+
+        // Mask value at the pixel, read at an offset that differs per dimension and axis, so the shifts of
+        // different dimensions are unrelated
+        double shift(uint32_t dimension, uint32_t axis) const {
+            uint64_t offset = mix_bits((uint64_t(dimension) << 1 | axis) ^ 0x2545f4914f6cdd1dULL);
+            return mask->value(current.i + int(offset & 63), current.j + int((offset >> 6) & 63));
+        }
+
+        static double wrap(double u) { return u >= 1 ? u - 1 : u; }
+};
+
+// Makes the sampler called name ("independent", "stratified", "sobol" or "bluenoise"); null for other names
+inline shared_ptr<sampler> make_sampler(const std::string& name, int samples_per_pixel) {
+    if (name == "independent") return make_shared<independent_sampler>();
+    if (name == "stratified")  return make_shared<stratified_sampler>(samples_per_pixel);
+    if (name == "sobol")       return make_shared<sobol_sampler>();
+    if (name == "bluenoise")   return make_shared<blue_noise_sampler>();
+    return nullptr;
+}
+
+// Next number(s) of the sample being traced on this thread. Outside a sample (scene generation, benchmarks)
+// they are plain random numbers.
+inline double sample_1d() {
+    sampler* s = sampler::active();
+    return s ? s->get_1d() : random_double();
+}
+
+inline sample2 sample_2d() {
+    sampler* s = sampler::active();
+    if (s) return s->get_2d();
+    double x = random_double();
+    return {x, random_double()};
+}
+
+inline vec3 sample_unit_vector() {                  // Uniform direction from the next two numbers of the sample
+    sample2 u = sample_2d();
+    return sphere_from_square(u.x, u.y);
+}
+
+#endif
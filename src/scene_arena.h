@@ -0,0 +1,116 @@
+#ifndef SCENE_ARENA_H
+#define SCENE_ARENA_H
+
+#include "rtweekend.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Memory for the objects of one scene, taken from a few large blocks instead of one heap allocation per object.
+// Objects created together (all slices of a sphere array, all leaves of a split) sit next to each other, and
+// the whole scene is released by one reset: the destructors run array by array and the blocks are freed,
+// instead of every object going back to the heap on its own.
+//
+// Objects are handed out as shared_ptr handles that do not own anything (no control block, no reference
+// counting), so they plug into hittable_list and bvh_node as they are. They stay valid until reset.
+class scene_arena {
+    public:
+        explicit scene_arena(size_t block_bytes = size_t(1) << 20) : block_bytes(block_bytes) {}
+
+        scene_arena(const scene_arena&) = delete;
+        scene_arena& operator=(const scene_arena&) = delete;
+
+        ~scene_arena() { reset(); }
+
+        // Uninitialized memory, aligned to `alignment` (a power of two)
+        void* allocate(size_t bytes, size_t alignment = alignof(std::max_align_t)) {
+            uintptr_t start = 0;
+            if (!blocks.empty()) {
+                uintptr_t base = reinterpret_cast<uintptr_t>(blocks.back().data.get());
+                start = (base + used + alignment - 1) & ~uintptr_t(alignment - 1);
+                if (start + bytes > base + blocks.back().size) start = 0;
+            }
+            if (start == 0) {                       // Does not fit: a new block, big enough for large arrays
+                size_t size = std::max(block_bytes, bytes + alignment);
+                blocks.push_back({std::unique_ptr<unsigned char[]>(new unsigned char[size]), size});
+                reserved_bytes += size;
+                used = 0;
+                uintptr_t base = reinterpret_cast<uintptr_t>(blocks.back().data.get());
+                start = (base + alignment - 1) & ~uintptr_t(alignment - 1);
+            }
+            uintptr_t base = reinterpret_cast<uintptr_t>(blocks.back().data.get());
+            used = start + bytes - base;
+            used_bytes += bytes;
+            return reinterpret_cast<void*>(start);
+        }
+
+        // Uninitialized array of a type without a destructor (sphere coordinates, node arrays)
+        template <class T>
+        T* allocate_array(size_t count, size_t alignment = alignof(T)) {
+            static_assert(std::is_trivially_destructible<T>::value, "use make_array for types with a destructor");
+            return static_cast<T*>(allocate(count * sizeof(T), std::max(alignment, alignof(T))));
+        }
+
+        // count objects next to each other, the k-th one initialized from make(k)
+        template <class T, class Make>
+        T* make_array(size_t count, Make&& make) {
+            T* objects = static_cast<T*>(allocate(count * sizeof(T), alignof(T)));
+            for (size_t k = 0; k < count; k++)
+                new (objects + k) T(make(k));
+            if (!std::is_trivially_destructible<T>::value && count > 0) {
+                auto entry = static_cast<cleanup*>(allocate(sizeof(cleanup), alignof(cleanup)));
+                *entry = {[](void* p, size_t n) { std::destroy_n(static_cast<T*>(p), n); }, objects, count, cleanups};
+                cleanups = entry;
+            }
+            return objects;
+        }
+
+        template <class T, class... Args>
+        shared_ptr<T> make(Args&&... args) {
+            return handle(make_array<T>(1, [&](size_t) { return T(std::forward<Args>(args)...); }));
+        }
+
+        // A shared_ptr that points at an arena object without owning it
+        template <class T>
+        static shared_ptr<T> handle(T* object) { return shared_ptr<T>(shared_ptr<T>(), object); }
+
+        // Destroys every object made here, newest first, and frees the blocks. Handles are invalid afterwards.
+        void reset() {
+            for (cleanup* entry = cleanups; entry; entry = entry->next)
+                entry->destroy(entry->objects, entry->count);
+            cleanups = nullptr;
+            blocks.clear();
+            used = used_bytes = reserved_bytes = 0;
+        }
+
+        size_t bytes_used() const { return used_bytes; }            // Asked for, without alignment and block ends
+        size_t bytes_reserved() const { return reserved_bytes; }    // Taken from the heap
+        int block_count() const { return int(blocks.size()); }
+
+    private:
+        struct block {
+            std::unique_ptr<unsigned char[]> data;
+            size_t size;
+        };
+
+        struct cleanup {                            // One per array of objects that need their destructor run
+            void (*destroy)(void* objects, size_t count);
+            void* objects;
+            size_t count;
+            cleanup* next;                          // The array made before this one
+        };
+
+        size_t block_bytes;
+        std::vector<block> blocks;
+        size_t used = 0;                            // Bytes taken in the last block
+        size_t used_bytes = 0, reserved_bytes = 0;
+        cleanup* cleanups = nullptr;
+};
+
+#endif
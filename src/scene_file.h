@@ -0,0 +1,815 @@
+#ifndef SCENE_FILE_H
+#define SCENE_FILE_H
+
+// Scene files.
+//
+// The text format has one statement per line; '#' starts a comment:
+//
+//     camera image_width 1200                 (also aspect_ratio, samples_per_pixel, max_depth, vfov,
+//     camera lookfrom 13 2 3                   defocus_angle, focus_dist, lookat, vup)
+//     camera background 0 0 0                 (one color for every ray that escapes, instead of the sky)
+//     material ground lambertian 0.5 0.5 0.5
+//     material gold metal 0.8 0.6 0.2 0.1     (albedo r g b, fuzz)
+//     material glass dielectric 1.5           (refraction index)
+//     material lamp light 4 4 4               (emitted r g b; spheres made of it are sampled as lights)
+//     sphere 0 -1000 0 1000 ground            (center x y z, radius, material name)
+//     mesh bunny.obj gold 0 1 0 2             (OBJ file, material name, optional offset x y z and scale)
+//     key 24 camera lookfrom 10 2 6           (value of lookfrom, lookat, vfov or focus_dist at frame 24)
+//     key 24 mesh 0 1 1 0 2 90                (place of mesh statement 0 at frame 24: x y z, optional scale, yaw)
+//
+// Keys animate a frame sequence (raytracer -F); values between keys are interpolated linearly.
+// Mesh paths are relative to the scene file. Every OBJ file is loaded and given a BVH once, however many
+// mesh statements place it and with whatever materials; each placement is an instance.
+//
+// A parsed scene can be compiled to a binary file whose sphere arrays are laid out exactly like sphere_batch
+// reads them. The binary file is memory-mapped and used in place: loading it costs no per-object allocation.
+// Meshes are not copied into it; it records the mesh statements, and the OBJ files are read again.
+
+#include "animation.h"
+#include "bvh.h"
+#include "camera.h"
+#include "instance.h"
+#include "lights.h"
+#include "mapped_file.h"
+#include "material.h"
+#include "obj_loader.h"
+#include "scene_arena.h"
+#include "sphere_batch.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <sys/stat.h>
+#include <unordered_map>
+#include <vector>
+
+struct material_desc {
+    material_kind kind;
+    double params[4];       // lambertian: r g b, metal: r g b fuzz, dielectric: refraction index, light: r g b
+};
+
+inline material make_material(const material_desc& desc) {
+    const double* p = desc.params;
+    switch (desc.kind) {
+        case material_kind::lambertian: return lambertian(color(p[0], p[1], p[2]));
+        case material_kind::metal:      return metal(color(p[0], p[1], p[2]), p[3]);
+        case material_kind::diffuse_light: return diffuse_light(color(p[0], p[1], p[2]));
+        default:                        return dielectric(p[0]);
+    }
+}
+
+// Sphere arrays in the padded layout sphere_batch expects
+struct scene_arrays {
+    std::vector<real> center_x, center_y, center_z, radius;
+    std::vector<uint32_t> material_id;
+    int count = 0;
+    aabb bbox;
+
+    void add(const point3& center, real r, uint32_t mat) {
+        center_x.push_back(center.x());
+        center_y.push_back(center.y());
+        center_z.push_back(center.z());
+        radius.push_back(r);
+        material_id.push_back(mat);
+        count++;
+        auto rvec = vec3(r, r, r);
+        bbox = aabb(bbox, aabb(center - rvec, center + rvec));
+    }
+
+    // Reorders the spheres along a Morton (Z-order) curve of their centers, so that spheres next to each other
+    // in the arrays are also close in space and consecutive ranges make good BVH leaves
+    void sort_spatially() {
+        aabb centers;
+        for (int i = 0; i < count; i++) {
+            point3 c(center_x[i], center_y[i], center_z[i]);
+            centers = aabb(centers, aabb(c, c));
+        }
+
+        std::vector<std::pair<uint32_t, int>> keys(count);
+        for (int i = 0; i < count; i++)
+            keys[i] = {morton_code(point3(center_x[i], center_y[i], center_z[i]), centers), i};
+        std::sort(keys.begin(), keys.end());
+
+        auto permute = [&](auto& values) {
+            auto old = values;
+            for (int i = 0; i < count; i++) values[i] = old[keys[i].second];
+        };
+        permute(center_x);
+        permute(center_y);
+        permute(center_z);
+        permute(radius);
+        permute(material_id);
+    }
+
+    void pad() {
+        size_t padded = size_t((count + sphere_batch::padding - 1) / sphere_batch::padding * sphere_batch::padding);
+        auto nan = std::numeric_limits<real>::quiet_NaN();
+        center_x.resize(padded, nan);
+        center_y.resize(padded, nan);
+        center_z.resize(padded, nan);
+        radius.resize(padded, 0);
+        material_id.resize(padded, 0);
+    }
+
+    sphere_soa view() const {
+        sphere_soa soa;
+        soa.center_x = center_x.data();
+        soa.center_y = center_y.data();
+        soa.center_z = center_z.data();
+        soa.radius = radius.data();
+        soa.material_id = material_id.data();
+        soa.count = count;
+        return soa;
+    }
+};
+
+struct mesh_desc {
+    std::string path;                       // As written in the scene file
+    uint32_t material;
+    vec3 offset;
+    double scale;
+};
+
+enum class key_target : uint32_t { lookfrom, lookat, vfov, focus_dist, mesh };
+
+struct key_desc {
+    double frame;
+    key_target target;
+    int32_t mesh;                           // Index of the mesh statement, for key_target::mesh
+    double values[5];                       // Camera: the value (x y z for points). Mesh: x y z, scale, yaw
+};
+
+struct scene_data {
+    scene_arena arena;                      // Sphere slices and the sphere BVH (see add_scene_objects)
+    std::vector<material_desc> material_descs;
+    material_table materials;               // Indexed by the material IDs of the spheres and meshes
+    shared_ptr<sphere_batch> spheres;
+    shared_ptr<bvh_node> sphere_tree;       // Over slices of `spheres`, in the arena; null for small scenes
+    std::vector<mesh_desc> mesh_descs;
+    std::vector<shared_ptr<const triangle_mesh>> mesh_shapes;   // One per OBJ file
+    shared_ptr<instance_set> meshes;        // Null when the scene has no meshes; instance k is mesh statement k
+    std::vector<key_desc> key_descs;
+    scene_animation animation;
+
+    // Releases the whole scene, arena included. Worlds holding its objects must be cleared first.
+    void clear() {
+        material_descs.clear();
+        materials = material_table();
+        spheres.reset();
+        sphere_tree.reset();
+        mesh_descs.clear();
+        mesh_shapes.clear();
+        meshes.reset();
+        key_descs.clear();
+        animation = scene_animation();
+        arena.reset();
+    }
+};
+
+inline void build_scene_animation(scene_data& scene) {
+    scene.animation = scene_animation();
+    for (const auto& key : scene.key_descs) {
+        const double* v = key.values;
+        switch (key.target) {
+            case key_target::lookfrom:   scene.animation.lookfrom.add(key.frame, vec3(v[0], v[1], v[2])); break;
+            case key_target::lookat:     scene.animation.lookat.add(key.frame, vec3(v[0], v[1], v[2])); break;
+            case key_target::vfov:       scene.animation.vfov.add(key.frame, v[0]); break;
+            case key_target::focus_dist: scene.animation.focus_dist.add(key.frame, v[0]); break;
+            case key_target::mesh:       scene.animation.placement_track(key.mesh).add(key.frame, {vec3(v[0], v[1], v[2]), v[3], v[4]}); break;
+        }
+    }
+}
+
+// Loads the OBJ files of the mesh statements (relative to the directory of scene_path) and places them
+inline bool load_scene_meshes(const std::string& scene_path, scene_data& scene) {
+    if (scene.mesh_descs.empty()) return true;
+
+    auto slash = scene_path.find_last_of('/');
+    std::string directory = slash == std::string::npos ? "" : scene_path.substr(0, slash + 1);
+
+    std::unordered_map<std::string, shared_ptr<triangle_mesh>> shapes;     // By path, with the first material used
+    std::unordered_map<std::string, shared_ptr<triangle_mesh>> loaded;     // By material and path
+    std::vector<instance> placements;
+    for (const auto& desc : scene.mesh_descs) {
+        auto& shape = shapes[desc.path];
+        if (!shape) {
+            auto buffers = make_shared<mesh_buffers>();
+            std::string path = desc.path[0] == '/' ? desc.path : directory + desc.path;
+            if (!load_obj(path, *buffers)) return false;
+            shape = make_shared<triangle_mesh>(std::move(buffers), desc.material);
+            scene.mesh_shapes.push_back(shape);
+        }
+        auto& mesh = loaded[std::to_string(desc.material) + ' ' + desc.path];
+        if (!mesh) mesh = make_shared<triangle_mesh>(*shape, desc.material);
+        placements.emplace_back(mesh, placement{desc.offset, desc.scale, 0}.to_transform());
+    }
+    scene.meshes = make_shared<instance_set>(std::move(placements));
+    return true;
+}
+
+// Camera parameters as stored in the binary file
+struct scene_camera {
+    double aspect_ratio, vfov, defocus_angle, focus_dist;
+    double lookfrom[3], lookat[3], vup[3];
+    int32_t image_width, samples_per_pixel, max_depth, sky;
+    double background[3];
+};
+
+struct scene_file_header {
+    char magic[8];              // "RTSCENE" followed by a zero byte
+    uint32_t version;
+    uint32_t byte_order;        // 0x01020304 as written by the machine that made the file
+    uint32_t material_count;
+    uint32_t sphere_count;
+    uint32_t real_size;         // Bytes per scalar of the sphere arrays: 8 (double build) or 4 (float build)
+    uint32_t unused;
+    uint64_t padded_count;      // Length of every sphere array
+    scene_camera cam;
+    double bbox[6];             // min x, max x, min y, max y, min z, max z
+    uint64_t materials_offset, center_x_offset, center_y_offset, center_z_offset, radius_offset, material_id_offset;
+    uint64_t mesh_count, meshes_offset;
+    uint64_t key_count, keys_offset;
+    uint64_t source_size;       // Cache of a text scene: size and modification time (ns) of the text when it was
+    int64_t source_mtime;       // parsed; the cache is only used while both still match. 0 for other binary scenes
+};
+
+struct packed_material {
+    uint32_t kind;
+    uint32_t unused;
+    double params[4];
+};
+
+struct packed_mesh {
+    char path[240];             // Zero-terminated
+    uint32_t material;
+    uint32_t unused;
+    double offset[3];
+    double scale;
+};
+
+struct packed_key {
+    double frame;
+    uint32_t target;
+    int32_t mesh;
+    double values[5];
+};
+
+const char scene_file_magic[8] = {'R','T','S','C','E','N','E','\0'};
+const uint32_t scene_file_version = 7;
+
+// Size and modification time of a text scene, which its binary cache records
+struct scene_source_stamp {
+    uint64_t size = 0;
+    int64_t mtime = 0;          // Nanoseconds: an edit within the second the cache was written still shows
+};
+
+inline bool stat_scene_source(const std::string& path, scene_source_stamp& stamp) {
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) return false;
+    stamp.size = uint64_t(info.st_size);
+    stamp.mtime = int64_t(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+    return true;
+}
+
+inline scene_camera pack_camera(const camera& cam) {
+    scene_camera c = {};
+    c.aspect_ratio = cam.aspect_ratio;
+    c.vfov = cam.vfov;
+    c.defocus_angle = cam.defocus_angle;
+    c.focus_dist = cam.focus_dist;
+    for (int k = 0; k < 3; k++) {
+        c.lookfrom[k] = cam.lookfrom[k];
+        c.lookat[k] = cam.lookat[k];
+        c.vup[k] = cam.vup[k];
+        c.background[k] = cam.background_color[k];
+    }
+    c.image_width = cam.image_width;
+    c.samples_per_pixel = cam.samples_per_pixel;
+    c.max_depth = cam.max_depth;
+    c.sky = cam.sky;
+    return c;
+}
+
+// Whether a camera setting is usable: a positive, finite aspect ratio and counts of at least 1
+inline bool valid_camera(double aspect_ratio, double image_width, double samples_per_pixel, double max_depth) {
+    auto count = [](double v) { return v >= 1 && v <= std::numeric_limits<int>::max(); };   // False for NaN too
+    return aspect_ratio > 0 && std::isfinite(aspect_ratio) && count(image_width) && count(samples_per_pixel) &&
+           count(max_depth);
+}
+
+// Returns false (and leaves cam alone) if the stored settings are not valid_camera
+inline bool unpack_camera(const scene_camera& c, camera& cam) {
+    if (!valid_camera(c.aspect_ratio, c.image_width, c.samples_per_pixel, c.max_depth))
+        return false;
+    cam.aspect_ratio = c.aspect_ratio;
+    cam.vfov = c.vfov;
+    cam.defocus_angle = c.defocus_angle;
+    cam.focus_dist = c.focus_dist;
+    cam.lookfrom = point3(c.lookfrom[0], c.lookfrom[1], c.lookfrom[2]);
+    cam.lookat = point3(c.lookat[0], c.lookat[1], c.lookat[2]);
+    cam.vup = vec3(c.vup[0], c.vup[1], c.vup[2]);
+    cam.image_width = c.image_width;
+    cam.samples_per_pixel = c.samples_per_pixel;
+    cam.max_depth = c.max_depth;
+    cam.sky = c.sky != 0;
+    cam.background_color = color(c.background[0], c.background[1], c.background[2]);
+    return true;
+}
+
+// Reads the next whitespace-separated word of the line; returns false at the end of the line
+inline bool next_word(const char*& p, const char* end, std::string& word) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+    const char* start = p;
+    while (p < end && *p != ' ' && *p != '\t' && *p != '\r') p++;
+    word.assign(start, p);
+    return !word.empty();
+}
+
+inline bool next_number(const char*& p, const char* end, double& value) {
+    std::string word;
+    if (!next_word(p, end, word)) return false;
+    char* stop;
+    value = std::strtod(word.c_str(), &stop);
+    return *stop == '\0';
+}
+
+// Applies the rest of a "camera parameter value" statement (after the word camera) to cam.
+// Returns what is wrong with it, or null.
+inline const char* parse_camera_statement(const char*& p, const char* stop, camera& cam) {
+    std::string key;
+    double v[3];
+    if (!next_word(p, stop, key) || !next_number(p, stop, v[0]))
+        return "expected: camera parameter value";
+
+    if (key == "lookfrom" || key == "lookat" || key == "vup" || key == "background") {
+        if (!next_number(p, stop, v[1]) || !next_number(p, stop, v[2]))
+            return "expected three coordinates";
+        vec3 value(v[0], v[1], v[2]);
+        if (key == "lookfrom")    cam.lookfrom = value;
+        else if (key == "lookat") cam.lookat = value;
+        else if (key == "vup")    cam.vup = value;
+        else {
+            cam.sky = false;
+            cam.background_color = value;
+        }
+    }
+    else if (key == "aspect_ratio") {
+        if (!valid_camera(v[0], 1, 1, 1)) return "aspect_ratio must be positive";
+        cam.aspect_ratio = v[0];
+    }
+    else if (key == "image_width" || key == "samples_per_pixel" || key == "max_depth") {
+        if (!valid_camera(1, v[0], 1, 1)) return "must be a positive integer";     // Checked before int() may overflow
+        if (key == "image_width")            cam.image_width = int(v[0]);
+        else if (key == "samples_per_pixel") cam.samples_per_pixel = int(v[0]);
+        else                                 cam.max_depth = int(v[0]);
+    }
+    else if (key == "vfov")              cam.vfov = v[0];
+    else if (key == "defocus_angle")     cam.defocus_angle = v[0];
+    else if (key == "focus_dist")        cam.focus_dist = v[0];
+    else return "unknown camera parameter";
+    return nullptr;
+}
+
+// Parses a text scene. Camera statements are applied to cam. Also returns the padded sphere arrays,
+// which save_scene_binary needs; the sphere batch uses them in place.
+inline bool load_scene_text(const std::string& path, camera& cam, scene_data& scene, shared_ptr<scene_arrays>& arrays) {
+    mapped_file file(path);
+    if (!file.is_open()) {
+        clog << "Could not open scene " << path << '\n';
+        return false;
+    }
+
+    scene.clear();
+    arrays = make_shared<scene_arrays>();
+    std::unordered_map<std::string, uint32_t> material_ids;
+
+    const char* p = file.data();
+    const char* file_end = p + file.size();
+    std::string word;
+
+    for (int line = 1; p < file_end; line++) {
+        const char* end = static_cast<const char*>(std::memchr(p, '\n', size_t(file_end - p)));
+        if (!end) end = file_end;
+        const char* comment = static_cast<const char*>(std::memchr(p, '#', size_t(end - p)));
+        const char* stop = comment ? comment : end;
+
+        auto fail = [&](const std::string& what) {
+            clog << path << ':' << line << ": " << what << '\n';
+            return false;
+        };
+
+        if (next_word(p, stop, word)) {
+            if (word == "sphere") {
+                double x, y, z, r;
+                std::string name;
+                if (!next_number(p, stop, x) || !next_number(p, stop, y) || !next_number(p, stop, z) ||
+                    !next_number(p, stop, r) || !next_word(p, stop, name))
+                    return fail("expected: sphere x y z radius material");
+                auto it = material_ids.find(name);
+                if (it == material_ids.end()) return fail("unknown material");
+                arrays->add(point3(x, y, z), std::fmax(0, r), it->second);
+            } else if (word == "mesh") {
+                mesh_desc desc = {};
+                std::string name;
+                double x = 0, y = 0, z = 0, scale = 1;
+                if (!next_word(p, stop, desc.path) || !next_word(p, stop, name))
+                    return fail("expected: mesh file.obj material [x y z [scale]]");
+                if (desc.path.size() >= sizeof(packed_mesh::path)) return fail("mesh path too long");
+                if (next_number(p, stop, x) && (!next_number(p, stop, y) || !next_number(p, stop, z)))
+                    return fail("expected three coordinates");
+                next_number(p, stop, scale);
+                auto it = material_ids.find(name);
+                if (it == material_ids.end()) return fail("unknown material");
+                desc.material = it->second;
+                desc.offset = vec3(x, y, z);
+                desc.scale = scale;
+                scene.mesh_descs.push_back(desc);
+            } else if (word == "key") {
+                key_desc key = {};
+                std::string target;
+                if (!next_number(p, stop, key.frame) || !next_word(p, stop, target))
+                    return fail("expected: key frame camera|mesh ...");
+                int value_count = 1, required = 1;
+                if (target == "camera") {
+                    std::string name;
+                    if (!next_word(p, stop, name)) return fail("expected: key frame camera parameter value");
+                    if (name == "lookfrom")        { key.target = key_target::lookfrom; value_count = required = 3; }
+                    else if (name == "lookat")     { key.target = key_target::lookat;   value_count = required = 3; }
+                    else if (name == "vfov")       key.target = key_target::vfov;
+                    else if (name == "focus_dist") key.target = key_target::focus_dist;
+                    else return fail("only lookfrom, lookat, vfov and focus_dist can be animated");
+                } else if (target == "mesh") {
+                    double index;
+                    if (!next_number(p, stop, index) || index < 0) return fail("expected: key frame mesh index x y z [scale [yaw]]");
+                    key.target = key_target::mesh;
+                    key.mesh = int32_t(index);
+                    key.values[3] = 1;
+                    value_count = 5;
+                    required = 3;
+                } else {
+                    return fail("expected: key frame camera|mesh ...");
+                }
+                for (int k = 0; k < value_count; k++) {
+                    if (!next_number(p, stop, key.values[k])) {
+                        if (k < required) return fail("missing key value");
+                        break;
+                    }
+                }
+                scene.key_descs.push_back(key);
+            } else if (word == "material") {
+                std::string name, type;
+                if (!next_word(p, stop, name) || !next_word(p, stop, type))
+                    return fail("expected: material name type parameters");
+
+                material_desc desc = {};
+                int param_count;
+                if (type == "lambertian")      { desc.kind = material_kind::lambertian; param_count = 3; }
+                else if (type == "metal")      { desc.kind = material_kind::metal;      param_count = 4; }
+                else if (type == "dielectric") { desc.kind = material_kind::dielectric; param_count = 1; }
+                else if (type == "light")      { desc.kind = material_kind::diffuse_light; param_count = 3; }
+                else return fail("unknown material type");
+                for (int k = 0; k < param_count; k++)
+                    if (!next_number(p, stop, desc.params[k])) return fail("missing material parameter");
+
+                if (!material_ids.emplace(name, uint32_t(scene.material_descs.size())).second)
+                    return fail("material " + name + " is already defined");
+                scene.material_descs.push_back(desc);
+            } else if (word == "camera") {
+                if (const char* error = parse_camera_statement(p, stop, cam))
+                    return fail(error);
+            } else {
+                return fail("unknown statement");
+            }
+        }
+
+        p = end + 1;
+    }
+
+    for (const auto& desc : scene.material_descs)
+        scene.materials.add(make_material(desc));
+
+    arrays->sort_spatially();
+    arrays->pad();
+    scene.spheres = make_shared<sphere_batch>(arrays->view(), arrays->bbox, arrays);
+
+    for (const auto& key : scene.key_descs) {
+        if (key.target == key_target::mesh && size_t(key.mesh) >= scene.mesh_descs.size()) {
+            clog << path << ": a key refers to mesh " << key.mesh << ", but there are " << scene.mesh_descs.size() << " mesh statements\n";
+            return false;
+        }
+    }
+    build_scene_animation(scene);
+    return load_scene_meshes(path, scene);
+}
+
+// Writes the scene in the binary layout that load_scene_binary maps back in
+inline bool save_scene_binary(const std::string& path, const camera& cam, const scene_data& scene, const scene_arrays& arrays,
+                              const scene_source_stamp& source = scene_source_stamp()) {
+    auto align = [](uint64_t offset) { return (offset + 63) / 64 * 64; };     // Every array starts on a cache line
+
+    scene_file_header header = {};
+    std::memcpy(header.magic, scene_file_magic, sizeof header.magic);
+    header.version = scene_file_version;
+    header.byte_order = 0x01020304;
+    header.material_count = uint32_t(scene.material_descs.size());
+    header.sphere_count = uint32_t(arrays.count);
+    header.real_size = sizeof(real);
+    header.padded_count = arrays.center_x.size();
+    header.cam = pack_camera(cam);
+    header.source_size = source.size;
+    header.source_mtime = source.mtime;
+    double box[6] = {arrays.bbox.x.min, arrays.bbox.x.max, arrays.bbox.y.min, arrays.bbox.y.max, arrays.bbox.z.min, arrays.bbox.z.max};
+    std::memcpy(header.bbox, box, sizeof box);
+
+    uint64_t n = header.padded_count;
+    header.materials_offset   = align(sizeof header);
+    header.center_x_offset    = align(header.materials_offset + header.material_count * sizeof(packed_material));
+    header.center_y_offset    = align(header.center_x_offset + n * sizeof(real));
+    header.center_z_offset    = align(header.center_y_offset + n * sizeof(real));
+    header.radius_offset      = align(header.center_z_offset + n * sizeof(real));
+    header.material_id_offset = align(header.radius_offset + n * sizeof(real));
+    header.mesh_count         = scene.mesh_descs.size();
+    header.meshes_offset      = align(header.material_id_offset + n * sizeof(uint32_t));
+    header.key_count          = scene.key_descs.size();
+    header.keys_offset        = align(header.meshes_offset + header.mesh_count * sizeof(packed_mesh));
+
+    std::ofstream out(path, std::ios::binary);
+    if (!out) return false;
+
+    auto write_at = [&](uint64_t offset, const void* data, size_t size) {
+        while (uint64_t(out.tellp()) < offset) out.put('\0');
+        out.write(static_cast<const char*>(data), std::streamsize(size));
+    };
+
+    write_at(0, &header, sizeof header);
+    std::vector<packed_material> packed;
+    for (const auto& desc : scene.material_descs) {
+        packed_material m = {};
+        m.kind = uint32_t(desc.kind);
+        std::memcpy(m.params, desc.params, sizeof m.params);
+        packed.push_back(m);
+    }
+    write_at(header.materials_offset, packed.data(), packed.size() * sizeof(packed_material));
+    write_at(header.center_x_offset, arrays.center_x.data(), n * sizeof(real));
+    write_at(header.center_y_offset, arrays.center_y.data(), n * sizeof(real));
+    write_at(header.center_z_offset, arrays.center_z.data(), n * sizeof(real));
+    write_at(header.radius_offset, arrays.radius.data(), n * sizeof(real));
+    write_at(header.material_id_offset, arrays.material_id.data(), n * sizeof(uint32_t));
+    for (uint64_t k = 0; k < header.mesh_count; k++) {
+        const mesh_desc& desc = scene.mesh_descs[k];
+        packed_mesh m = {};
+        std::strncpy(m.path, desc.path.c_str(), sizeof m.path - 1);
+        m.material = desc.material;
+        for (int axis = 0; axis < 3; axis++) m.offset[axis] = desc.offset[axis];
+        m.scale = desc.scale;
+        write_at(header.meshes_offset + k * sizeof(packed_mesh), &m, sizeof m);
+    }
+    for (uint64_t k = 0; k < header.key_count; k++) {
+        const key_desc& key = scene.key_descs[k];
+        packed_key packed = {key.frame, uint32_t(key.target), key.mesh, {}};
+        std::memcpy(packed.values, key.values, sizeof packed.values);
+        write_at(header.keys_offset + k * sizeof(packed_key), &packed, sizeof packed);
+    }
+    return bool(out);
+}
+
+// Maps a binary scene and builds the sphere batch directly on top of the mapped arrays. With source, the file
+// is a cache and is only used (quietly returns false otherwise) if it was made from a text scene with that stamp.
+inline bool load_scene_binary(const std::string& path, camera& cam, scene_data& scene,
+                              const scene_source_stamp* source = nullptr) {
+    auto file = make_shared<mapped_file>(path);
+    if (!file->is_open() || file->size() < sizeof(scene_file_header))
+        return false;
+
+    scene_file_header header;
+    std::memcpy(&header, file->data(), sizeof header);
+    if (std::memcmp(header.magic, scene_file_magic, sizeof header.magic) != 0)
+        return false;
+    if (header.version != scene_file_version || header.byte_order != 0x01020304 || header.real_size != sizeof(real)) {
+        clog << path << " is not a scene file this build can read\n";
+        return false;
+    }
+    if (source && (header.source_size != source->size || header.source_mtime != source->mtime))
+        return false;
+
+    // Nothing in the header is trusted: every array must lie inside the file, aligned for its type (the
+    // mapping starts on a page; empty arrays may point past the end), and the sphere arrays must cover the padded groups sphere_batch reads
+    uint64_t size = file->size();
+    auto fits = [size](uint64_t offset, uint64_t count, size_t element, size_t alignment) {
+        return count == 0 || (offset <= size && count <= (size - offset) / element && offset % alignment == 0);
+    };
+    uint64_t n = header.padded_count;
+    uint64_t groups = (uint64_t(header.sphere_count) + sphere_batch::padding - 1) / sphere_batch::padding;
+    if (header.sphere_count > uint32_t(std::numeric_limits<int>::max()) || groups * sphere_batch::padding > n ||
+        !fits(header.materials_offset, header.material_count, sizeof(packed_material), 1) ||
+        !fits(header.center_x_offset, n, sizeof(real), alignof(real)) ||
+        !fits(header.center_y_offset, n, sizeof(real), alignof(real)) ||
+        !fits(header.center_z_offset, n, sizeof(real), alignof(real)) ||
+        !fits(header.radius_offset, n, sizeof(real), alignof(real)) ||
+        !fits(header.material_id_offset, n, sizeof(uint32_t), alignof(uint32_t)) ||
+        !fits(header.meshes_offset, header.mesh_count, sizeof(packed_mesh), 1) ||
+        !fits(header.keys_offset, header.key_count, sizeof(packed_key), 1)) {
+        clog << path << " is truncated or damaged\n";
+        return false;
+    }
+    const uint32_t* material_ids = reinterpret_cast<const uint32_t*>(file->data() + header.material_id_offset);
+    for (uint32_t i = 0; i < header.sphere_count; i++) {
+        if (material_ids[i] >= header.material_count) {
+            clog << path << " has a sphere with an unknown material\n";
+            return false;
+        }
+    }
+
+    if (!unpack_camera(header.cam, cam)) {
+        clog << path << " has invalid camera settings\n";
+        return false;
+    }
+    scene.clear();
+
+    for (uint32_t k = 0; k < header.material_count; k++) {
+        packed_material m;
+        std::memcpy(&m, file->data() + header.materials_offset + k * sizeof(packed_material), sizeof m);
+        if (m.kind > uint32_t(material_kind::diffuse_light)) {
+            clog << path << " has an unknown material type\n";
+            return false;
+        }
+        material_desc desc;
+        desc.kind = material_kind(m.kind);
+        std::memcpy(desc.params, m.params, sizeof desc.params);
+        scene.material_descs.push_back(desc);
+        scene.materials.add(make_material(desc));
+    }
+
+    sphere_soa soa;
+    soa.center_x = reinterpret_cast<const real*>(file->data() + header.center_x_offset);
+    soa.center_y = reinterpret_cast<const real*>(file->data() + header.center_y_offset);
+    soa.center_z = reinterpret_cast<const real*>(file->data() + header.center_z_offset);
+    soa.radius = reinterpret_cast<const real*>(file->data() + header.radius_offset);
+    soa.material_id = material_ids;
+    soa.count = int(header.sphere_count);
+
+    aabb bbox(interval(header.bbox[0], header.bbox[1]), interval(header.bbox[2], header.bbox[3]),
+              interval(header.bbox[4], header.bbox[5]));
+    scene.spheres = make_shared<sphere_batch>(soa, bbox, file);
+
+    for (uint64_t k = 0; k < header.mesh_count; k++) {
+        packed_mesh m;
+        std::memcpy(&m, file->data() + header.meshes_offset + k * sizeof(packed_mesh), sizeof m);
+        m.path[sizeof m.path - 1] = '\0';
+        if (m.material >= header.material_count) {
+            clog << path << " has a mesh with an unknown material\n";
+            return false;
+        }
+        scene.mesh_descs.push_back({m.path, m.material, vec3(m.offset[0], m.offset[1], m.offset[2]), m.scale});
+    }
+
+    for (uint64_t k = 0; k < header.key_count; k++) {
+        packed_key packed;
+        std::memcpy(&packed, file->data() + header.keys_offset + k * sizeof(packed_key), sizeof packed);
+        if (packed.target > uint32_t(key_target::mesh) ||
+            (packed.target == uint32_t(key_target::mesh) && (packed.mesh < 0 || uint64_t(packed.mesh) >= header.mesh_count))) {
+            clog << path << " has a bad animation key\n";
+            return false;
+        }
+        key_desc key = {packed.frame, key_target(packed.target), packed.mesh, {}};
+        std::memcpy(key.values, packed.values, sizeof key.values);
+        scene.key_descs.push_back(key);
+    }
+    build_scene_animation(scene);
+    return load_scene_meshes(path, scene);
+}
+
+// Loads a scene file. A binary scene is mapped directly. For a text scene, a binary cache next to it
+// (path + ".bin", or ".f32.bin" in the float build) is used when it was made from the text as it is now (same
+// size and modification time), and written otherwise.
+inline bool load_scene(const std::string& path, camera& cam, scene_data& scene) {
+    if (load_scene_binary(path, cam, scene))
+        return true;
+
+    std::string cache_path = path + (sizeof(real) == sizeof(float) ? ".f32.bin" : ".bin");
+    scene_source_stamp source;          // Taken before parsing: an edit during the parse makes the cache stale
+    bool stamped = stat_scene_source(path, source);
+    if (stamped && load_scene_binary(cache_path, cam, scene, &source))
+        return true;
+
+    shared_ptr<scene_arrays> arrays;
+    if (!load_scene_text(path, cam, scene, arrays))
+        return false;
+
+    if (!stamped)
+        return true;
+    if (!save_scene_binary(cache_path, cam, scene, *arrays, source))
+        clog << "Could not write scene cache " << cache_path << '\n';
+    return true;
+}
+
+// Puts the objects of a loaded scene into world. Big sphere sets get a BVH over slices of their (spatially
+// sorted) arrays, stored in the scene's arena.
+inline void add_scene_objects(scene_data& scene, hittable_list& world) {
+    if (scene.spheres->size() > 64) {
+        scene.sphere_tree = scene.arena.make<bvh_node>(sphere_batch::slices(scene.spheres, 8, &scene.arena));
+        world.add(scene.sphere_tree);
+    } else if (scene.spheres->size() > 0) {
+        world.add(scene.spheres);
+    }
+    if (scene.meshes)
+        world.add(scene.meshes);
+}
+
+// The spheres of a loaded scene that are made of a light material, for the camera to sample.
+// Meshes made of one still glow, but are only found by scattered rays.
+inline shared_ptr<light_list> scene_lights(const scene_data& scene) {
+    auto lights = make_shared<light_list>();
+    const sphere_soa& soa = scene.spheres->arrays();
+    for (int i = 0; i < soa.count; i++)
+        if (soa.radius[i] > 0 && kind(scene.materials[soa.material_id[i]]) == material_kind::diffuse_light)
+            lights->add(point3(soa.center_x[i], soa.center_y[i], soa.center_z[i]), soa.radius[i], i);
+    return lights;
+}
+
+// Hash of everything a loaded scene draws: its materials, spheres, mesh statements and animation keys.
+// OBJ files are taken by their path, not read again. Checkpoints record it (see camera::scene_key).
+inline uint64_t scene_fingerprint(const scene_data& scene) {
+    uint64_t h = 0;
+    auto add = [&](double v) {
+        uint64_t bits;
+        std::memcpy(&bits, &v, sizeof bits);
+        h = hash_combine(h, bits);
+    };
+
+    add(double(scene.material_descs.size()));           // Counts first, so the sections cannot run into each other
+    for (const auto& desc : scene.material_descs) {
+        add(double(desc.kind));
+        for (double p : desc.params) add(p);
+    }
+    const sphere_soa& soa = scene.spheres->arrays();
+    add(soa.count);
+    for (int i = 0; i < soa.count; i++) {
+        add(soa.center_x[i]); add(soa.center_y[i]); add(soa.center_z[i]);
+        add(soa.radius[i]);
+        add(soa.material_id[i]);
+    }
+    add(double(scene.mesh_descs.size()));
+    for (const auto& desc : scene.mesh_descs) {
+        add(double(desc.path.size()));
+        for (char c : desc.path) add(c);
+        add(desc.material);
+        add(desc.offset.x()); add(desc.offset.y()); add(desc.offset.z());
+        add(desc.scale);
+    }
+    add(double(scene.key_descs.size()));
+    for (const auto& key : scene.key_descs) {
+        add(key.frame);
+        add(double(key.target));
+        add(key.mesh);
+        for (double v : key.values) add(v);
+    }
+    return h;
+}
+
+// Where the memory of a scene goes, in bytes
+struct scene_memory {
+    size_t spheres = 0;         // Sphere arrays
+    size_t materials = 0;
+    size_t sphere_bvh = 0;      // Nodes and leaf pointers of the BVH over the sphere slices
+    size_t meshes = 0;          // Vertex and index buffers, mesh BVHs
+    size_t instances = 0;       // Mesh placements and their top-level BVH
+    size_t arena = 0;           // Taken by the arena (the slices and the BVH object)
+
+    size_t total() const { return spheres + materials + sphere_bvh + meshes + instances + arena; }
+};
+
+inline scene_memory scene_footprint(const scene_data& scene) {
+    scene_memory memory;
+    if (scene.spheres) {
+        size_t padded = size_t((scene.spheres->size() + sphere_batch::padding - 1) / sphere_batch::padding
+                               * sphere_batch::padding);
+        memory.spheres = padded * (4 * sizeof(real) + sizeof(uint32_t));
+    }
+    memory.materials = scene.materials.size() * sizeof(material);
+    if (scene.sphere_tree) memory.sphere_bvh = scene.sphere_tree->memory_bytes();
+    for (const auto& shape : scene.mesh_shapes)
+        memory.meshes += shape->mesh().memory_bytes() + shape->acceleration_bytes();
+    if (scene.meshes) memory.instances = scene.meshes->memory_bytes();
+    memory.arena = scene.arena.bytes_reserved();
+    return memory;
+}
+
+inline std::ostream& operator<<(std::ostream& out, const scene_memory& memory) {
+    auto size = [](size_t bytes) {
+        char text[32];
+        if (bytes >= (size_t(1) << 20)) std::snprintf(text, sizeof text, "%.1f MB", double(bytes) / (1 << 20));
+        else std::snprintf(text, sizeof text, "%.1f KB", double(bytes) / (1 << 10));
+        return std::string(text);
+    };
+    return out << size(memory.total()) << " (spheres " << size(memory.spheres) << ", sphere BVH " << size(memory.sphere_bvh)
+               << ", meshes " << size(memory.meshes) << ", instances " << size(memory.instances)
+               << ", materials " << size(memory.materials) << ", arena " << size(memory.arena) << ")";
+}
+
+#endif
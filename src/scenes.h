@@ -0,0 +1,152 @@
+#ifndef SCENES_H
+#define SCENES_H
+
+#include "hittable_list.h"
+#include "bvh.h"
+#include "instance.h"
+#include "material.h"
+#include "sphere.h"
+#include "sphere_batch.h"
+#include "triangle_mesh.h"
+
+// Built-in scenes, shared by the renderer and the benchmarks
+
+// The final scene of the book: a field of small random spheres around three big ones
+inline void random_spheres_scene(hittable_list& world, material_table& materials) {
+    sphere_batch spheres; // All spheres of the scene, intersected several at a time with SIMD
+
+    auto ground_material = materials.add(lambertian(color(0.5, 0.5, 0.5)));
+    spheres.add(point3(0,-1000,0), 1000, ground_material);
+
+    for (int a = -1; a < 1; a++) {
+        for (int b = -11; b < 11; b++) {
+            auto choose_mat = random_double();
+            point3 center(a + 0.9*random_double(), 0.2, b + 0.9*random_double());
+
+            if ((center - point3(4, 0.2, 0)).length() > 0.9) {
+                uint32_t sphere_material;
+
+                if (choose_mat < 0.8) {
+                    // diffuse
+                    auto albedo = color::random() * color::random();
+                    sphere_material = materials.add(lambertian(albedo));
+                    spheres.add(center, 0.2, sphere_material);
+                } else if (choose_mat < 0.95) {
+                    // metal
+                    auto albedo = color::random(0.5, 1);
+                    auto fuzz = random_double(0, 0.5);
+                    sphere_material = materials.add(metal(albedo, fuzz));
+                    spheres.add(center, 0.2, sphere_material);
+                } else {
+                    // glass
+                    sphere_material = materials.add(dielectric(1.5));
+                    spheres.add(center, 0.2, sphere_material);
+                }
+            }
+        }
+    }
+
+    auto material1 = materials.add(dielectric(1.5));
+    spheres.add(point3(0, 1, 0), 1.0, material1);
+
+    auto material2 = materials.add(lambertian(color(0.4, 0.2, 0.1)));
+    spheres.add(point3(-4, 1, 0), 1.0, material2);
+
+    auto material3 = materials.add(metal(color(0.7, 0.6, 0.5), 0.0));
+    spheres.add(point3(4, 1, 0), 1.0, material3);
+
+    world.add(make_shared<sphere_batch>(spheres));  // A few dozen spheres are fastest as one batch; for big scenes
+                                                    // use make_shared<bvh_node>(spheres.split(8)) to only test spheres near each ray
+    
+    
+    /*auto R = std::cos(pi/4);
+
+    auto material_left  = materials.add(lambertian(color(0.9,0,0.5)));
+    auto material_right = materials.add(lambertian(color(0,1,0)));
+
+    world.add(make_shared<sphere>(point3(-R, 0, -1), R, material_left));
+    world.add(make_shared<sphere>(point3( R, 0, -1), R, material_right));*/
+    
+    /*auto material_ground = materials.add(lambertian(color(0.4, 0.9, 0.1)));
+    auto material_center = materials.add(lambertian(color(0.2, 0.3, 1.0)));
+    // Hollow glass sphere is modeled just as a bubble of air inside the glass environment
+    auto material_left   = materials.add(dielectric(1.50));        
+    auto material_bubble = materials.add(dielectric(1.00 / 1.50));
+    auto material_right = materials.add(metal(color(0.8, 0.1, 0.2), 1.0));
+
+    world.add(make_shared<sphere>(point3( 0.0, -100.5, -1.0), 100.0, material_ground));
+    world.add(make_shared<sphere>(point3( 0.0, 0.0, -1.2), 0.5, material_center));
+    world.add(make_shared<sphere>(point3(-1.0, 0.0, -1.0), 0.5, material_left));
+    world.add(make_shared<sphere>(point3(-1.0, 0.0, -1.0), 0.4, material_bubble));
+    world.add(make_shared<sphere>(point3( 1.0, 0.0, -1.0), 0.5, material_right));*/
+}
+
+// Many small random spheres in a cube, for testing acceleration structures
+inline void sphere_cloud_scene(hittable_list& world, material_table& materials, int count) {
+    auto diffuse = materials.add(lambertian(color(0.6, 0.5, 0.4)));
+    auto mirror = materials.add(metal(color(0.8, 0.8, 0.8), 0.1));
+
+    sphere_batch spheres;
+    for (int k = 0; k < count; k++) {
+        point3 center = vec3::random(-4, 4);
+        spheres.add(center, random_double(0.02, 0.1), k % 4 == 0 ? mirror : diffuse);
+    }
+    world.add(make_shared<bvh_node>(spheres.split(8)));
+}
+
+// side x side copies of one cloud of small spheres, each copy with its own rotation, size and place.
+// The spheres and the BVH of the cloud are stored once, however many copies there are.
+inline void instanced_clouds_scene(hittable_list& world, material_table& materials, int side, int spheres_per_cloud) {
+    auto ground = materials.add(lambertian(color(0.5, 0.5, 0.5)));
+    auto diffuse = materials.add(lambertian(color(0.6, 0.5, 0.4)));
+    auto mirror = materials.add(metal(color(0.8, 0.8, 0.8), 0.1));
+
+    sphere_batch spheres;
+    for (int k = 0; k < spheres_per_cloud; k++)
+        spheres.add(vec3::random(-1, 1), random_double(0.02, 0.08), k % 4 == 0 ? mirror : diffuse);
+    auto cloud = make_shared<bvh_node>(spheres.split(8));
+
+    std::vector<instance> copies;
+    copies.reserve(size_t(side) * side);
+    for (int a = 0; a < side; a++) {
+        for (int b = 0; b < side; b++) {
+            auto place = affine_transform::translate(vec3(3 * (a - 0.5 * (side - 1)), 1.2, 3 * (b - 0.5 * (side - 1))))
+                       * affine_transform::rotate(random_unit_vector(), random_double(0, 360))
+                       * affine_transform::scale(random_double(0.6, 1.2));
+            copies.emplace_back(cloud, place);
+        }
+    }
+    world.add(make_shared<instance_set>(std::move(copies)));
+    world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, ground));
+}
+
+// Unit sphere as a triangle mesh of latitude rings and longitude segments (2 * segments * (rings - 1) triangles)
+inline shared_ptr<mesh_buffers> sphere_mesh(int rings, int segments) {
+    auto mesh = make_shared<mesh_buffers>();
+    mesh->vertices.emplace_back(0, 1, 0);
+    for (int a = 1; a < rings; a++) {
+        double theta = pi * a / rings;
+        for (int b = 0; b < segments; b++) {
+            double phi = 2 * pi * b / segments;
+            mesh->vertices.emplace_back(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+        }
+    }
+    mesh->vertices.emplace_back(0, -1, 0);
+
+    auto ring_vertex = [&](int a, int b) { return uint32_t(1 + (a - 1) * segments + b % segments); };
+    auto add = [&](uint32_t v0, uint32_t v1, uint32_t v2) {
+        mesh->indices.insert(mesh->indices.end(), {v0, v1, v2});
+    };
+    uint32_t south = uint32_t(mesh->vertices.size() - 1);
+    for (int b = 0; b < segments; b++) {
+        add(0, ring_vertex(1, b + 1), ring_vertex(1, b));
+        for (int a = 1; a + 1 < rings; a++) {
+            add(ring_vertex(a, b), ring_vertex(a, b + 1), ring_vertex(a + 1, b + 1));
+            add(ring_vertex(a, b), ring_vertex(a + 1, b + 1), ring_vertex(a + 1, b));
+        }
+        add(south, ring_vertex(rings - 1, b), ring_vertex(rings - 1, b + 1));
+    }
+    return mesh;
+}
+
+#endif
@@ -0,0 +1,141 @@
+#ifndef SIMD_LANES_H
+#define SIMD_LANES_H
+
+#include "precision.h"
+
+#include <cmath>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+// Instruction sets the batch intersectors (sphere_batch, triangle_mesh) can use. The best one is picked at runtime.
+enum class simd_level { scalar, sse2, avx2 };
+
+inline simd_level detect_simd_level() {
+#if SIMD_X86
+    if (__builtin_cpu_supports("avx2"))
+        return simd_level::avx2;
+    return simd_level::sse2;        // Every x86-64 CPU has SSE2
+#else
+    return simd_level::scalar;
+#endif
+}
+
+#if SIMD_X86
+// Thin wrappers around the intrinsics, so one kernel source serves every instruction set and precision.
+// Lane indices are kept as floating-point values; float represents them exactly up to 2^24 spheres per batch.
+struct sse2_lanes {
+    using reg = __m128d;
+    static constexpr int width = 2;
+
+    static reg load(const double* p)         { return _mm_loadu_pd(p); }
+    static reg set1(double x)                { return _mm_set1_pd(x); }
+    static reg index(int base)               { return _mm_set_pd(base + 1, base); }
+    static reg add(reg a, reg b)             { return _mm_add_pd(a, b); }
+    static reg sub(reg a, reg b)             { return _mm_sub_pd(a, b); }
+    static reg mul(reg a, reg b)             { return _mm_mul_pd(a, b); }
+    static reg div(reg a, reg b)             { return _mm_div_pd(a, b); }
+    static reg sqrt(reg a)                   { return _mm_sqrt_pd(a); }
+    static reg less(reg a, reg b)            { return _mm_cmplt_pd(a, b); }
+    static reg less_equal(reg a, reg b)      { return _mm_cmple_pd(a, b); }
+    static reg logical_and(reg a, reg b)     { return _mm_and_pd(a, b); }
+    static reg logical_or(reg a, reg b)      { return _mm_or_pd(a, b); }
+    static reg select(reg mask, reg a, reg b) { return _mm_or_pd(_mm_and_pd(mask, a), _mm_andnot_pd(mask, b)); }
+    static bool any(reg mask)                { return _mm_movemask_pd(mask) != 0; }
+    static void store(double* p, reg a)      { _mm_storeu_pd(p, a); }
+};
+
+struct sse2_float_lanes {
+    using reg = __m128;
+    static constexpr int width = 4;
+
+    static reg load(const float* p)          { return _mm_loadu_ps(p); }
+    static reg set1(float x)                 { return _mm_set1_ps(x); }
+    static reg index(int base)               { return _mm_set_ps(base + 3, base + 2, base + 1, base); }
+    static reg add(reg a, reg b)             { return _mm_add_ps(a, b); }
+    static reg sub(reg a, reg b)             { return _mm_sub_ps(a, b); }
+    static reg mul(reg a, reg b)             { return _mm_mul_ps(a, b); }
+    static reg div(reg a, reg b)             { return _mm_div_ps(a, b); }
+    static reg sqrt(reg a)                   { return _mm_sqrt_ps(a); }
+    static reg less(reg a, reg b)            { return _mm_cmplt_ps(a, b); }
+    static reg less_equal(reg a, reg b)      { return _mm_cmple_ps(a, b); }
+    static reg logical_and(reg a, reg b)     { return _mm_and_ps(a, b); }
+    static reg logical_or(reg a, reg b)      { return _mm_or_ps(a, b); }
+    static reg select(reg mask, reg a, reg b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+    static bool any(reg mask)                { return _mm_movemask_ps(mask) != 0; }
+    static void store(float* p, reg a)       { _mm_storeu_ps(p, a); }
+};
+
+#define SIMD_AVX2 __attribute__((target("avx2"), always_inline))
+
+struct avx2_lanes {
+    using reg = __m256d;
+    static constexpr int width = 4;
+
+    SIMD_AVX2 static inline reg load(const double* p)          { return _mm256_loadu_pd(p); }
+    SIMD_AVX2 static inline reg set1(double x)                 { return _mm256_set1_pd(x); }
+    SIMD_AVX2 static inline reg index(int base)                { return _mm256_set_pd(base + 3, base + 2, base + 1, base); }
+    SIMD_AVX2 static inline reg add(reg a, reg b)              { return _mm256_add_pd(a, b); }
+    SIMD_AVX2 static inline reg sub(reg a, reg b)              { return _mm256_sub_pd(a, b); }
+    SIMD_AVX2 static inline reg mul(reg a, reg b)              { return _mm256_mul_pd(a, b); }
+    SIMD_AVX2 static inline reg div(reg a, reg b)              { return _mm256_div_pd(a, b); }
+    SIMD_AVX2 static inline reg sqrt(reg a)                    { return _mm256_sqrt_pd(a); }
+    SIMD_AVX2 static inline reg less(reg a, reg b)             { return _mm256_cmp_pd(a, b, _CMP_LT_OQ); }
+    SIMD_AVX2 static inline reg less_equal(reg a, reg b)       { return _mm256_cmp_pd(a, b, _CMP_LE_OQ); }
+    SIMD_AVX2 static inline reg logical_and(reg a, reg b)      { return _mm256_and_pd(a, b); }
+    SIMD_AVX2 static inline reg logical_or(reg a, reg b)       { return _mm256_or_pd(a, b); }
+    SIMD_AVX2 static inline reg select(reg mask, reg a, reg b) { return _mm256_blendv_pd(b, a, mask); }
+    SIMD_AVX2 static inline bool any(reg mask)                 { return _mm256_movemask_pd(mask) != 0; }
+    SIMD_AVX2 static inline void store(double* p, reg a)       { _mm256_storeu_pd(p, a); }
+};
+
+struct avx2_float_lanes {
+    using reg = __m256;
+    static constexpr int width = 8;
+
+    SIMD_AVX2 static inline reg load(const float* p)           { return _mm256_loadu_ps(p); }
+    SIMD_AVX2 static inline reg set1(float x)                  { return _mm256_set1_ps(x); }
+    SIMD_AVX2 static inline reg index(int base) {
+        return _mm256_set_ps(base + 7, base + 6, base + 5, base + 4, base + 3, base + 2, base + 1, base);
+    }
+    SIMD_AVX2 static inline reg add(reg a, reg b)              { return _mm256_add_ps(a, b); }
+    SIMD_AVX2 static inline reg sub(reg a, reg b)              { return _mm256_sub_ps(a, b); }
+    SIMD_AVX2 static inline reg mul(reg a, reg b)              { return _mm256_mul_ps(a, b); }
+    SIMD_AVX2 static inline reg div(reg a, reg b)              { return _mm256_div_ps(a, b); }
+    SIMD_AVX2 static inline reg sqrt(reg a)                    { return _mm256_sqrt_ps(a); }
+    SIMD_AVX2 static inline reg less(reg a, reg b)             { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+    SIMD_AVX2 static inline reg less_equal(reg a, reg b)       { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+    SIMD_AVX2 static inline reg logical_and(reg a, reg b)      { return _mm256_and_ps(a, b); }
+    SIMD_AVX2 static inline reg logical_or(reg a, reg b)       { return _mm256_or_ps(a, b); }
+    SIMD_AVX2 static inline reg select(reg mask, reg a, reg b) { return _mm256_blendv_ps(b, a, mask); }
+    SIMD_AVX2 static inline bool any(reg mask)                 { return _mm256_movemask_ps(mask) != 0; }
+    SIMD_AVX2 static inline void store(float* p, reg a)        { _mm256_storeu_ps(p, a); }
+};
+#endif
+
+// One lane, for kernels that are written with the wrappers but have no SIMD version on this machine.
+// Masks are 1 (true) or 0 (false).
+struct scalar_lanes {
+    using reg = real;
+    static constexpr int width = 1;
+
+    static reg load(const real* p)           { return *p; }
+    static reg set1(real x)                  { return x; }
+    static reg index(int base)               { return real(base); }
+    static reg add(reg a, reg b)             { return a + b; }
+    static reg sub(reg a, reg b)             { return a - b; }
+    static reg mul(reg a, reg b)             { return a * b; }
+    static reg div(reg a, reg b)             { return a / b; }
+    static reg sqrt(reg a)                   { return std::sqrt(a); }
+    static reg less(reg a, reg b)            { return a < b; }
+    static reg less_equal(reg a, reg b)      { return a <= b; }
+    static reg logical_and(reg a, reg b)     { return a != 0 && b != 0; }
+    static reg logical_or(reg a, reg b)      { return a != 0 || b != 0; }
+    static reg select(reg mask, reg a, reg b) { return mask != 0 ? a : b; }
+    static bool any(reg mask)                { return mask != 0; }
+    static void store(real* p, reg a)        { *p = a; }
+};
+
+#endif
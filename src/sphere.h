@@ -4,17 +4,20 @@
 #include "hittable.h"
 #include "vec3.h"
 #include "ray.h"
-
-class material; 
+#include "render_stats.h"
 
 class sphere : public hittable {
   public:
 
     // Constructor
-    sphere(const point3& center, double radius, shared_ptr<material> mat) : center(center), radius(std::fmax(0,radius)), mat(mat) {}
+    sphere(const point3& center, real radius, uint32_t mat) : center(center), radius(std::fmax(0,radius)), mat(mat) {
+        auto rvec = vec3(radius, radius, radius);
+        bbox = aabb(center - rvec, center + rvec);
+    }
 
     // Override - safety feature for virtual. Not mandatory but a good practice.
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        RENDER_STAT(thread_render_stats().count_tests(primitive_kind::sphere));
 
         vec3 oc = center - r.origin();
 
@@ -52,21 +55,31 @@ class sphere : public hittable {
         rec.normal = (rec.p - center) / radius;
 
         // Normalized vector from the sphere center to the hit point
-        vec3 outward_normal = (rec.p - center) / radius;
+        vec3 outward_normal = unit_vector(rec.p - center);
+
+        // Puts the point back onto the surface: r.at(t) can miss it by far more than the rounding error of p,
+        // since t comes from a difference of nearly equal numbers
+        rec.p = center + radius * outward_normal;
         
         // Set the direction of the vector
         rec.set_face_normal(r, outward_normal);
 
+        rec.p_error = hit_point_error(center, radius);
         rec.mat = mat;
+        rec.sphere = -1;                // Not one of the scene's sphere arrays
+        RENDER_STAT(thread_render_stats().count_hit(primitive_kind::sphere));
 
 
         return true;
     }
 
+    aabb bounding_box() const override { return bbox; }
+
   private:
     point3 center;
-    double radius;
-    shared_ptr<material> mat;
+    real radius;
+    uint32_t mat;       // Material index
+    aabb bbox;
 };
 
 
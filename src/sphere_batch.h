@@ -0,0 +1,356 @@
+#ifndef SPHERE_BATCH_H
+#define SPHERE_BATCH_H
+
+#include "hittable.h"
+#include "render_stats.h"
+#include "scene_arena.h"
+#include "simd_lanes.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <type_traits>
+#include <vector>
+
+// Centers, radii and material IDs of many spheres stored as separate arrays (structure of arrays).
+// The arrays are padded past `count` with spheres that can never be hit (NaN centers).
+struct sphere_soa {
+    const real* center_x = nullptr;
+    const real* center_y = nullptr;
+    const real* center_z = nullptr;
+    const real* radius = nullptr;
+    const uint32_t* material_id = nullptr;
+    int count = 0;
+};
+
+#if SIMD_X86
+// The kernel is compiled once per instruction set: the same source, a different lane type and target attribute
+namespace sphere_batch_sse2 {
+    using lanes = std::conditional<std::is_same<real, float>::value, sse2_float_lanes, sse2_lanes>::type;
+    #define SPHERE_BATCH_TARGET
+    #include "sphere_batch_kernel.h"
+    #undef SPHERE_BATCH_TARGET
+}
+
+namespace sphere_batch_avx2 {
+    using lanes = std::conditional<std::is_same<real, float>::value, avx2_float_lanes, avx2_lanes>::type;
+    #define SPHERE_BATCH_TARGET __attribute__((target("avx2")))
+    #include "sphere_batch_kernel.h"
+    #undef SPHERE_BATCH_TARGET
+}
+#endif
+
+// Many spheres tested together: 2 (SSE2) or 4 (AVX2) spheres per instruction on x86, a plain loop elsewhere.
+// Only the closest sphere found is turned into a hit_record, so the misses and farther hits cost no
+// record writes. It is a regular hittable, so it also works as a leaf inside a bvh_node.
+class sphere_batch : public hittable {
+    public:
+        simd_level level = detect_simd_level();     // Can be lowered to compare the code paths
+
+        static constexpr int padding = 32 / sizeof(real);  // Lanes in one AVX register; the arrays are always padded to a multiple of it
+
+        // Index of sphere 0 of this batch in the batch it is a slice of, so hits name the same sphere (hit_record::sphere)
+        // whichever slice they come from. -1 for the batches made by split, whose spheres are reordered copies.
+        int first_index = 0;
+
+        sphere_batch() {}
+
+        // Uses sphere arrays that live elsewhere, for example in a memory-mapped scene file, without copying them.
+        // `owner` keeps that memory alive for as long as the batch exists.
+        sphere_batch(const sphere_soa& arrays, const aabb& bbox, shared_ptr<const void> owner)
+          : soa(arrays), bbox(bbox), owner(std::move(owner)) {}
+
+        // A copy must point its view at its own arrays, not at the ones of the batch it was copied from
+        sphere_batch(const sphere_batch& other)
+          : hittable(other), level(other.level), first_index(other.first_index), soa(other.soa),
+            storage(other.storage), bbox(other.bbox), owner(other.owner) {
+            if (!owner) set_size(soa.count);
+        }
+
+        sphere_batch& operator=(const sphere_batch& other) {
+            if (this != &other) {
+                level = other.level;
+                first_index = other.first_index;
+                soa = other.soa;
+                storage = other.storage;
+                bbox = other.bbox;
+                owner = other.owner;
+                if (!owner) set_size(soa.count);
+            }
+            return *this;
+        }
+
+        sphere_batch(sphere_batch&&) = default;             // Moving a vector keeps its data where it is
+        sphere_batch& operator=(sphere_batch&&) = default;
+
+        void add(const point3& center, real radius, uint32_t mat) {
+            radius = std::fmax(0, radius);
+            if (owner) make_owned();
+
+            auto rvec = vec3(radius, radius, radius);
+            bbox = aabb(bbox, aabb(center - rvec, center + rvec));
+
+            int i = soa.count;
+            set_size(soa.count + 1);
+            storage.center_x[i] = center.x();
+            storage.center_y[i] = center.y();
+            storage.center_z[i] = center.z();
+            storage.radius[i] = radius;
+            storage.material_id[i] = mat;
+        }
+
+        int size() const { return soa.count; }
+
+        const sphere_soa& arrays() const { return soa; }
+
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            int index;
+            real t;
+            RENDER_STAT(thread_render_stats().count_tests(primitive_kind::sphere_batch, soa.count));
+            if (!closest_hit(r, ray_t, index, t))
+                return false;
+            RENDER_STAT(thread_render_stats().count_hit(primitive_kind::sphere_batch));
+
+            point3 center(soa.center_x[index], soa.center_y[index], soa.center_z[index]);
+            rec.t = t;
+            rec.p = r.at(t);
+            vec3 outward_normal = unit_vector(rec.p - center);
+            rec.p = center + soa.radius[index] * outward_normal;     // Back onto the surface, like sphere::hit
+            rec.set_face_normal(r, outward_normal);
+            rec.p_error = hit_point_error(center, soa.radius[index]);
+            rec.mat = soa.material_id[index];
+            rec.sphere = first_index < 0 ? -1 : first_index + index;
+            return true;
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        // Splits the batch into spatially compact batches of at most max_size spheres,
+        // ready to be used as the leaves of a bvh_node. With an arena, the batches and their arrays are
+        // stored there, one after the other in the order of the leaves.
+        std::vector<shared_ptr<hittable>> split(int max_size, scene_arena* arena = nullptr) const {
+            std::vector<int> order(soa.count);
+            std::iota(order.begin(), order.end(), 0);
+
+            std::vector<std::pair<int, int>> ranges;            // [begin, end) of each batch in `order`
+            split_range(order, 0, soa.count, std::max(max_size, 1), ranges);
+
+            std::vector<shared_ptr<hittable>> batches;
+            if (!arena) {
+                for (auto [begin, end] : ranges) {
+                    auto batch = make_shared<sphere_batch>();
+                    batch->level = level;
+                    batch->first_index = -1;
+                    for (int k = begin; k < end; k++) {
+                        int i = order[k];
+                        batch->add(point3(soa.center_x[i], soa.center_y[i], soa.center_z[i]), soa.radius[i],
+                                   soa.material_id[i]);
+                    }
+                    batches.push_back(batch);
+                }
+                return batches;
+            }
+
+            // Every batch starts on a multiple of the lane count and is padded like a batch of its own
+            std::vector<size_t> starts;
+            size_t padded = 0;
+            for (auto [begin, end] : ranges) {
+                starts.push_back(padded);
+                padded += size_t((end - begin + padding - 1) / padding * padding);
+            }
+            auto nan = std::numeric_limits<real>::quiet_NaN();
+            real* x = arena->allocate_array<real>(padded, 32);
+            real* y = arena->allocate_array<real>(padded, 32);
+            real* z = arena->allocate_array<real>(padded, 32);
+            real* radius = arena->allocate_array<real>(padded, 32);
+            uint32_t* material_id = arena->allocate_array<uint32_t>(padded, 32);
+            std::fill(x, x + padded, nan);
+            std::fill(y, y + padded, nan);
+            std::fill(z, z + padded, nan);
+            std::fill(radius, radius + padded, real(0));
+            std::fill(material_id, material_id + padded, 0u);
+
+            auto arrays = scene_arena::handle<const void>(x);   // Non-null owner: the batches view external arrays
+            sphere_batch* leaves = arena->make_array<sphere_batch>(ranges.size(), [&](size_t b) {
+                auto [begin, end] = ranges[b];
+                size_t start = starts[b];
+                aabb bbox;
+                for (int k = begin; k < end; k++) {
+                    int i = order[k];
+                    size_t j = start + size_t(k - begin);
+                    x[j] = soa.center_x[i];
+                    y[j] = soa.center_y[i];
+                    z[j] = soa.center_z[i];
+                    radius[j] = soa.radius[i];
+                    material_id[j] = soa.material_id[i];
+                    auto r = vec3(radius[j], radius[j], radius[j]);
+                    point3 c(x[j], y[j], z[j]);
+                    bbox = aabb(bbox, aabb(c - r, c + r));
+                }
+                sphere_batch leaf({x + start, y + start, z + start, radius + start, material_id + start, end - begin},
+                                  bbox, arrays);
+                leaf.level = level;
+                leaf.first_index = -1;
+                return leaf;
+            });
+            for (size_t b = 0; b < ranges.size(); b++)
+                batches.push_back(scene_arena::handle<hittable>(leaves + b));
+            return batches;
+        }
+
+        // Batches that view consecutive ranges of about slice_size spheres of `batch`, without copying anything.
+        // Works best when the spheres are stored in a spatially coherent order, as scene files are.
+        // With an arena, the slices are stored there next to each other instead of allocated one by one.
+        static std::vector<shared_ptr<hittable>> slices(const shared_ptr<const sphere_batch>& batch, int slice_size,
+                                                        scene_arena* arena = nullptr) {
+            // Slices start on multiples of the lane count, so the kernels never read into the next slice
+            slice_size = std::max(padding, (slice_size + padding - 1) / padding * padding);
+
+            const sphere_soa& all = batch->soa;
+            auto make_slice = [&](int begin) {
+                sphere_soa part;
+                part.center_x = all.center_x + begin;
+                part.center_y = all.center_y + begin;
+                part.center_z = all.center_z + begin;
+                part.radius = all.radius + begin;
+                part.material_id = all.material_id + begin;
+                part.count = std::min(slice_size, all.count - begin);
+
+                aabb bbox;
+                for (int i = 0; i < part.count; i++) {
+                    auto r = part.radius[i];
+                    point3 c(part.center_x[i], part.center_y[i], part.center_z[i]);
+                    bbox = aabb(bbox, aabb(c - vec3(r, r, r), c + vec3(r, r, r)));
+                }
+
+                sphere_batch slice(part, bbox, batch);      // The slice keeps `batch` alive
+                slice.level = batch->level;
+                slice.first_index = batch->first_index < 0 ? -1 : batch->first_index + begin;
+                return slice;
+            };
+
+            int count = (all.count + slice_size - 1) / slice_size;
+            std::vector<shared_ptr<hittable>> result;
+            result.reserve(size_t(count));
+            if (arena) {
+                sphere_batch* stored = arena->make_array<sphere_batch>(size_t(count),
+                                                                       [&](size_t k) { return make_slice(int(k) * slice_size); });
+                for (int k = 0; k < count; k++)
+                    result.push_back(scene_arena::handle<hittable>(stored + k));
+            } else {
+                for (int k = 0; k < count; k++)
+                    result.push_back(make_shared<sphere_batch>(make_slice(k * slice_size)));
+            }
+            return result;
+        }
+
+    private:
+        struct sphere_arrays {
+            std::vector<real> center_x, center_y, center_z, radius;
+            std::vector<uint32_t> material_id;
+        };
+
+        sphere_soa soa;                                 // What the kernels read: either `storage` or external memory
+        sphere_arrays storage;                          // Arrays owned by the batch itself
+        aabb bbox;
+        shared_ptr<const void> owner;                   // Keeps external arrays alive, null when `storage` is used
+
+        void set_size(int count) {
+            size_t padded = size_t((count + padding - 1) / padding * padding);
+
+            // Padding spheres sit at NaN, every comparison with NaN is false, so they never report a hit
+            auto nan = std::numeric_limits<real>::quiet_NaN();
+            storage.center_x.resize(padded, nan);
+            storage.center_y.resize(padded, nan);
+            storage.center_z.resize(padded, nan);
+            storage.radius.resize(padded, 0);
+            storage.material_id.resize(padded, 0);
+
+            soa.center_x = storage.center_x.data();
+            soa.center_y = storage.center_y.data();
+            soa.center_z = storage.center_z.data();
+            soa.radius = storage.radius.data();
+            soa.material_id = storage.material_id.data();
+            soa.count = count;
+        }
+
+        void make_owned() {                             // Copies external arrays into `storage` so they can grow
+            size_t padded = size_t((soa.count + padding - 1) / padding * padding);
+            storage.center_x.assign(soa.center_x, soa.center_x + padded);
+            storage.center_y.assign(soa.center_y, soa.center_y + padded);
+            storage.center_z.assign(soa.center_z, soa.center_z + padded);
+            storage.radius.assign(soa.radius, soa.radius + padded);
+            storage.material_id.assign(soa.material_id, soa.material_id + padded);
+            owner.reset();
+            set_size(soa.count);
+        }
+
+        bool closest_hit(const ray& r, const interval& ray_t, int& index, real& t) const {
+            switch (level) {
+#if SIMD_X86
+                case simd_level::avx2:
+                    return sphere_batch_avx2::closest_hit(soa, r, ray_t.min, ray_t.max, index, t);
+                case simd_level::sse2:
+                    return sphere_batch_sse2::closest_hit(soa, r, ray_t.min, ray_t.max, index, t);
+#endif
+                default:
+                    return closest_hit_scalar(r, ray_t, index, t);
+            }
+        }
+
+        bool closest_hit_scalar(const ray& r, const interval& ray_t, int& index, real& t) const {
+            const vec3& dir = r.direction();
+            const point3& orig = r.origin();
+            auto a = dir.length_squared();
+            auto closest = ray_t.max;
+            index = -1;
+
+            for (int i = 0; i < soa.count; i++) {
+                auto ocx = soa.center_x[i] - orig.x();
+                auto ocy = soa.center_y[i] - orig.y();
+                auto ocz = soa.center_z[i] - orig.z();
+                auto h = dir.x()*ocx + dir.y()*ocy + dir.z()*ocz;
+                auto c = (ocx*ocx + ocy*ocy + ocz*ocz) - soa.radius[i]*soa.radius[i];
+                auto discriminant = h*h - a*c;
+                if (discriminant < 0) continue;
+
+                auto sqrtd = std::sqrt(discriminant);
+                auto root = (h - sqrtd) / a;
+                if (!(ray_t.min < root && root < closest)) {
+                    root = (h + sqrtd) / a;
+                    if (!(ray_t.min < root && root < closest)) continue;
+                }
+                closest = root;
+                index = i;
+            }
+
+            t = closest;
+            return index >= 0;
+        }
+
+        void split_range(std::vector<int>& order, int begin, int end, int max_size,
+                         std::vector<std::pair<int, int>>& ranges) const {
+            if (end - begin <= max_size) {
+                ranges.emplace_back(begin, end);
+                return;
+            }
+
+            // Median split along the longest axis of the centers
+            aabb centers;
+            for (int k = begin; k < end; k++) {
+                point3 c(soa.center_x[order[k]], soa.center_y[order[k]], soa.center_z[order[k]]);
+                centers = aabb(centers, aabb(c, c));
+            }
+            const real* key = centers.longest_axis() == 0 ? soa.center_x
+                              : centers.longest_axis() == 1 ? soa.center_y : soa.center_z;
+            int mid = (begin + end) / 2;
+            std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+                             [&](int l, int r) { return key[l] < key[r]; });
+
+            split_range(order, begin, mid, max_size, ranges);
+            split_range(order, mid, end, max_size, ranges);
+        }
+};
+
+#endif
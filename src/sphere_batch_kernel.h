@@ -0,0 +1,58 @@
+// Closest-hit kernel of sphere_batch. This file has no include guard on purpose: sphere_batch.h includes it
+// once per instruction set, inside a namespace that defines `lanes` and the SPHERE_BATCH_TARGET attribute.
+
+SPHERE_BATCH_TARGET
+inline bool closest_hit(const sphere_soa& soa, const ray& r, real t_min, real t_max, int& index, real& t) {
+    const vec3& dir = r.direction();
+    const point3& orig = r.origin();
+
+    auto dx = lanes::set1(dir.x()), dy = lanes::set1(dir.y()), dz = lanes::set1(dir.z());
+    auto ox = lanes::set1(orig.x()), oy = lanes::set1(orig.y()), oz = lanes::set1(orig.z());
+    auto a = lanes::set1(dir.length_squared());
+    auto zero = lanes::set1(0.0);
+    auto lower = lanes::set1(t_min);
+
+    // Every lane keeps its own closest hit; the lanes are compared only once at the end
+    auto best_t = lanes::set1(t_max);
+    auto best_index = lanes::set1(-1.0);
+
+    for (int i = 0; i < soa.count; i += lanes::width) {
+        auto ocx = lanes::sub(lanes::load(&soa.center_x[i]), ox);
+        auto ocy = lanes::sub(lanes::load(&soa.center_y[i]), oy);
+        auto ocz = lanes::sub(lanes::load(&soa.center_z[i]), oz);
+        auto rad = lanes::load(&soa.radius[i]);
+
+        // Same quadratic as sphere::hit, for lanes::width spheres at once
+        auto h = lanes::add(lanes::add(lanes::mul(dx, ocx), lanes::mul(dy, ocy)), lanes::mul(dz, ocz));
+        auto c = lanes::sub(lanes::add(lanes::add(lanes::mul(ocx, ocx), lanes::mul(ocy, ocy)), lanes::mul(ocz, ocz)),
+                            lanes::mul(rad, rad));
+        auto discriminant = lanes::sub(lanes::mul(h, h), lanes::mul(a, c));
+        auto has_roots = lanes::less_equal(zero, discriminant);    // False for the NaN padding spheres too
+        if (!lanes::any(has_roots)) continue;
+
+        auto sqrtd = lanes::sqrt(discriminant);
+        auto near_root = lanes::div(lanes::sub(h, sqrtd), a);
+        auto far_root = lanes::div(lanes::add(h, sqrtd), a);
+
+        auto near_ok = lanes::logical_and(lanes::less(lower, near_root), lanes::less(near_root, best_t));
+        auto root = lanes::select(near_ok, near_root, far_root);
+        auto ok = lanes::logical_and(has_roots, lanes::logical_and(lanes::less(lower, root), lanes::less(root, best_t)));
+
+        best_t = lanes::select(ok, root, best_t);
+        best_index = lanes::select(ok, lanes::index(i), best_index);
+    }
+
+    real lane_t[lanes::width], lane_index[lanes::width];
+    lanes::store(lane_t, best_t);
+    lanes::store(lane_index, best_index);
+
+    index = -1;
+    t = t_max;
+    for (int k = 0; k < lanes::width; k++) {
+        if (lane_index[k] >= 0 && (lane_t[k] < t || (lane_t[k] == t && lane_index[k] < index))) {
+            t = lane_t[k];
+            index = int(lane_index[k]);
+        }
+    }
+    return index >= 0;
+}
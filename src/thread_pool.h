@@ -0,0 +1,133 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads that run "parallel for" jobs.
+// Every worker owns a queue of task indices. A worker takes work from the front of its own queue
+// and, once that runs dry, steals from the back of the other queues, so a few expensive tasks
+// (for example tiles full of glass spheres) never leave the other threads idle.
+class thread_pool {
+    public:
+        explicit thread_pool(int thread_count = 0) {
+            if (thread_count <= 0)
+                thread_count = int(std::thread::hardware_concurrency());
+            thread_count = std::max(thread_count, 1);
+
+            queues = std::vector<work_queue>(thread_count);
+            for (int id = 0; id < thread_count; id++)
+                workers.emplace_back([this, id] { worker_loop(id); });
+        }
+
+        ~thread_pool() {
+            {
+                std::lock_guard<std::mutex> lock(job_mutex);
+                stopping = true;
+            }
+            job_started.notify_all();
+            for (auto& worker : workers)
+                worker.join();
+        }
+
+        thread_pool(const thread_pool&) = delete;
+        thread_pool& operator=(const thread_pool&) = delete;
+
+        int size() const { return int(workers.size()); }
+
+        // Runs task(index, worker_id) for every index in [0, count) and returns once all of them are done.
+        // worker_id is in [0, size()) and can be used to pick per-thread scratch data.
+        void parallel_for(int count, const std::function<void(int, int)>& task) {
+            if (count <= 0) return;
+
+            std::unique_lock<std::mutex> lock(job_mutex);
+
+            // Hand out contiguous blocks so neighbouring tasks start on the same thread
+            int n = size();
+            for (int id = 0; id < n; id++) {
+                int begin = int(long(count) * id / n);
+                int end   = int(long(count) * (id + 1) / n);
+                std::lock_guard<std::mutex> queue_lock(queues[id].mutex);
+                for (int i = begin; i < end; i++)
+                    queues[id].items.push_back(i);
+            }
+
+            current_task = &task;
+            busy_workers = n;
+            generation++;
+            job_started.notify_all();
+
+            job_finished.wait(lock, [this] { return busy_workers == 0; });
+            current_task = nullptr;
+        }
+
+    private:
+        struct work_queue {
+            std::mutex mutex;
+            std::deque<int> items;
+        };
+
+        std::vector<std::thread> workers;
+        std::vector<work_queue> queues;
+
+        std::mutex job_mutex;
+        std::condition_variable job_started;
+        std::condition_variable job_finished;
+        const std::function<void(int, int)>* current_task = nullptr;
+        unsigned long generation = 0;   // Bumped for every parallel_for call so sleeping workers know a new job arrived
+        int busy_workers = 0;
+        bool stopping = false;
+
+        bool pop_own(int id, int& index) {
+            std::lock_guard<std::mutex> lock(queues[id].mutex);
+            if (queues[id].items.empty()) return false;
+            index = queues[id].items.front();
+            queues[id].items.pop_front();
+            return true;
+        }
+
+        bool steal(int thief, int& index) {
+            int n = size();
+            for (int k = 1; k < n; k++) {
+                auto& victim = queues[(thief + k) % n];
+                std::lock_guard<std::mutex> lock(victim.mutex);
+                if (!victim.items.empty()) {
+                    index = victim.items.back();    // Take from the opposite end than the owner
+                    victim.items.pop_back();
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void worker_loop(int id) {
+            unsigned long seen_generation = 0;
+
+            while (true) {
+                const std::function<void(int, int)>* task;
+                {
+                    std::unique_lock<std::mutex> lock(job_mutex);
+                    job_started.wait(lock, [&] { return stopping || generation != seen_generation; });
+                    if (stopping) return;
+                    seen_generation = generation;
+                    task = current_task;
+                }
+
+                // No new indices are added while a job runs, so once every queue is empty this worker is done
+                int index;
+                while (pop_own(id, index) || steal(id, index))
+                    (*task)(index, id);
+
+                std::lock_guard<std::mutex> lock(job_mutex);
+                if (--busy_workers == 0)
+                    job_finished.notify_one();
+            }
+        }
+};
+
+#endif
@@ -0,0 +1,453 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include "hittable.h"
+#include "render_stats.h"
+#include "simd_lanes.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <type_traits>
+#include <vector>
+
+// Vertex and index buffers of a triangle mesh. Triangles refer to their corners by index, so a vertex shared by
+// several triangles is stored once. Meshes hold the buffers through a shared_ptr, so they can share them too.
+struct mesh_buffers {
+    std::vector<point3> vertices;
+    std::vector<uint32_t> indices;      // Three per triangle, counterclockwise seen from the front
+
+    int triangle_count() const { return int(indices.size() / 3); }
+    size_t memory_bytes() const { return vertices.capacity() * sizeof(point3) + indices.capacity() * sizeof(uint32_t); }
+};
+
+// The corners of up to `width` triangles, one lane each, laid out for the SIMD kernels.
+// Unused lanes hold NaN vertices, which never report a hit.
+struct triangle_packet {
+    static constexpr int width = 32 / sizeof(real);     // Lanes in one AVX register
+
+    real v[3][3][width];                                // v[corner][axis][lane]
+};
+
+// A ray prepared for the watertight test: the axis where its direction is largest becomes z (kz), and the
+// shear (sx, sy, sz) maps the direction onto +z.
+struct sheared_ray {
+    int kx, ky, kz;
+    real sx, sy, sz;
+    real ox, oy, oz;    // Origin coordinates along kx, ky and kz
+
+    explicit sheared_ray(const ray& r) {
+        const vec3& d = r.direction();
+        kz = std::fabs(d.x()) > std::fabs(d.y()) ? (std::fabs(d.x()) > std::fabs(d.z()) ? 0 : 2)
+                                                 : (std::fabs(d.y()) > std::fabs(d.z()) ? 1 : 2);
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        if (d[kz] < 0) std::swap(kx, ky);   // Keeps the winding order of the sheared triangles
+        sx = d[kx] / d[kz];
+        sy = d[ky] / d[kz];
+        sz = 1 / d[kz];
+        ox = r.origin()[kx];
+        oy = r.origin()[ky];
+        oz = r.origin()[kz];
+    }
+};
+
+#if SIMD_X86
+// The kernel is compiled once per instruction set, like the sphere_batch kernel
+namespace triangle_mesh_sse2 {
+    using lanes = std::conditional<std::is_same<real, float>::value, sse2_float_lanes, sse2_lanes>::type;
+    #define TRIANGLE_MESH_TARGET
+    #include "triangle_mesh_kernel.h"
+    #undef TRIANGLE_MESH_TARGET
+}
+
+namespace triangle_mesh_avx2 {
+    using lanes = std::conditional<std::is_same<real, float>::value, avx2_float_lanes, avx2_lanes>::type;
+    #define TRIANGLE_MESH_TARGET __attribute__((target("avx2")))
+    #include "triangle_mesh_kernel.h"
+    #undef TRIANGLE_MESH_TARGET
+}
+#endif
+
+namespace triangle_mesh_scalar {
+    using lanes = scalar_lanes;
+    #define TRIANGLE_MESH_TARGET
+    #include "triangle_mesh_kernel.h"
+    #undef TRIANGLE_MESH_TARGET
+}
+
+// An indexed triangle mesh with one material and its own BVH.
+// The BVH is built with the binned SAH like bvh_node, but it is specialized for triangles and kept small:
+// a node is 32 bytes (float bounds, rounded outward), and a leaf is a run of the mesh's own copy of the
+// triangle indices, reordered so that every leaf is contiguous. Vertices stay in the shared buffers.
+// A leaf is gathered into triangle packets when a ray reaches it and the SIMD kernel tests them together.
+class triangle_mesh : public hittable {
+    public:
+        simd_level level = detect_simd_level();     // Can be lowered to compare the code paths
+
+        triangle_mesh(shared_ptr<const mesh_buffers> buffers, uint32_t mat)
+          : buffers(std::move(buffers)), mat(mat), tree(make_shared<mesh_tree>()) {
+            build();
+        }
+
+        // The same triangles and BVH as shape, stored once, with another material
+        triangle_mesh(const triangle_mesh& shape, uint32_t mat)
+          : level(shape.level), buffers(shape.buffers), mat(mat), tree(shape.tree), bbox(shape.bbox) {}
+
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            const auto& nodes = tree->nodes;
+            if (nodes.empty()) return false;
+
+            const point3& orig = r.origin();
+            const vec3& dir = r.direction();
+            vec3 inv_dir(1.0 / dir.x(), 1.0 / dir.y(), 1.0 / dir.z());
+
+            real t_entry;
+            if (!hit_box(nodes[0], orig, inv_dir, ray_t, t_entry))
+                return false;
+
+            sheared_ray sheared(r);
+            struct stack_entry { int node; real t_entry; };
+            stack_entry stack[max_depth + 1];
+            int stack_size = 0;
+            stack[stack_size++] = {0, t_entry};
+            int best = -1;
+
+            while (stack_size > 0) {
+                auto entry = stack[--stack_size];
+                if (entry.t_entry >= ray_t.max)
+                    continue;
+
+                int index = entry.node;
+                while (true) {
+                    const mesh_node& node = nodes[index];
+
+                    if (node.count > 0) {
+                        int found = hit_leaf(node, sheared, ray_t);
+                        if (found >= 0) best = found;
+                        break;
+                    }
+
+                    int left = index + 1;
+                    int right = int(node.offset);
+                    real t_left = 0, t_right = 0;
+                    bool hit_left = hit_box(nodes[left], orig, inv_dir, ray_t, t_left);
+                    bool hit_right = hit_box(nodes[right], orig, inv_dir, ray_t, t_right);
+
+                    if (hit_left && hit_right) {
+                        if (t_right < t_left) {
+                            std::swap(left, right);
+                            std::swap(t_left, t_right);
+                        }
+                        stack[stack_size++] = {right, t_right};
+                        index = left;
+                    } else if (hit_left) {
+                        index = left;
+                    } else if (hit_right) {
+                        index = right;
+                    } else {
+                        break;
+                    }
+                }
+            }
+
+            if (best < 0) return false;
+
+            const point3& v0 = vertex(best, 0);
+            const point3& v1 = vertex(best, 1);
+            const point3& v2 = vertex(best, 2);
+            vec3 outward_normal = unit_vector(cross(v1 - v0, v2 - v0));
+
+            rec.t = ray_t.max;
+            rec.p = r.at(rec.t);
+            rec.p = rec.p - dot(rec.p - v0, outward_normal) * outward_normal;  // Back onto the plane, like sphere::hit
+            rec.set_face_normal(r, outward_normal);
+            rec.p_error = hit_point_error(v0, (v1 - v0).length() + (v2 - v0).length());
+            rec.mat = mat;
+            rec.sphere = -1;
+            return true;
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        int triangle_count() const { return buffers->triangle_count(); }
+        int node_count() const { return int(tree->nodes.size()); }
+
+        const mesh_buffers& mesh() const { return *buffers; }
+
+        // Bytes used by the BVH and the reordered indices (the shared buffers not included)
+        size_t acceleration_bytes() const {
+            return tree->nodes.size() * sizeof(mesh_node) + tree->corners.size() * sizeof(uint32_t);
+        }
+
+    private:
+        struct mesh_node {
+            float lo[3], hi[3];     // Bounds, rounded outward to the next float
+            uint32_t offset;        // Leaf: its first triangle in `corners`. Interior node: index of its right child
+            uint32_t count;         // Number of triangles in a leaf, 0 for interior nodes
+        };
+        static_assert(sizeof(mesh_node) == 32, "two nodes per cache line");
+
+        struct mesh_tree {
+            std::vector<mesh_node> nodes;               // Depth-first: the left child follows its parent
+            std::vector<uint32_t> corners;              // Vertex indices of the triangles in leaf order, three each
+        };
+
+        struct build_item {
+            float lo[3], hi[3];
+            float centroid[3];
+            uint32_t triangle;
+        };
+
+        // Bounds of a set of build items and of their centroids
+        struct build_bounds {
+            static constexpr float inf = std::numeric_limits<float>::infinity();
+            float lo[3] = {inf, inf, inf}, hi[3] = {-inf, -inf, -inf};
+            float centroid_lo[3] = {inf, inf, inf}, centroid_hi[3] = {-inf, -inf, -inf};
+            int count = 0;
+
+            void add(const build_item& item) {
+                for (int axis = 0; axis < 3; axis++) {
+                    lo[axis] = std::min(lo[axis], item.lo[axis]);
+                    hi[axis] = std::max(hi[axis], item.hi[axis]);
+                    centroid_lo[axis] = std::min(centroid_lo[axis], item.centroid[axis]);
+                    centroid_hi[axis] = std::max(centroid_hi[axis], item.centroid[axis]);
+                }
+                count++;
+            }
+
+            void add(const build_bounds& other) {
+                for (int axis = 0; axis < 3; axis++) {
+                    lo[axis] = std::min(lo[axis], other.lo[axis]);
+                    hi[axis] = std::max(hi[axis], other.hi[axis]);
+                    centroid_lo[axis] = std::min(centroid_lo[axis], other.centroid_lo[axis]);
+                    centroid_hi[axis] = std::max(centroid_hi[axis], other.centroid_hi[axis]);
+                }
+                count += other.count;
+            }
+
+            double half_area() const {
+                double dx = hi[0] - lo[0], dy = hi[1] - lo[1], dz = hi[2] - lo[2];
+                return dx*dy + dy*dz + dz*dx;
+            }
+        };
+
+        static constexpr int bin_count = 12;
+        static constexpr int leaf_packets = 2;          // Packets gathered at a time; leaves are split down to this
+        static constexpr int max_depth = 64;            // Deeper subtrees become leaves, so the traversal stack cannot overflow
+        static constexpr double traversal_cost = 1.0;   // Relative to testing one packet
+
+        shared_ptr<const mesh_buffers> buffers;
+        uint32_t mat;
+        shared_ptr<mesh_tree> tree;                     // Shared by the copies of the mesh with other materials
+        aabb bbox;
+
+        const point3& vertex(int triangle, int corner) const {
+            return buffers->vertices[tree->corners[size_t(3 * triangle + corner)]];
+        }
+
+        // Tests the triangles of a leaf, leaf_packets packets at a time; returns the closest one that is nearer
+        // than ray_t.max (and moves ray_t.max to it), or -1
+        int hit_leaf(const mesh_node& node, const sheared_ray& r, interval& ray_t) const {
+            RENDER_STAT(thread_render_stats().count_tests(primitive_kind::triangle, node.count));
+            constexpr int chunk = leaf_packets * triangle_packet::width;
+            int best = -1;
+            int end = int(node.offset + node.count);
+            for (int first = int(node.offset); first < end; first += chunk) {
+                int count = std::min(chunk, end - first);
+                triangle_packet packets[leaf_packets];
+                int packet_count = (count + triangle_packet::width - 1) / triangle_packet::width;
+                for (int k = 0; k < packet_count * triangle_packet::width; k++) {
+                    triangle_packet& packet = packets[k / triangle_packet::width];
+                    int lane = k % triangle_packet::width;
+                    for (int corner = 0; corner < 3; corner++) {
+                        if (k < count) {
+                            const point3& v = vertex(first + k, corner);
+                            for (int axis = 0; axis < 3; axis++) packet.v[corner][axis][lane] = v[axis];
+                        } else {
+                            for (int axis = 0; axis < 3; axis++) packet.v[corner][axis][lane] = std::numeric_limits<real>::quiet_NaN();
+                        }
+                    }
+                }
+
+                real t = ray_t.max;
+                int lane;
+                if (closest_hit(packets, packet_count, r, ray_t.min, t, lane)) {
+                    ray_t.max = t;
+                    best = first + lane;
+                }
+            }
+            RENDER_STAT(if (best >= 0) thread_render_stats().count_hit(primitive_kind::triangle));
+            return best;
+        }
+
+        bool closest_hit(const triangle_packet* packets, int count, const sheared_ray& r, real t_min, real& t, int& lane) const {
+            switch (level) {
+#if SIMD_X86
+                case simd_level::avx2:
+                    return triangle_mesh_avx2::closest_hit(packets, count, r, t_min, t, lane);
+                case simd_level::sse2:
+                    return triangle_mesh_sse2::closest_hit(packets, count, r, t_min, t, lane);
+#endif
+                default:
+                    return triangle_mesh_scalar::closest_hit(packets, count, r, t_min, t, lane);
+            }
+        }
+
+        static bool hit_box(const mesh_node& node, const point3& orig, const vec3& inv_dir, const interval& ray_t, real& t_entry) {
+            real t_min = ray_t.min;
+            real t_max = ray_t.max;
+            RENDER_STAT(thread_render_stats().count_tests(primitive_kind::bvh_box));
+            for (int axis = 0; axis < 3; axis++) {
+                real t0 = (real(node.lo[axis]) - orig[axis]) * inv_dir[axis];
+                real t1 = (real(node.hi[axis]) - orig[axis]) * inv_dir[axis];
+                if (t0 > t1) std::swap(t0, t1);
+                t1 *= 1 + 4 * std::numeric_limits<real>::epsilon();    // Rounding must not miss a box a ray only grazes
+                t_min = t0 > t_min ? t0 : t_min;
+                t_max = t1 < t_max ? t1 : t_max;
+                if (t_max < t_min) return false;
+            }
+            t_entry = t_min;
+            RENDER_STAT(thread_render_stats().count_hit(primitive_kind::bvh_box));
+            return true;
+        }
+
+        static float round_down(real x) {
+            float f = float(x);
+            return real(f) > x ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+        }
+
+        static float round_up(real x) {
+            float f = float(x);
+            return real(f) < x ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+        }
+
+        static int packet_count(int triangles) { return (triangles + triangle_packet::width - 1) / triangle_packet::width; }
+
+        void build() {
+            const auto& vertices = buffers->vertices;
+            const auto& indices = buffers->indices;
+            int count = buffers->triangle_count();
+
+            std::vector<build_item> items(static_cast<size_t>(count));
+            for (int k = 0; k < count; k++) {
+                build_item& item = items[size_t(k)];
+                item.triangle = uint32_t(k);
+                for (int axis = 0; axis < 3; axis++) {
+                    real a = vertices[indices[3*k]][axis], b = vertices[indices[3*k+1]][axis], c = vertices[indices[3*k+2]][axis];
+                    item.lo[axis] = round_down(std::fmin(a, std::fmin(b, c)));
+                    item.hi[axis] = round_up(std::fmax(a, std::fmax(b, c)));
+                    item.centroid[axis] = 0.5f * (item.lo[axis] + item.hi[axis]);
+                }
+            }
+
+            tree->nodes.reserve(size_t(2 * packet_count(count)));
+            tree->corners.reserve(indices.size());
+            if (count > 0) {
+                build_bounds bounds;
+                for (const auto& item : items) bounds.add(item);
+                build_node(items, 0, count, 0, bounds);
+                bbox = aabb(point3(tree->nodes[0].lo[0], tree->nodes[0].lo[1], tree->nodes[0].lo[2]),
+                            point3(tree->nodes[0].hi[0], tree->nodes[0].hi[1], tree->nodes[0].hi[2]));
+            }
+            tree->nodes.shrink_to_fit();
+        }
+
+        int make_leaf(const std::vector<build_item>& items, int begin, int end, int node_index) {
+            const auto& indices = buffers->indices;
+            tree->nodes[size_t(node_index)].offset = uint32_t(tree->corners.size() / 3);
+            tree->nodes[size_t(node_index)].count = uint32_t(end - begin);
+            for (int i = begin; i < end; i++) {
+                uint32_t triangle = items[size_t(i)].triangle;
+                tree->corners.insert(tree->corners.end(), &indices[3*triangle], &indices[3*triangle] + 3);
+            }
+            return node_index;
+        }
+
+        // Builds the subtree over items[begin, end), whose bounds are given, and returns the index of its root node
+        int build_node(std::vector<build_item>& items, int begin, int end, int depth, const build_bounds& bounds) {
+            int node_index = int(tree->nodes.size());
+            tree->nodes.push_back(mesh_node());
+            std::copy(bounds.lo, bounds.lo + 3, tree->nodes[size_t(node_index)].lo);
+            std::copy(bounds.hi, bounds.hi + 3, tree->nodes[size_t(node_index)].hi);
+
+            int count = end - begin;
+            if (count <= 1 || depth >= max_depth - 1)
+                return make_leaf(items, begin, end, node_index);
+
+            // Bins on all three axes, filled in one pass over the triangles
+            build_bounds bins[3][bin_count];
+            float scale[3];
+            for (int axis = 0; axis < 3; axis++) {
+                float extent = bounds.centroid_hi[axis] - bounds.centroid_lo[axis];
+                scale[axis] = extent > 0 ? bin_count / extent : 0;
+            }
+            auto bin_of = [&](const build_item& item, int axis) {
+                return std::min(bin_count - 1, int((item.centroid[axis] - bounds.centroid_lo[axis]) * scale[axis]));
+            };
+            for (int i = begin; i < end; i++) {
+                const build_item& item = items[size_t(i)];
+                for (int axis = 0; axis < 3; axis++)
+                    bins[axis][bin_of(item, axis)].add(item);
+            }
+
+            // Cheapest split plane. The cost of a side is its area times the packets it takes.
+            double best_cost = std::numeric_limits<double>::infinity();
+            int best_axis = -1, best_split = 0;
+            build_bounds best_left, best_right;
+            for (int axis = 0; axis < 3; axis++) {
+                if (scale[axis] == 0) continue;
+
+                build_bounds right[bin_count];          // right[b]: bins b and up
+                for (int b = bin_count - 1; b > 0; b--) {
+                    right[b] = bins[axis][b];
+                    if (b + 1 < bin_count) right[b].add(right[b+1]);
+                }
+
+                build_bounds left;
+                for (int b = 0; b < bin_count - 1; b++) {
+                    left.add(bins[axis][b]);
+                    if (left.count == 0 || right[b+1].count == 0) continue;
+
+                    double cost = left.half_area() * packet_count(left.count) + right[b+1].half_area() * packet_count(right[b+1].count);
+                    if (cost < best_cost) {
+                        best_cost = cost;
+                        best_axis = axis;
+                        best_split = b;
+                        best_left = left;
+                        best_right = right[b+1];
+                    }
+                }
+            }
+
+            int packets_here = packet_count(count);
+            int mid;
+            if (best_axis >= 0) {
+                double parent_area = bounds.half_area();
+                double split_cost = traversal_cost + (parent_area > 0 ? best_cost / parent_area : best_cost);
+                if (packets_here <= leaf_packets && split_cost >= packets_here)
+                    return make_leaf(items, begin, end, node_index);
+
+                auto middle = std::partition(items.begin() + begin, items.begin() + end,
+                                             [&](const build_item& item) { return bin_of(item, best_axis) <= best_split; });
+                mid = int(middle - items.begin());
+            } else {
+                // All centroids in one point: no plane separates them, so halve the range to keep leaves small
+                if (packets_here <= leaf_packets)
+                    return make_leaf(items, begin, end, node_index);
+                mid = begin + count / 2;
+                best_left = best_right = build_bounds();
+                for (int i = begin; i < mid; i++) best_left.add(items[size_t(i)]);
+                for (int i = mid; i < end; i++) best_right.add(items[size_t(i)]);
+            }
+
+            build_node(items, begin, mid, depth + 1, best_left);
+            tree->nodes[size_t(node_index)].offset = uint32_t(build_node(items, mid, end, depth + 1, best_right));
+            tree->nodes[size_t(node_index)].count = 0;
+            return node_index;
+        }
+};
+
+#endif
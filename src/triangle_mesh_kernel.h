@@ -0,0 +1,72 @@
+// Closest-hit kernel of triangle_mesh. This file has no include guard on purpose: triangle_mesh.h includes it
+// once per instruction set, inside a namespace that defines `lanes` and the TRIANGLE_MESH_TARGET attribute.
+//
+// Watertight ray-triangle test (Woop, Benthin and Wald, "Watertight Ray/Triangle Intersection", JCGT 2013):
+// the vertices are moved into a space where the ray runs along +z from the origin, and the signed areas
+// U, V, W of the edges seen from the ray decide the hit. An edge shared by two triangles gives the same area
+// with opposite signs in both, so a ray through an edge or a vertex always hits at least one of them.
+
+TRIANGLE_MESH_TARGET
+inline bool closest_hit(const triangle_packet* packets, int count, const sheared_ray& r, real t_min, real& t, int& index) {
+    auto sx = lanes::set1(r.sx), sy = lanes::set1(r.sy), sz = lanes::set1(r.sz);
+    auto ox = lanes::set1(r.ox), oy = lanes::set1(r.oy), oz = lanes::set1(r.oz);
+    auto zero = lanes::set1(0.0);
+    auto lower = lanes::set1(t_min);
+
+    auto best_t = lanes::set1(t);
+    auto best_index = lanes::set1(-1.0);
+
+    for (int p = 0; p < count; p++) {
+        const triangle_packet& packet = packets[p];
+        for (int lane = 0; lane < triangle_packet::width; lane += lanes::width) {
+            // Vertices relative to the ray origin, then sheared so that the ray direction becomes +z
+            auto az = lanes::sub(lanes::load(&packet.v[0][r.kz][lane]), oz);
+            auto bz = lanes::sub(lanes::load(&packet.v[1][r.kz][lane]), oz);
+            auto cz = lanes::sub(lanes::load(&packet.v[2][r.kz][lane]), oz);
+            auto ax = lanes::sub(lanes::sub(lanes::load(&packet.v[0][r.kx][lane]), ox), lanes::mul(sx, az));
+            auto ay = lanes::sub(lanes::sub(lanes::load(&packet.v[0][r.ky][lane]), oy), lanes::mul(sy, az));
+            auto bx = lanes::sub(lanes::sub(lanes::load(&packet.v[1][r.kx][lane]), ox), lanes::mul(sx, bz));
+            auto by = lanes::sub(lanes::sub(lanes::load(&packet.v[1][r.ky][lane]), oy), lanes::mul(sy, bz));
+            auto cx = lanes::sub(lanes::sub(lanes::load(&packet.v[2][r.kx][lane]), ox), lanes::mul(sx, cz));
+            auto cy = lanes::sub(lanes::sub(lanes::load(&packet.v[2][r.ky][lane]), oy), lanes::mul(sy, cz));
+
+            auto u = lanes::sub(lanes::mul(cx, by), lanes::mul(cy, bx));
+            auto v = lanes::sub(lanes::mul(ax, cy), lanes::mul(ay, cx));
+            auto w = lanes::sub(lanes::mul(bx, ay), lanes::mul(by, ax));
+
+            // Inside when all three areas have the same sign (either side: triangles are two-sided).
+            // False for the NaN padding triangles, like every comparison with NaN.
+            auto all_positive = lanes::logical_and(lanes::less_equal(zero, u),
+                                lanes::logical_and(lanes::less_equal(zero, v), lanes::less_equal(zero, w)));
+            auto all_negative = lanes::logical_and(lanes::less_equal(u, zero),
+                                lanes::logical_and(lanes::less_equal(v, zero), lanes::less_equal(w, zero)));
+            auto inside = lanes::logical_or(all_positive, all_negative);
+            if (!lanes::any(inside)) continue;
+
+            auto det = lanes::add(lanes::add(u, v), w);
+            auto nonzero = lanes::logical_or(lanes::less(zero, det), lanes::less(det, zero));
+            auto scaled_t = lanes::add(lanes::add(lanes::mul(u, lanes::mul(sz, az)), lanes::mul(v, lanes::mul(sz, bz))),
+                                       lanes::mul(w, lanes::mul(sz, cz)));
+            auto hit_t = lanes::div(scaled_t, det);
+
+            auto ok = lanes::logical_and(lanes::logical_and(inside, nonzero),
+                                         lanes::logical_and(lanes::less(lower, hit_t), lanes::less(hit_t, best_t)));
+            best_t = lanes::select(ok, hit_t, best_t);
+            best_index = lanes::select(ok, lanes::index(p * triangle_packet::width + lane), best_index);
+        }
+    }
+
+    real lane_t[lanes::width], lane_index[lanes::width];
+    lanes::store(lane_t, best_t);
+    lanes::store(lane_index, best_index);
+
+    bool found = false;
+    for (int k = 0; k < lanes::width; k++) {
+        if (lane_index[k] >= 0 && (!found || lane_t[k] < t || (lane_t[k] == t && int(lane_index[k]) < index))) {
+            t = lane_t[k];
+            index = int(lane_index[k]);
+            found = true;
+        }
+    }
+    return found;
+}
@@ -1,6 +1,8 @@
 #ifndef VEC3_H
 #define VEC3_H
 
+#include "precision.h"
+
 #include <cmath>
 #include <iostream>
 using namespace std;
@@ -9,19 +11,19 @@ using namespace std;
 class vec3 {
 
     public:
-        double e[3];
+        real e[3];
 
         vec3(): e{0,0,0} {}                                         // #1: Default constructor
-        vec3(double e0, double e1, double e2) : e{e0, e1, e2} {}    // #2: Parameterized constructor
+        vec3(real e0, real e1, real e2) : e{e0, e1, e2} {}          // #2: Parameterized constructor
 
-        double x() const { return e[0]; }   // Getter function
-        double y() const { return e[1]; }
-        double z() const { return e[2]; }
+        real x() const { return e[0]; }     // Getter function
+        real y() const { return e[1]; }
+        real z() const { return e[2]; }
 
         vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }    // Overloading "-": if written -vec3, all members become negative. Would cause an error otherwise
 
-        double operator[](int i) const { return e[i]; } // "Array-like" behaviour
-        double& operator[](int i) { return e[i]; }
+        real operator[](int i) const { return e[i]; }   // "Array-like" behaviour
+        real& operator[](int i) { return e[i]; }
 
         // "this" - refers to the object that was called with the mentioned operator
         
@@ -31,29 +33,29 @@ class vec3 {
             e[2] += v.e[2];
             return *this;
         } 
-        vec3& operator*=(double t) {        // "Vector-like" behaviour: scalar multiplication
+        vec3& operator*=(real t) {          // "Vector-like" behaviour: scalar multiplication
             e[0] *= t;
             e[1] *= t;
             e[2] *= t;
             return *this;
         }
-        vec3& operator/=(double t) {        // "Vector-like" behaviour: scalar division
+        vec3& operator/=(real t) {          // "Vector-like" behaviour: scalar division
             return *this *= 1/t;
         }
-        double length() const {             // "Vector-like" behaviour: length 
+        real length() const {               // "Vector-like" behaviour: length 
             return sqrt(length_squared());
         }
-        double length_squared() const {     // Helper function for getting the length
+        real length_squared() const {       // Helper function for getting the length
             return e[0]*e[0] + e[1]*e[1] + e[2]*e[2];   
         }
         static vec3 random() {
             return vec3(random_double(), random_double(), random_double());
         }
-        static vec3 random(double min, double max) {
+        static vec3 random(real min, real max) {
             return vec3(random_double(min, max), random_double(min, max), random_double(min, max));
         }
         bool near_zero() const {             // Returns true if the vector is close to zero in all dimensions
-            auto s = 1e-8;
+            auto s = near_zero_epsilon;
             return (std::abs(e[0]) < s) && (std::abs(e[1]) < s) && (std::abs(e[2]) < s);
         }
 
@@ -77,19 +79,19 @@ inline vec3 operator*(const vec3& u, const vec3& v) {           // Multiplicatio
     return vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
 }
 
-inline vec3 operator*(double t, const vec3& v) {                // Scaling
+inline vec3 operator*(real t, const vec3& v) {                  // Scaling
     return vec3(t*v.e[0], t*v.e[1], t*v.e[2]);
 }
 
-inline vec3 operator*(const vec3& v, double t) {                // Scaling (different order)
+inline vec3 operator*(const vec3& v, real t) {                  // Scaling (different order)
     return t * v;
 }
 
-inline vec3 operator/(const vec3& v, double t) {                // Scaling by fraction
+inline vec3 operator/(const vec3& v, real t) {                  // Scaling by fraction
     return (1/t) * v;
 }
 
-inline double dot(const vec3& u, const vec3& v) {               // Dot product of 2 vectors
+inline real dot(const vec3& u, const vec3& v) {                 // Dot product of 2 vectors
     return u.e[0] * v.e[0]
          + u.e[1] * v.e[1]
          + u.e[2] * v.e[2];
@@ -105,13 +107,32 @@ inline vec3 unit_vector(const vec3& v) {                        // Vector normal
     return v / v.length();
 }
 
+// Warps from the unit square: each turns one pair of numbers in [0,1) into a uniformly distributed point,
+// without rejection, so stratified and low-discrepancy pairs stay well spread after the warp
+inline vec3 sphere_from_square(double u, double v) {           // Point on the unit sphere (Archimedes: z is uniform)
+    auto z = 1 - 2*u;
+    auto r = std::sqrt(std::fmax(0.0, 1 - z*z));
+    auto phi = 2*pi*v;
+    return vec3(r*std::cos(phi), r*std::sin(phi), z);
+}
+
+inline vec3 disk_from_square(double u, double v) {             // Point in the unit disk (Shirley-Chiu concentric map)
+    auto a = 2*u - 1;
+    auto b = 2*v - 1;
+    if (a == 0 && b == 0) return vec3(0,0,0);
+    double r, phi;
+    if (std::fabs(a) > std::fabs(b)) {                         // Squares map to circles, so neighbours stay neighbours
+        r = a;
+        phi = (pi/4) * (b/a);
+    } else {
+        r = b;
+        phi = (pi/2) - (pi/4) * (a/b);
+    }
+    return vec3(r*std::cos(phi), r*std::sin(phi), 0);
+}
+
 inline vec3 random_unit_vector() {
-    while (true) {
-        auto p = vec3::random(-1,1);                            // Generates a random vector
-        auto lensq = p.length_squared();                        // Calculates how far the point is from the origin
-        if (1e-160 < lensq && lensq <= 1)                       // Keeps only the points inside the sphere that are not too close to the center
-            return p / sqrt(lensq);                             // Returns a unit vector
-    }                                                           
+    return sphere_from_square(random_double(), random_double());
 }
 
 inline vec3 random_on_hemisphere(const vec3& normal) {
@@ -127,24 +148,20 @@ inline vec3 reflect(const vec3& v, const vec3& n) {
 }
 
 inline vec3 refract(const vec3& uv, const vec3& n, 
-                    double etai_over_etat) {                     // uv - incoming ray direction (unit len), n - unit surface normal, etai_over_etat - indices fro Snell's Law
+                    real etai_over_etat) {                       // uv - incoming ray direction (unit len), n - unit surface normal, etai_over_etat - indices fro Snell's Law
     
-    auto cos_theta = std::fmin(dot(-uv, n), 1.0);                // Calculates cos from 𝐚*𝐛=|𝐚||𝐛|cos𝜃, when a and b - unit vectors
+    auto cos_theta = std::fmin(dot(-uv, n), real(1));           // Calculates cos from 𝐚*𝐛=|𝐚||𝐛|cos𝜃, when a and b - unit vectors
 
     vec3 r_out_perp =  etai_over_etat * (uv + cos_theta*n);      // Computes tangent to normal part of the refracted ray (formula from Snell's Law)
 
     vec3 r_out_parallel = 
-    -std::sqrt(std::fabs(1.0 - r_out_perp.length_squared())) * n; // Computes part parallel to n (from Pythagorean theorem)
+    -std::sqrt(std::fabs(1 - r_out_perp.length_squared())) * n; // Computes part parallel to n (from Pythagorean theorem)
 
     return r_out_perp + r_out_parallel;                           // Returns the final ray direction
 }
 
 inline vec3 random_in_unit_disk() {                               // Simulates a circular lens in a camera
-    while (true) {
-        auto p = vec3(random_double(-1,1), random_double(-1,1), 0);
-        if (p.length_squared() < 1)                               // Checks if the randomly chosen point is in the unit circle
-            return p;                                             // Based on rejection sampling
-    }
+    return disk_from_square(random_double(), random_double());
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,328 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "hittable.h"
+#include "lights.h"
+#include "material.h"
+#include "render_stats.h"
+
+#include <cstdint>
+#include <vector>
+
+// State of a batch of paths, one array per field (structure of arrays).
+// Every stage of the wavefront integrator walks these arrays from front to back.
+struct path_buffer {
+    // Current ray of every live path
+    std::vector<real> origin_x, origin_y, origin_z;
+    std::vector<real> dir_x, dir_y, dir_z;
+
+    // Product of the attenuations along the path so far
+    std::vector<real> throughput_r, throughput_g, throughput_b;
+    std::vector<real> scatter_pdf;  // Density of the current ray's direction, for the MIS weight of a light it hits
+
+    std::vector<pcg32> rng;         // Each path carries its own generator, so its random numbers do not depend on batch order
+    std::vector<sample_state> sample;   // ...and its place in its sample's dimensions, for samplers that compute them
+    std::vector<int> slot;          // Where the finished path stores its color in `radiance`
+
+    // Filled by the intersect stage
+    std::vector<uint8_t> hit;
+    std::vector<real> hit_t, hit_error;
+    std::vector<real> hit_px, hit_py, hit_pz;
+    std::vector<real> hit_nx, hit_ny, hit_nz;
+    std::vector<uint8_t> hit_front_face;
+    std::vector<uint32_t> hit_mat;
+    std::vector<int32_t> hit_sphere;
+
+    std::vector<color> radiance;    // Final color of every path, indexed by slot
+
+    int size() const { return int(slot.size()); }
+
+    void clear() {
+        for (auto* v : {&origin_x, &origin_y, &origin_z, &dir_x, &dir_y, &dir_z,
+                        &throughput_r, &throughput_g, &throughput_b, &scatter_pdf})
+            v->clear();
+        rng.clear();
+        sample.clear();
+        slot.clear();
+        radiance.clear();
+    }
+
+    // Starts a new path along ray r; rng_state and sample_state are those right after the camera ray was made
+    void push(const ray& r, const pcg32& rng_state, const sample_state& sample_state) {
+        origin_x.push_back(r.origin().x());
+        origin_y.push_back(r.origin().y());
+        origin_z.push_back(r.origin().z());
+        dir_x.push_back(r.direction().x());
+        dir_y.push_back(r.direction().y());
+        dir_z.push_back(r.direction().z());
+        throughput_r.push_back(1);
+        throughput_g.push_back(1);
+        throughput_b.push_back(1);
+        scatter_pdf.push_back(0);
+        rng.push_back(rng_state);
+        sample.push_back(sample_state);
+        slot.push_back(int(radiance.size()));
+        radiance.push_back(color(0,0,0));
+    }
+
+    ray path_ray(int k) const {
+        return ray(point3(origin_x[k], origin_y[k], origin_z[k]), vec3(dir_x[k], dir_y[k], dir_z[k]));
+    }
+
+    void set_ray(int k, const ray& r) {
+        origin_x[k] = r.origin().x();  origin_y[k] = r.origin().y();  origin_z[k] = r.origin().z();
+        dir_x[k] = r.direction().x();  dir_y[k] = r.direction().y();  dir_z[k] = r.direction().z();
+    }
+
+    color throughput(int k) const { return color(throughput_r[k], throughput_g[k], throughput_b[k]); }
+
+    void set_throughput(int k, const color& c) {
+        throughput_r[k] = c.x();  throughput_g[k] = c.y();  throughput_b[k] = c.z();
+    }
+
+    // Moves the live state of path `from` into position `to` (used to compact the buffer)
+    void move(int from, int to) {
+        origin_x[to] = origin_x[from];  origin_y[to] = origin_y[from];  origin_z[to] = origin_z[from];
+        dir_x[to] = dir_x[from];  dir_y[to] = dir_y[from];  dir_z[to] = dir_z[from];
+        throughput_r[to] = throughput_r[from];  throughput_g[to] = throughput_g[from];  throughput_b[to] = throughput_b[from];
+        scatter_pdf[to] = scatter_pdf[from];
+        rng[to] = rng[from];
+        sample[to] = sample[from];
+        slot[to] = slot[from];
+    }
+
+    // Puts path order[k] at position k, for every live path. The old arrays are left in spare for the next call.
+    void permute(const std::vector<int>& order, path_buffer& spare) {
+        auto apply = [&](auto& values, auto& old) {
+            old.swap(values);
+            values.resize(old.size());
+            for (size_t k = 0; k < order.size(); k++) values[k] = old[order[k]];
+        };
+        apply(origin_x, spare.origin_x);  apply(origin_y, spare.origin_y);  apply(origin_z, spare.origin_z);
+        apply(dir_x, spare.dir_x);  apply(dir_y, spare.dir_y);  apply(dir_z, spare.dir_z);
+        apply(throughput_r, spare.throughput_r);  apply(throughput_g, spare.throughput_g);  apply(throughput_b, spare.throughput_b);
+        apply(scatter_pdf, spare.scatter_pdf);
+        apply(rng, spare.rng);
+        apply(sample, spare.sample);
+        apply(slot, spare.slot);
+    }
+
+    void resize_live(int n) {
+        for (auto* v : {&origin_x, &origin_y, &origin_z, &dir_x, &dir_y, &dir_z,
+                        &throughput_r, &throughput_g, &throughput_b, &scatter_pdf})
+            v->resize(n);
+        rng.resize(n);
+        sample.resize(n);
+        slot.resize(n);
+    }
+
+    void resize_hits(int n) {
+        hit.resize(n);
+        hit_t.resize(n);
+        hit_error.resize(n);
+        for (auto* v : {&hit_px, &hit_py, &hit_pz, &hit_nx, &hit_ny, &hit_nz})
+            v->resize(n);
+        hit_front_face.resize(n);
+        hit_mat.resize(n);
+        hit_sphere.resize(n);
+    }
+};
+
+// Russian roulette: ends a path with probability 1 - survival, where survival is the largest channel of its
+// throughput, and scales the throughput of the survivors by 1 / survival, so the expected color stays the same.
+// Returns false if the path ends. A path at full throughput (clear glass) always survives and draws no number.
+inline bool survives_roulette(color& throughput) {
+    real survival = std::fmax(throughput.x(), std::fmax(throughput.y(), throughput.z()));
+    if (survival >= 1) return true;
+    if (sample_1d() >= survival) return false;
+    throughput /= survival;
+    return true;
+}
+
+// Breadth-first path tracer. Instead of following one path to the end before starting the next, it advances
+// a whole batch of paths one bounce at a time, stage by stage:
+//   intersect all -> finish the misses -> scatter all hits grouped by material type -> compact the survivors
+// Lights are sampled in the scatter stage, with the shadow ray traced right there. With sort_rays, the rays of
+// every bounce after the first are sorted by where they start and which way they go before they are intersected.
+// Paths use the same random numbers as camera::ray_color would, so the images match the recursive integrator.
+class wavefront_integrator {
+    public:
+        // With lights (not null, not empty), every non-specular hit also samples one of them, like camera::ray_color
+        wavefront_integrator(const hittable& world, const material_table& materials, const light_list* lights,
+                             int max_depth, int roulette_depth)
+          : world(world), materials(materials), lights(lights && !lights->empty() ? lights : nullptr),
+            max_depth(max_depth), roulette_depth(roulette_depth) {}
+
+        // Scattered rays leave in all directions, so in batch order consecutive rays visit unrelated parts of the
+        // BVH. Sorted along a Morton curve of their origins and then by direction octant, rays next to each other
+        // start close together and go the same way, and mostly walk the same nodes and test the same primitives
+        // while those are still in the cache. Sorting only changes the order; the image stays the same.
+        bool sort_rays = false;
+
+        // Traces every path in the buffer to its end and stores its color in paths.radiance
+        template <class Background>
+        void trace(path_buffer& paths, Background&& background) {
+            for (int depth = 0; depth < max_depth && paths.size() > 0; depth++) {
+                if (sort_rays && depth > 0)     // Camera rays are coherent already
+                    sort(paths);
+                intersect(paths, depth);
+                shade(paths, background, depth);
+                compact(paths);
+            }
+            // Paths still alive after max_depth bounces gather no more light; they keep the radiance they have
+            RENDER_STAT(thread_render_stats().count_path_end(max_depth, path_end::max_depth, paths.size()));
+            paths.resize_live(0);
+        }
+
+    private:
+        const hittable& world;
+        const material_table& materials;
+        const light_list* lights;       // Null if there are none to sample
+        int max_depth;
+        int roulette_depth;             // Bounces after which survives_roulette decides whether a path goes on
+
+        std::vector<int> order;         // Hit paths sorted by material type; in sort, paths in ray order
+        std::vector<uint8_t> alive;     // Whether each path continues after the current bounce
+        std::vector<uint32_t> ray_keys, spare_keys;         // Sort key of every ray, for sort
+        std::vector<int> spare_order;
+        path_buffer spare;              // Arrays permute reuses
+
+        void sort(path_buffer& paths) {
+            int n = paths.size();
+            aabb origins;
+            for (int k = 0; k < n; k++) {
+                point3 origin(paths.origin_x[k], paths.origin_y[k], paths.origin_z[k]);
+                origins = aabb(origins, aabb(origin, origin));
+            }
+
+            // Key: the origin's Morton code (without its finest bit), then the direction's octant in the low 3 bits
+            ray_keys.resize(n);
+            order.resize(n);
+            for (int k = 0; k < n; k++) {
+                uint32_t octant = (paths.dir_x[k] < 0) | (paths.dir_y[k] < 0) << 1 | (paths.dir_z[k] < 0) << 2;
+                point3 origin(paths.origin_x[k], paths.origin_y[k], paths.origin_z[k]);
+                ray_keys[k] = (morton_code(origin, origins) >> 1) << 3 | octant;
+                order[k] = k;
+            }
+
+            // Radix sort, 11 bits per pass: three linear passes instead of a comparison sort
+            spare_keys.resize(n);
+            spare_order.resize(n);
+            for (int shift = 0; shift < 32; shift += 11) {
+                int start[2048 + 1] = {};
+                for (int k = 0; k < n; k++)
+                    start[((ray_keys[k] >> shift) & 2047) + 1]++;
+                for (int digit = 0; digit < 2048; digit++)
+                    start[digit + 1] += start[digit];
+                for (int k = 0; k < n; k++) {
+                    int to = start[(ray_keys[k] >> shift) & 2047]++;
+                    spare_keys[to] = ray_keys[k];
+                    spare_order[to] = order[k];
+                }
+                ray_keys.swap(spare_keys);
+                order.swap(spare_order);
+            }
+            paths.permute(order, spare);
+        }
+
+        void intersect(path_buffer& paths, int depth) {
+            int n = paths.size();
+            paths.resize_hits(n);
+            RENDER_STAT(thread_render_stats().count_rays(depth == 0, n));
+
+            hit_record rec;
+            for (int k = 0; k < n; k++) {
+                paths.hit[k] = world.hit(paths.path_ray(k), interval(ray_t_min, infinity), rec);
+                if (!paths.hit[k]) continue;
+
+                paths.hit_t[k] = rec.t;
+                paths.hit_error[k] = rec.p_error;
+                paths.hit_px[k] = rec.p.x();  paths.hit_py[k] = rec.p.y();  paths.hit_pz[k] = rec.p.z();
+                paths.hit_nx[k] = rec.normal.x();  paths.hit_ny[k] = rec.normal.y();  paths.hit_nz[k] = rec.normal.z();
+                paths.hit_front_face[k] = rec.front_face;
+                paths.hit_mat[k] = rec.mat;
+                paths.hit_sphere[k] = rec.sphere;
+            }
+        }
+
+        template <class Background>
+        void shade(path_buffer& paths, Background&& background, int depth) {
+            int n = paths.size();
+            alive.assign(n, 0);
+            sampler* path_sampler = sampler::active();     // The one that started the paths, if any
+
+            // Counting sort of the hits by material type, so each type is scattered in one coherent run
+            constexpr int kinds = material_kinds;
+            int start[kinds + 1] = {};
+            for (int k = 0; k < n; k++) {
+                if (paths.hit[k])
+                    start[int(kind(materials[paths.hit_mat[k]])) + 1]++;
+                else    // Missed paths are finished right away: they see the background
+                    paths.radiance[paths.slot[k]] += paths.throughput(k) * background(paths.path_ray(k));
+            }
+            for (int kind = 0; kind < kinds; kind++)
+                start[kind + 1] += start[kind];
+            RENDER_STAT(thread_render_stats().count_path_end(depth, path_end::escaped, n - start[kinds]));
+
+            order.resize(start[kinds]);
+            for (int k = 0; k < n; k++)
+                if (paths.hit[k])
+                    order[start[int(kind(materials[paths.hit_mat[k]]))]++] = k;
+
+            hit_record rec;
+            for (int k : order) {
+                rec.t = paths.hit_t[k];
+                rec.p_error = paths.hit_error[k];
+                rec.p = point3(paths.hit_px[k], paths.hit_py[k], paths.hit_pz[k]);
+                rec.normal = vec3(paths.hit_nx[k], paths.hit_ny[k], paths.hit_nz[k]);
+                rec.front_face = paths.hit_front_face[k];
+                rec.mat = paths.hit_mat[k];
+                rec.sphere = paths.hit_sphere[k];
+
+                thread_rng() = paths.rng[k];    // Continue this path's own random sequence
+                if (path_sampler) path_sampler->resume(paths.sample[k]);
+                const material& mat = materials[rec.mat];
+                ray r = paths.path_ray(k);
+                color& radiance = paths.radiance[paths.slot[k]];
+                color emission = emitted(mat, rec);
+                if (emission.length_squared() > 0)
+                    radiance += paths.throughput(k) * emission * (lights ? emission_weight(*lights, r, rec, paths.scatter_pdf[k]) : 1);
+                if (lights && !is_specular(mat))
+                    radiance += paths.throughput(k) * sample_direct_light(world, materials, *lights, mat, r, rec);
+
+                ray scattered;
+                color attenuation;
+                bool scattering = scatter(mat, r, rec, attenuation, scattered);
+                RENDER_STAT(thread_render_stats().count_scatter(mat, scattering));
+                if (scattering) {
+                    if (lights) paths.scatter_pdf[k] = scatter_pdf(mat, r, rec, scattered.direction());
+                    color throughput = paths.throughput(k) * attenuation;
+                    int bounces = depth + 1;
+                    if (bounces >= max_depth || bounces < roulette_depth || survives_roulette(throughput)) {
+                        paths.set_ray(k, scattered);
+                        paths.set_throughput(k, throughput);
+                        alive[k] = 1;
+                    } else {
+                        RENDER_STAT(thread_render_stats().count_path_end(bounces, path_end::roulette));
+                    }
+                } else {
+                    RENDER_STAT(thread_render_stats().count_path_end(depth, path_end::absorbed));
+                }
+                paths.rng[k] = thread_rng();
+                if (path_sampler) paths.sample[k] = path_sampler->state();
+            }
+        }
+
+        void compact(path_buffer& paths) {
+            int n = paths.size();
+            int live = 0;
+            for (int k = 0; k < n; k++) {
+                if (!alive[k]) continue;
+                if (k != live) paths.move(k, live);
+                live++;
+            }
+            paths.resize_live(live);
+        }
+};
+
+#endif
@@ -0,0 +1,151 @@
+#ifndef WORKER_PROCESS_H
+#define WORKER_PROCESS_H
+
+#include "framebuffer.h"
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Local worker processes for camera::render (POSIX fork and Unix socket pairs).
+// A fork()ed worker starts with a copy of the scene the parent has in memory, so nothing but tile
+// coordinates and pixel sums ever crosses its socket. Messages are in host byte order: both ends are
+// always the same program on the same machine.
+//
+//   parent -> worker: tile_rect                                   (render this tile)
+//   worker -> parent: tile_rect, 3 float sums and 1 uint32 count per pixel, row by row
+//                     (with RAYTRACER_STATS, preceded by the worker's render_stats for the tile)
+//
+// Closing the parent's end of the socket tells the worker to exit.
+
+struct tile_rect {
+    int32_t x0, y0, x1, y1;     // Pixels [x0, x1) x [y0, y1)
+
+    size_t pixels() const { return size_t(x1 - x0) * size_t(y1 - y0); }
+
+    bool operator==(const tile_rect& other) const {
+        return x0 == other.x0 && y0 == other.y0 && x1 == other.x1 && y1 == other.y1;
+    }
+};
+
+// Blocking socket I/O that finishes partial transfers; false if the other end is gone
+inline bool read_all(int fd, void* data, size_t size) {
+    char* p = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t n = ::read(fd, p, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= size_t(n);
+    }
+    return true;
+}
+
+inline bool write_all(int fd, const void* data, size_t size) {
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t n = ::write(fd, p, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= size_t(n);
+    }
+    return true;
+}
+
+inline bool send_tile_result(int fd, const tile_rect& tile, const framebuffer& image) {
+    std::vector<float> sums(3 * tile.pixels());
+    std::vector<uint32_t> counts(tile.pixels());
+    image.read_tile(tile.x0, tile.y0, tile.x1, tile.y1, sums.data(), counts.data());
+    return write_all(fd, &tile, sizeof tile)
+        && write_all(fd, sums.data(), sums.size() * sizeof(float))
+        && write_all(fd, counts.data(), counts.size() * sizeof(uint32_t));
+}
+
+// Reads the result for `expected` and adds it to image. Nothing is added unless the whole message arrived.
+inline bool receive_tile_result(int fd, const tile_rect& expected, framebuffer& image) {
+    tile_rect tile;
+    if (!read_all(fd, &tile, sizeof tile) || !(tile == expected))
+        return false;
+
+    std::vector<float> sums(3 * tile.pixels());
+    std::vector<uint32_t> counts(tile.pixels());
+    if (!read_all(fd, sums.data(), sums.size() * sizeof(float)) ||
+        !read_all(fd, counts.data(), counts.size() * sizeof(uint32_t)))
+        return false;
+
+    image.add_tile(tile.x0, tile.y0, tile.x1, tile.y1, sums.data(), counts.data());
+    return true;
+}
+
+// One fork()ed child and the parent's end of the socket connected to it
+class worker_process {
+    public:
+        worker_process() {}
+        ~worker_process() { stop(); }
+
+        worker_process(const worker_process&) = delete;
+        worker_process& operator=(const worker_process&) = delete;
+
+        // Forks a child that runs serve(socket) and then exits. False if the child could not be started.
+        // Flush buffered output first, or the child writes it a second time when it exits.
+        template <class Serve>
+        bool start(Serve&& serve) {
+            int fds[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+                return false;
+
+            pid_t child = fork();
+            if (child < 0) {
+                ::close(fds[0]);
+                ::close(fds[1]);
+                return false;
+            }
+            if (child == 0) {
+                ::close(fds[0]);
+                serve(fds[1]);
+                _exit(0);       // The parent's destructors and atexit handlers are not the child's to run
+            }
+
+            ::close(fds[1]);
+            fd = fds[0];
+            pid = child;
+            return true;
+        }
+
+        bool running() const { return fd >= 0; }
+        int socket() const { return fd; }
+        pid_t id() const { return pid; }
+
+        // Called in a newly forked sibling: drops its inherited copy of this worker's socket, which would
+        // otherwise keep the socket open after the parent closes it, and the worker would never see the end
+        void forget() {
+            if (fd >= 0) ::close(fd);
+            fd = -1;
+            pid = -1;
+        }
+
+        // Closes the socket and waits for the child to exit; a worker that failed is killed first
+        void stop(bool failed = false) {
+            if (fd >= 0) ::close(fd);
+            fd = -1;
+            if (pid > 0) {
+                if (failed) kill(pid, SIGKILL);
+                while (waitpid(pid, nullptr, 0) < 0 && errno == EINTR) {}
+            }
+            pid = -1;
+        }
+
+    private:
+        int fd = -1;
+        pid_t pid = -1;
+};
+
+#endif